@@ -1,3 +1,4 @@
+#include <cmath>
 #include <limits>
 #include <memory>
 #include <string>
@@ -38,10 +39,12 @@ bool Colormap::operator==(const Colormap& other)
 
 void Colormap::displaySettings()
 {
-    ImGui::DragFloat("Inverse Contrast", &radius);
+    if (ImGui::DragFloat("Inverse Contrast", &radius))
+        stopAutoScale();
     ImGui::SameLine();
     ImGui::ShowHelpMarker("Change the contrast/radius (shift + mouse wheel)");
-    ImGui::DragFloat3("Inverse Brightness", center.data());
+    if (ImGui::DragFloat3("Inverse Brightness", center.data()))
+        stopAutoScale();
     ImGui::SameLine();
     ImGui::ShowHelpMarker("Change the brightness/center (mouse wheel)");
 
@@ -96,6 +99,11 @@ std::array<float, 3> Colormap::getBias() const
     return bias;
 }
 
+float Colormap::getPrecision() const
+{
+    return std::abs(2.f * radius) / 1024.f;
+}
+
 void Colormap::autoCenterAndRadius(float min, float max)
 {
     if (min >= max) {
@@ -167,6 +175,14 @@ bool Colormap::setShader(const std::string& name)
     return false;
 }
 
+void Colormap::stopAutoScale()
+{
+    for (const auto& ptr : sequences) {
+        if (const auto& seq = ptr.lock())
+            seq->autoScale = false;
+    }
+}
+
 void Colormap::onSequenceAttach(std::weak_ptr<Sequence> s)
 {
     sequences.insert(std::move(s));
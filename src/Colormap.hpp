@@ -30,8 +30,12 @@ public:
     void getRange(std::array<float, 3>& min, std::array<float, 3>& max) const;
     std::array<float, 3> getScale() const;
     std::array<float, 3> getBias() const;
+    // a 1024th of the range of values mapped to the colors (see chooseTextureStorage)
+    float getPrecision() const;
 
     void autoCenterAndRadius(float min, float max);
+    // after a manual change of the contrast, so that the sequences do not adjust it again to the next frames
+    void stopAutoScale();
 
     void nextShader();
     void previousShader();
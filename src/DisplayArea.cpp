@@ -8,6 +8,7 @@
 #include "DisplayArea.hpp"
 #include "Image.hpp"
 #include "Sequence.hpp"
+#include "TextureCache.hpp"
 #include "View.hpp"
 #include "shaders.hpp"
 
@@ -24,15 +25,36 @@ static std::string checkerboardFragment = S(
 
 void DisplayArea::draw(const std::shared_ptr<Image>& image, ImVec2 pos, ImVec2 winSize,
     const Colormap& colormap, const View& view, float factor)
+{
+    ImagePreview whole;
+    if (image) {
+        whole.image = image;
+        whole.size = ImVec2(image->w, image->h);
+    }
+    draw(whole, pos, winSize, colormap, view, factor);
+}
+
+void DisplayArea::draw(const ImagePreview& preview, ImVec2 pos, ImVec2 winSize,
+    const Colormap& colormap, const View& view, float factor)
 {
     static std::shared_ptr<Shader::Program> checkerboard = createShader(checkerboardFragment);
 
     // update the texture if we have an image
-    if (image) {
-        ImVec2 imSize(image->w, image->h);
-        ImVec2 p1 = view.window2image(ImVec2(0, 0), imSize, winSize, factor);
-        ImVec2 p2 = view.window2image(winSize, imSize, winSize, factor);
-        requestTextureArea(image, ImRect(p1, p2), colormap.bands);
+    if (preview.image) {
+        if (texture->updateReadiness() && !texture->tiles.empty()) {
+            previous.texture = texture;
+            previous.origin = origin;
+            previous.step = step;
+            previous.frameSize = frameSize;
+        }
+        origin = preview.origin;
+        step = preview.step;
+        frameSize = preview.size;
+        ImVec2 p1 = view.window2image(ImVec2(0, 0), frameSize, winSize, factor);
+        ImVec2 p2 = view.window2image(winSize, frameSize, winSize, factor);
+        // the zoomed out images are streamed at a coarser level of detail
+        int level = chooseTextureLevel(view.zoom * factor * step);
+        requestTextureArea(preview.image, ImRect((p1 - origin) / step, (p2 - origin) / step), colormap.getPrecision(), level);
     }
 
     // draw a checkboard pattern
@@ -46,15 +68,41 @@ void DisplayArea::draw(const std::shared_ptr<Image>& image, ImVec2 pos, ImVec2 w
         ImGui::GetWindowDrawList()->AddCallback(ImGui::SetShaderCallback, nullptr);
     }
 
-    // display the texture
-    ImGui::ShaderUserData* userdata = new ImGui::ShaderUserData;
-    userdata->shader = colormap.shader;
-    userdata->scale = colormap.getScale();
-    userdata->bias = colormap.getBias();
-    ImGui::GetWindowDrawList()->AddCallback(ImGui::SetShaderCallback, userdata);
-    for (auto t : texture.tiles) {
-        ImVec2 TL = view.image2window(ImVec2(t.x, t.y), getCurrentSize(), winSize, factor);
-        ImVec2 BR = view.image2window(ImVec2(t.x + t.w, t.y + t.h), getCurrentSize(), winSize, factor);
+    // the tiles of a new frame are shown once they are all uploaded, the last complete frame is shown meanwhile
+    bool ready = texture->updateReadiness();
+    if (!ready && previous.texture && previous.texture != texture
+        && previous.frameSize.x == frameSize.x && previous.frameSize.y == frameSize.y
+        && previous.texture->layers == texture->layers) {
+        drawTexture(*previous.texture, previous.origin, previous.step, pos, winSize, colormap, view, factor);
+    } else {
+        drawTexture(*texture, origin, step, pos, winSize, colormap, view, factor);
+    }
+    ImGui::GetWindowDrawList()->AddCallback(ImGui::SetShaderCallback, nullptr);
+}
+
+void DisplayArea::drawTexture(const Texture& texture, ImVec2 textureOrigin, float textureStep, ImVec2 pos,
+    ImVec2 winSize, const Colormap& colormap, const View& view, float factor)
+{
+    if (const Texture* retired = texture.getRetired())
+        drawTexture(*retired, textureOrigin, textureStep, pos, winSize, colormap, view, factor);
+
+    // display the texture, the shader picks the bands in the layers of each tile
+    std::array<float, 3> bands;
+    std::array<float, 3> scale = colormap.getScale();
+    for (size_t i = 0; i < 3; i++) {
+        scale[i] *= getStorageNormalization(texture.storage);
+        size_t b = colormap.bands[i];
+        bands[i] = image && b < image->c ? b : -1;
+    }
+    // the last texels of a level can cover less pixels, they are drawn slightly past the border of the image
+    float texel = textureStep * (1 << texture.level);
+    for (const auto& t : texture.tiles) {
+        // only the part of the tile whose uploads have landed
+        ImRect ready = t.ready;
+        if (ready.GetWidth() <= 0 || ready.GetHeight() <= 0)
+            continue;
+        ImVec2 TL = view.image2window(textureOrigin + (ImVec2(t.x, t.y) + ready.Min) * texel, getCurrentSize(), winSize, factor);
+        ImVec2 BR = view.image2window(textureOrigin + (ImVec2(t.x, t.y) + ready.Max) * texel, getCurrentSize(), winSize, factor);
 
         TL += pos;
         BR += pos;
@@ -68,12 +116,19 @@ void DisplayArea::draw(const std::shared_ptr<Image>& image, ImVec2 pos, ImVec2 w
         if (BR.y < pos.y)
             continue;
 
-        ImGui::GetWindowDrawList()->AddImage((void*)(size_t)t.id, TL, BR);
+        ImGui::ShaderUserData* userdata = new ImGui::ShaderUserData;
+        userdata->shader = colormap.shader;
+        userdata->scale = scale;
+        userdata->bias = colormap.getBias();
+        userdata->layers = t.id;
+        userdata->bands = bands;
+        ImGui::GetWindowDrawList()->AddCallback(ImGui::SetShaderCallback, userdata);
+        ImVec2 tileSize(t.w, t.h);
+        ImGui::GetWindowDrawList()->AddImage(nullptr, TL, BR, ready.Min / tileSize, ready.Max / tileSize);
     }
-    ImGui::GetWindowDrawList()->AddCallback(ImGui::SetShaderCallback, nullptr);
 }
 
-void DisplayArea::requestTextureArea(const std::shared_ptr<Image>& image, ImRect rect, BandIndices bandidx)
+void DisplayArea::requestTextureArea(const std::shared_ptr<Image>& image, ImRect rect, float precision, int level)
 {
     rect.Expand(1.0f);
     rect.Floor();
@@ -81,33 +136,35 @@ void DisplayArea::requestTextureArea(const std::shared_ptr<Image>& image, ImRect
 
     bool reupload = false;
 
-    if (this->image != image) {
+    // the image may have been uploaded in advance (see prefetchTextures)
+    if (this->image != image || texture->level != level) {
         this->image = image;
-        loadedRect = ImRect();
-        reupload = true;
+        texture = TextureCache::get(image, level);
     }
 
+    ImRect loadedRect = texture->loadedRect;
     if (!loadedRect.Contains(rect)) {
         loadedRect.Add(rect);
-        loadedRect.Expand(128); // to avoid multiple uploads during zoom-out
+        loadedRect.Expand(128 << level); // to avoid multiple uploads during zoom-out
         loadedRect.ClipWithFull(ImRect(0, 0, image->w, image->h));
         reupload = true;
     }
 
-    if (loadedBands != bandidx) {
-        loadedBands = bandidx;
+    // half floats are replaced when the contrast is increased, but kept when it is decreased
+    if (texture->storage == TextureStorage::FLOAT16
+        && chooseTextureStorage(*image, precision) == TextureStorage::FLOAT32) {
         reupload = true;
     }
 
     if (reupload) {
-        texture.upload(*image, loadedRect, loadedBands);
+        texture->stream(image, loadedRect, precision, level);
     }
 }
 
 ImVec2 DisplayArea::getCurrentSize() const
 {
     if (image) {
-        return ImVec2(image->w, image->h);
+        return frameSize;
     }
     return ImVec2();
 }
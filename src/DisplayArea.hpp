@@ -11,23 +11,39 @@ struct View;
 struct Sequence;
 
 class DisplayArea {
-    Texture texture;
+    std::shared_ptr<Texture> texture; // shared with TextureCache
 
     std::shared_ptr<Image> image;
-    ImRect loadedRect;
-    BandIndices loadedBands;
+    // position of the texture in the displayed image, which differs when showing a preview
+    ImVec2 origin;
+    float step;
+    ImVec2 frameSize;
+    // the last texture whose tiles were all ready, drawn instead of the current one until it is ready too
+    // so that the frames are not mixed during the uploads
+    struct {
+        std::shared_ptr<Texture> texture;
+        ImVec2 origin;
+        float step = 1;
+        ImVec2 frameSize;
+    } previous;
 
 public:
     DisplayArea()
-        : image(nullptr)
-        , loadedBands(BANDS_DEFAULT)
+        : texture(std::make_shared<Texture>())
+        , image(nullptr)
+        , step(1)
     {
     }
 
     void draw(const std::shared_ptr<Image>& image, ImVec2 pos,
         ImVec2 winSize, const Colormap& colormap, const View& view, float factor);
+    void draw(const ImagePreview& preview, ImVec2 pos,
+        ImVec2 winSize, const Colormap& colormap, const View& view, float factor);
     ImVec2 getCurrentSize() const;
 
 private:
-    void requestTextureArea(const std::shared_ptr<Image>& image, ImRect rect, BandIndices bandidx);
+    // draws the ready areas of the tiles, above the retired tiles of the texture
+    void drawTexture(const Texture& texture, ImVec2 origin, float step, ImVec2 pos, ImVec2 winSize,
+        const Colormap& colormap, const View& view, float factor);
+    void requestTextureArea(const std::shared_ptr<Image>& image, ImRect rect, float precision, int level);
 };
@@ -41,11 +41,23 @@ void EditGUI::display(Sequence& seq, bool focus)
     for (int i = 0; i < nvars; i++) {
         std::string name = "$" + std::to_string(i + 1);
         if (ImGui::DragFloat(("##" + name).c_str(), &vars[i], 1.f, 0.f, 0.f, (name + ": %.3f").c_str())) {
+            pendingValidation = true;
+            lastVarsChange = ImGui::GetTime();
+        }
+    }
+
+    // dragging a variable changes it at each frame, and each value is a new program to compile and run
+    // so the edit is only rebuilt once the value settles or the drag is released
+    if (pendingValidation) {
+        if (!ImGui::IsMouseDown(0) || ImGui::GetTime() - lastVarsChange > EDIT_VARS_DEBOUNCE) {
             shouldValidate = true;
+        } else {
+            gActive = std::max(gActive, 2);
         }
     }
 
     if (shouldValidate) {
+        pendingValidation = false;
         validate(seq);
     }
 }
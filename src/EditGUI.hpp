@@ -7,10 +7,14 @@
 struct Sequence;
 
 #define MAX_VARS 10
+// delay (in seconds) without changes to the variables before the edit is rebuilt
+#define EDIT_VARS_DEBOUNCE 0.15
 
 class EditGUI {
     float vars[MAX_VARS];
     int nvars;
+    bool pendingValidation;
+    double lastVarsChange;
 
 public:
     std::string editprog;
@@ -18,6 +22,8 @@ public:
 
     EditGUI()
         : nvars(0)
+        , pendingValidation(false)
+        , lastVarsChange(0)
         , editprog()
         , edittype(PLAMBDA)
     {
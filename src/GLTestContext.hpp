@@ -0,0 +1,52 @@
+#pragma once
+
+#include <GL/gl3w.h>
+#include <SDL.h>
+#include <doctest.h>
+
+// a hidden window with an OpenGL 3.3 context, for the tests which need one
+// the tests are skipped when it is false, on a headless machine Mesa's software rasterizer can provide one with:
+// SDL_VIDEODRIVER=offscreen LIBGL_ALWAYS_SOFTWARE=1 ./tests
+// the textures and buffers have to be released before it is destroyed
+class GLTestContext {
+    bool initialized = false;
+    SDL_Window* window = nullptr;
+    SDL_GLContext context = nullptr;
+
+public:
+    GLTestContext()
+    {
+        if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+            MESSAGE("no video driver, skipped: " << SDL_GetError());
+            return;
+        }
+        initialized = true;
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_FORWARD_COMPATIBLE_FLAG);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+        window = SDL_CreateWindow("tests", 0, 0, 16, 16, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+        context = window ? SDL_GL_CreateContext(window) : nullptr;
+        if (!context || gl3wInit()) {
+            MESSAGE("no OpenGL 3.3 context, skipped: " << SDL_GetError());
+            if (context)
+                SDL_GL_DeleteContext(context);
+            context = nullptr;
+        }
+    }
+
+    ~GLTestContext()
+    {
+        if (context)
+            SDL_GL_DeleteContext(context);
+        if (window)
+            SDL_DestroyWindow(window);
+        if (initialized)
+            SDL_Quit();
+    }
+
+    GLTestContext(const GLTestContext&) = delete;
+    GLTestContext& operator=(const GLTestContext&) = delete;
+
+    explicit operator bool() const { return context != nullptr; }
+};
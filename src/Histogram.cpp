@@ -1,142 +1,109 @@
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <imgui.h>
 #include <vector>
 #define IMGUI_DEFINE_MATH_OPERATORS
 #include <imgui_internal.h>
 
+#include <doctest.h>
+
 #include "imgui_custom.hpp"
 
 #include "Colormap.hpp"
 #include "Histogram.hpp"
 #include "Image.hpp"
+#include "ImageCache.hpp"
+#include "ThreadPool.hpp"
 #include "globals.hpp"
+#include "testimages.hpp"
 
 namespace imscript {
-// a quad is a square cell bounded by 4 pixels
-// it knows its four values and its position on the original image
-struct quad {
-    float abcd[4];
-    int ij;
-};
-
-static int compare_floats(const void* a, const void* b)
-{
-    const float* da = (const float*)a;
-    const float* db = (const float*)b;
-    return (*da > *db) - (*da < *db);
-}
+// a cell is the square bounded by 4 neighboring pixels, inside which the values are interpolated
+// the histogram of the interpolated values is piecewise linear, so each cell adds 4 jumps
+// to its second derivative, which is integrated twice at the end
 
-static void sort_four_values(float* x)
+// sorting network, which keeps all the values even with NaN
+template <typename T>
+static void sort_four_values(T* x)
 {
-    qsort(x, 4, sizeof *x, compare_floats);
-}
-
-// copy the values of a square cell into an array, for easy access
-static void copy_cell_values(float q[4], float* x, int w, int h, int c, int i, int j)
-{
-    assert(0 <= i);
-    assert(i < w - 1);
-    assert(0 <= j);
-    assert(j < h - 1);
-    q[0] = x[((j + 0) * w + (i + 0)) * c];
-    q[1] = x[((j + 0) * w + (i + 1)) * c];
-    q[2] = x[((j + 1) * w + (i + 0)) * c];
-    q[3] = x[((j + 1) * w + (i + 1)) * c];
+    auto sort2 = [](T& a, T& b) {
+        if (b < a)
+            std::swap(a, b);
+    };
+    sort2(x[0], x[1]);
+    sort2(x[2], x[3]);
+    sort2(x[0], x[2]);
+    sort2(x[1], x[3]);
+    sort2(x[1], x[2]);
 }
 
-// obtain the histogram bin that corresponds to the given value
+// obtain the histogram bin that corresponds to the given value, -1 outside of [m, M]
 static int bin(int n, float m, float M, float x)
 {
+    if (!(m <= x && x <= M))
+        return -1;
     float f = (n - 1) * (x - m) / (M - m);
-    int r = std::lrint(f);
-    assert(m <= x);
-    assert(x <= M);
-    assert(0 <= r);
-    assert(r < n);
-    return r;
-}
-
-static int cell_is_degenerate(float m, float M, float q[4])
-{
-    for (int i = 0; i < 4; i++)
-        if (q[i] < m || q[i] > M)
-            return 1;
-    return !(q[0] < q[1] && q[1] < q[2] && q[2] < q[3]);
-}
-
-static void integrate_values(std::vector<std::array<long double, 2>>& o, int n)
-{
-    // TODO : multiply each increment by the span of the interval
-    for (int i = 1; i < n; i++)
-        o[i][1] += o[i - 1][1]; // * (o[i][0] - o[i-1][0]);
-    //o[0][1] = 0;
+    return std::lrint(f);
 }
 
-static void accumulate_jumps_for_one_cell(std::vector<std::array<long double, 2>>& o,
-    int n, float m, float M, float q[4])
+// q holds the sorted values of the cell and b their sorted bins
+static void accumulate_jumps_for_one_cell(double* o, const float q[4], const int b[4])
 {
     // discard degenerate cells
-    if (cell_is_degenerate(m, M, q))
+    if (b[0] < 0 || !(q[0] < q[1] && q[1] < q[2] && q[2] < q[3]))
         return;
-
-    // give nice names to numbers
-    float A = q[0];
-    float B = q[1];
-    float C = q[2];
-    float D = q[3];
-    int i_A = bin(n, m, M, A);
-    int i_B = bin(n, m, M, B);
-    int i_C = bin(n, m, M, C);
-    int i_D = bin(n, m, M, D);
-    A = i_A;
-    B = i_B;
-    C = i_C;
-    D = i_D;
-
-    if (i_A == i_B || i_B == i_C || i_C == i_D)
+    if (b[0] == b[1] || b[1] == b[2] || b[2] == b[3])
         return;
 
-    assert(i_A < i_B);
-    assert(i_B < i_C);
-    assert(i_C < i_D);
-
-    double fac = 1; //33333;
+    // give nice names to numbers
+    double A = b[0];
+    double B = b[1];
+    double C = b[2];
+    double D = b[3];
 
     // accumulate jumps
-    o[i_A][1] += fac * 2 / (C + D - B - A) / (B - A);
-    o[i_B][1] -= fac * 2 / (C + D - B - A) / (B - A);
-    o[i_C][1] -= fac * 2 / (C + D - B - A) / (D - C);
-    o[i_D][1] += fac * 2 / (C + D - B - A) / (D - C);
+    o[b[0]] += 2 / (C + D - B - A) / (B - A);
+    o[b[1]] -= 2 / (C + D - B - A) / (B - A);
+    o[b[2]] -= 2 / (C + D - B - A) / (D - C);
+    o[b[3]] += 2 / (C + D - B - A) / (D - C);
 }
 
-static void fill_continuous_histogram_simple(
-    std::vector<std::array<long double, 2>>& o, // output histogram array of (value,density) pairs
-    int n, // requested number of bins for the histogram
-    float m, // requested minimum of the histogram
-    float M, // requested maximum of the histogram
-    float* x, // input image data
-    int w, // input image width
-    int h, // input image height
-    int c)
+// accumulates the jumps of the cells of the rows j0..j1 whose corners are in the columns x0..x1
+// x points to the channel of the image, which has c channels
+static void accumulate_jumps(double* o, int n, float m, float M, const float* x, size_t w, size_t c,
+    size_t x0, size_t x1, size_t j0, size_t j1)
 {
-    // initialize bins (n equidistant points between m and M)
-    for (int i = 0; i < n; i++) {
-        o[i][0] = m + i * (M - m) / n;
-        o[i][1] = 0;
-    }
-
-    // compute 2nd derivative of histogram
-    for (int j = 0; j < h - 1; j++)
-        for (int i = 0; i < w - 1; i++) {
-            float q[4]; // here we store the 4 values of the cell at (i,j)
-            copy_cell_values(q, x, w, h, c, i, j);
+    // each pixel is a corner of 4 cells, so its bin is computed once per row
+    size_t len = x1 - x0;
+    std::vector<int> bins0(len);
+    std::vector<int> bins1(len);
+    for (size_t i = 0; i < len; i++)
+        bins0[i] = bin(n, m, M, x[(j0 * w + x0 + i) * c]);
+    for (size_t j = j0; j < j1; j++) {
+        const float* row0 = x + (j * w + x0) * c;
+        const float* row1 = row0 + w * c;
+        for (size_t i = 0; i < len; i++)
+            bins1[i] = bin(n, m, M, row1[i * c]);
+        for (size_t i = 0; i + 1 < len; i++) {
+            float q[4] = { row0[i * c], row0[(i + 1) * c], row1[i * c], row1[(i + 1) * c] };
+            int b[4] = { bins0[i], bins0[i + 1], bins1[i], bins1[i + 1] };
+            // the bins grow with the values, so they can be sorted separately
             sort_four_values(q);
-            accumulate_jumps_for_one_cell(o, n, m, M, q);
+            sort_four_values(b);
+            accumulate_jumps_for_one_cell(o, q, b);
         }
+        std::swap(bins0, bins1);
+    }
+}
 
-    // integrate twice
-    integrate_values(o, n);
-    integrate_values(o, n);
+static void integrate_values(std::vector<double>& o)
+{
+    // TODO : multiply each increment by the span of the interval
+    for (size_t i = 1; i < o.size(); i++)
+        o[i] += o[i - 1];
 }
 }
 
@@ -150,9 +117,11 @@ void Histogram::request(std::shared_ptr<Image> image, Mode mode, ImRect region)
         region.Max.x = image->w;
         region.Max.y = image->h;
     }
+    region.ClipWithFull(ImRect(0, 0, image->w, image->h));
     if (image == img && min == this->min && max == this->max && mode == this->mode && region == this->region)
         return;
     loaded = false;
+    generation++;
     this->mode = mode;
     this->min = min;
     this->max = max;
@@ -162,12 +131,20 @@ void Histogram::request(std::shared_ptr<Image> image, Mode mode, ImRect region)
 
     values.clear();
     values.resize(image->c);
+    jumps.assign(mode == Mode::SMOOTH ? image->c : 0, std::vector<double>(nbins));
 
     for (size_t d = 0; d < image->c; d++) {
         auto& histogram = values[d];
         histogram.clear();
         histogram.resize(nbins);
     }
+
+    // the histograms of the selection are immediate once the integral histogram is built
+    std::shared_ptr<IntegralHistogram> integral = image->integralHistogram;
+    if (mode == Mode::EXACT && integral && integral->nbins == nbins && integral->query(region, values)) {
+        curh = region.GetHeight();
+        loaded = true;
+    }
 }
 
 float Histogram::getProgressPercentage() const
@@ -177,68 +154,428 @@ float Histogram::getProgressPercentage() const
         return 1.f;
     if (!image)
         return 0.f;
+    std::lock_guard<std::recursive_mutex> _lock(lock);
     return (float)curh / region.GetHeight();
 }
 
-void Histogram::progress()
+// pixels counted by each progress() call, so that a new request() is taken into account quickly
+#define HISTOGRAM_CHUNK_PIXELS (1 << 22)
+#define HISTOGRAM_BLOCK 256
+
+// counts the samples of the columns x0..x1 of a row in bins, which holds nbins bins per channel
+static void count_exact_row(long* bins, int nbins, const float* pixels, size_t w, size_t c,
+    size_t x0, size_t x1, size_t y, float min, float f)
 {
-    std::vector<std::vector<long>> valuescopy;
-    size_t oldh;
-    {
-        std::lock_guard<std::recursive_mutex> _lock(lock);
-        valuescopy = values;
-        oldh = curh;
+    const float* row = pixels + (y * w + x0) * c;
+    size_t n = (x1 - x0) * c;
+    size_t d = 0;
+    for (size_t k = 0; k < n; k += HISTOGRAM_BLOCK) {
+        size_t len = std::min<size_t>(HISTOGRAM_BLOCK, n - k);
+        // the bins are computed apart from the counting so that this loop is vectorized
+        // the values in ]-1, 0[ are truncated to the first bin, NaN is not counted
+        int idx[HISTOGRAM_BLOCK];
+        for (size_t l = 0; l < len; l++) {
+            float b = (row[k + l] - min) * f;
+            idx[l] = b > -1.f && b < nbins ? (int)b : -1;
+        }
+        for (size_t l = 0; l < len; l++) {
+            if (idx[l] >= 0)
+                bins[d * nbins + idx[l]]++;
+            if (++d == c)
+                d = 0;
+        }
     }
+}
 
+void Histogram::progress()
+{
     std::shared_ptr<Image> image = this->image.lock();
     if (!image)
         return;
 
+    size_t gen, y0;
+    Mode mode;
+    float min, max;
+    ImRect region;
+    {
+        std::lock_guard<std::recursive_mutex> _lock(lock);
+        if (loaded)
+            return;
+        gen = generation;
+        y0 = curh;
+        mode = this->mode;
+        min = this->min;
+        max = this->max;
+        region = this->region;
+    }
+
+    size_t c = image->c;
+    size_t minx = region.Min.x;
+    size_t maxx = region.Max.x;
+    size_t miny = region.Min.y;
+    size_t height = region.GetHeight();
+    // the SMOOTH histogram counts the cells between the rows
+    size_t rows = mode == Mode::SMOOTH && height > 0 ? height - 1 : height;
+    size_t y1 = std::min(rows, y0 + std::max<size_t>(1, HISTOGRAM_CHUNK_PIXELS / std::max<size_t>(1, maxx - minx)));
+
+    // each band of rows is counted in private bins, which are summed at the end
+    ThreadPool& pool = getThreadPool();
+    int nbands = std::min<int>(y1 - y0, pool.getConcurrency());
+    std::vector<long> counts(c * nbins);
+    std::vector<double> chunkjumps(c * nbins);
     if (mode == Mode::EXACT) {
-        size_t minh = region.Min.y;
-        size_t minx = region.Min.x;
-        size_t maxx = region.Max.x;
-        for (size_t d = 0; d < image->c; d++) {
-            auto& histogram = valuescopy[d];
-            // nbins-1 because we want the last bin to end at 'max' and not start at 'max'
-            float f = (nbins - 1) / (max - min);
-            for (size_t i = minx; i < maxx; i++) {
-                // TODO: sometimes it crashes here
-                int bin = (image->pixels[((minh + curh) * image->w + i) * image->c + d] - min) * f;
-                if (bin >= 0 && bin < nbins) {
-                    histogram[bin]++;
-                }
-            }
-        }
+        std::vector<std::vector<long>> bands(nbands, std::vector<long>(c * nbins));
+        // nbins-1 because we want the last bin to end at 'max' and not start at 'max'
+        float f = (nbins - 1) / (max - min);
+        pool.parallelFor(nbands, [&](int band) {
+            size_t b0 = y0 + (y1 - y0) * band / nbands;
+            size_t b1 = y0 + (y1 - y0) * (band + 1) / nbands;
+            for (size_t y = b0; y < b1; y++)
+                count_exact_row(bands[band].data(), nbins, image->pixels, image->w, c, minx, maxx, miny + y, min, f);
+        });
+        for (const auto& bins : bands)
+            for (size_t i = 0; i < counts.size(); i++)
+                counts[i] += bins[i];
     } else if (mode == Mode::SMOOTH) {
-        std::vector<std::array<long double, 2>> bins(3 + nbins);
-        for (size_t d = 0; d < image->c; d++) {
-            imscript::fill_continuous_histogram_simple(bins, nbins, min, max, image->pixels + d,
-                image->w, image->h, image->c);
-            for (int b = 0; b < nbins; b++) {
-                valuescopy[d][b] = bins[b][1];
-            }
-        }
+        std::vector<std::vector<double>> bands(nbands, std::vector<double>(c * nbins));
+        pool.parallelFor(nbands, [&](int band) {
+            size_t b0 = y0 + (y1 - y0) * band / nbands;
+            size_t b1 = y0 + (y1 - y0) * (band + 1) / nbands;
+            for (size_t d = 0; d < c; d++)
+                imscript::accumulate_jumps(bands[band].data() + d * nbins, nbins, min, max, image->pixels + d,
+                    image->w, c, minx, maxx, miny + b0, miny + b1);
+        });
+        for (const auto& bins : bands)
+            for (size_t i = 0; i < chunkjumps.size(); i++)
+                chunkjumps[i] += bins[i];
     }
 
     {
         std::lock_guard<std::recursive_mutex> _lock(lock);
-        if (oldh != curh) {
+        if (gen != generation) {
             // someone called request()
             return;
         }
-        if (mode == Mode::EXACT) {
-            curh++;
-        } else {
-            curh = region.GetHeight();
+        for (size_t d = 0; d < c; d++) {
+            if (mode == Mode::EXACT) {
+                for (int b = 0; b < nbins; b++) {
+                    values[d][b] += counts[d * nbins + b];
+                }
+            } else {
+                // the partial histogram is shown while the rest is counted
+                for (int b = 0; b < nbins; b++) {
+                    jumps[d][b] += chunkjumps[d * nbins + b];
+                }
+                std::vector<double> integrated = jumps[d];
+                imscript::integrate_values(integrated);
+                imscript::integrate_values(integrated);
+                for (int b = 0; b < nbins; b++) {
+                    values[d][b] = integrated[b];
+                }
+            }
         }
-
-        if (curh == region.GetHeight()) {
+        curh = y1 == rows ? height : y1;
+        if (curh == height) {
             loaded = true;
         }
+    }
+}
 
-        values = valuescopy;
+// the table takes about 1/8 of the memory of the image
+#define INTEGRAL_HISTOGRAM_RATIO 8
+
+IntegralHistogram::~IntegralHistogram()
+{
+    ImageCache::countExtraBytes(-(ptrdiff_t)getBytes());
+}
+
+void IntegralHistogram::request(std::shared_ptr<Image> image)
+{
+    if (this->image.lock() == image)
+        return;
+    // query reads the state only once loaded is set again by progress
+    loaded.store(false, std::memory_order_release);
+    this->image = image;
+    curgy = 0;
+    // a block of block*block pixels has as many samples as its corner has bins (times the ratio)
+    // the samples and the bins are both 4 bytes
+    w = image->w;
+    h = image->h;
+    block = std::max<size_t>(16, std::ceil(std::sqrt(nbins * INTEGRAL_HISTOGRAM_RATIO)));
+    gw = (image->w + block - 1) / block;
+    gh = (image->h + block - 1) / block;
+    ptrdiff_t previous = getBytes();
+    table.assign((gw + 1) * (gh + 1) * image->c * nbins, 0);
+    ImageCache::countExtraBytes((ptrdiff_t)getBytes() - previous);
+}
+
+size_t IntegralHistogram::cornerX(size_t gx) const
+{
+    return std::min(gx * block, w);
+}
+
+size_t IntegralHistogram::cornerY(size_t gy) const
+{
+    return std::min(gy * block, h);
+}
+
+const uint32_t* IntegralHistogram::corner(size_t gx, size_t gy) const
+{
+    size_t stride = table.size() / ((gw + 1) * (gh + 1));
+    return &table[(gy * (gw + 1) + gx) * stride];
+}
+
+float IntegralHistogram::getProgressPercentage() const
+{
+    if (loaded)
+        return 1.f;
+    return gh ? (float)curgy / gh : 0.f;
+}
+
+void IntegralHistogram::progress()
+{
+    std::shared_ptr<Image> image = this->image.lock();
+    if (!image || loaded)
+        return;
+
+    // one row of blocks at a time, each block counted on its own thread
+    size_t gy = curgy;
+    size_t c = image->c;
+    size_t stride = c * nbins;
+    std::vector<long> blocks(gw * stride);
+    float f = (nbins - 1) / (image->max - image->min);
+    getThreadPool().parallelFor(gw, [&](int gx) {
+        for (size_t y = cornerY(gy); y < cornerY(gy + 1); y++)
+            count_exact_row(&blocks[gx * stride], nbins, image->pixels, image->w, c,
+                cornerX(gx), cornerX(gx + 1), y, image->min, f);
+    });
+
+    // the corners below the row are the corners above plus the blocks on their left
+    std::vector<long> row(stride);
+    uint32_t* above = &table[gy * (gw + 1) * stride];
+    uint32_t* below = above + (gw + 1) * stride;
+    for (size_t gx = 0; gx < gw; gx++) {
+        for (size_t i = 0; i < stride; i++) {
+            row[i] += blocks[gx * stride + i];
+            below[(gx + 1) * stride + i] = above[(gx + 1) * stride + i] + row[i];
+        }
+    }
+
+    curgy = gy + 1;
+    if (curgy == gh)
+        loaded.store(true, std::memory_order_release);
+}
+
+bool IntegralHistogram::query(ImRect region, std::vector<std::vector<long>>& values) const
+{
+    // the table and the image are complete once loaded is seen
+    if (!loaded.load(std::memory_order_acquire))
+        return false;
+    std::shared_ptr<Image> image = this->image.lock();
+    if (!image)
+        return false;
+
+    size_t x0 = region.Min.x;
+    size_t y0 = region.Min.y;
+    size_t x1 = region.Max.x;
+    size_t y1 = region.Max.y;
+    size_t c = image->c;
+    float f = (nbins - 1) / (image->max - image->min);
+    std::vector<long> counts(c * nbins);
+    auto count = [&](size_t xa, size_t xb, size_t ya, size_t yb) {
+        for (size_t y = ya; y < yb; y++)
+            count_exact_row(counts.data(), nbins, image->pixels, image->w, c, xa, xb, y, image->min, f);
+    };
+
+    // corners of the blocks inside the region
+    size_t bx0 = (x0 + block - 1) / block;
+    size_t by0 = (y0 + block - 1) / block;
+    size_t bx1 = x1 == w ? gw : x1 / block;
+    size_t by1 = y1 == h ? gh : y1 / block;
+    if (bx0 >= bx1 || by0 >= by1) {
+        count(x0, x1, y0, y1);
+    } else {
+        const uint32_t* a = corner(bx0, by0);
+        const uint32_t* b = corner(bx1, by0);
+        const uint32_t* cc = corner(bx0, by1);
+        const uint32_t* d = corner(bx1, by1);
+        for (size_t i = 0; i < counts.size(); i++)
+            counts[i] = (long)d[i] - b[i] - cc[i] + a[i];
+        size_t X0 = cornerX(bx0), X1 = cornerX(bx1);
+        size_t Y0 = cornerY(by0), Y1 = cornerY(by1);
+        count(x0, x1, y0, Y0);
+        count(x0, x1, Y1, y1);
+        count(x0, X0, Y0, Y1);
+        count(X1, x1, Y0, Y1);
+    }
+
+    for (size_t d = 0; d < c && d < values.size(); d++)
+        for (int i = 0; i < nbins && i < (int)values[d].size(); i++)
+            values[d][i] += counts[d * nbins + i];
+    return true;
+}
+
+// the histogram answers the quantiles when its bins are smaller than this fraction of their range
+#define QUANTILE_HISTOGRAM_PRECISION 128
+
+// the order of the keys as unsigned integers is the order of the values
+static uint32_t sortable_key(float v)
+{
+    uint32_t u;
+    std::memcpy(&u, &v, sizeof(u));
+    return u & 0x80000000u ? ~u : u | 0x80000000u;
+}
+
+static float key_value(uint32_t k)
+{
+    uint32_t u = k & 0x80000000u ? k & 0x7fffffffu : ~k;
+    float v;
+    std::memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+// the values of a given rank are found by counting the keys on 12, 12 and 8 bits
+static const int RADIX_BITS[] = { 12, 12, 8 };
+
+struct RadixSelection {
+    size_t rank; // among the values whose key starts with prefix
+    uint32_t prefix;
+    uint32_t mask;
+};
+
+// counts the finite values whose key starts with the prefix of each selection, on the bits after shift
+static std::vector<std::vector<size_t>> count_keys(const Image& image, const std::vector<size_t>& bands,
+    const ImRect& region, const std::vector<RadixSelection>& selections, int shift, int bits)
+{
+    size_t nbins = (size_t)1 << bits;
+    size_t x0 = region.Min.x;
+    size_t x1 = region.Max.x;
+    size_t y0 = region.Min.y;
+    size_t y1 = region.Max.y;
+    size_t nsel = selections.size();
+
+    ThreadPool& pool = getThreadPool();
+    int nbands = std::max<int>(1, std::min<int>(y1 - y0, pool.getConcurrency()));
+    std::vector<std::vector<size_t>> counts(nbands, std::vector<size_t>(nsel * nbins));
+    pool.parallelFor(nbands, [&](int band) {
+        size_t* bins = counts[band].data();
+        size_t b0 = y0 + (y1 - y0) * band / nbands;
+        size_t b1 = y0 + (y1 - y0) * (band + 1) / nbands;
+        for (size_t y = b0; y < b1; y++) {
+            for (size_t d : bands) {
+                const float* row = image.pixels + y * image.w * image.c + d;
+                for (size_t x = x0; x < x1; x++) {
+                    float v = row[x * image.c];
+                    if (!std::isfinite(v))
+                        continue;
+                    uint32_t k = sortable_key(v);
+                    for (size_t s = 0; s < nsel; s++) {
+                        if ((k & selections[s].mask) == selections[s].prefix)
+                            bins[s * nbins + ((k >> shift) & (nbins - 1))]++;
+                    }
+                }
+            }
+        }
+    });
+
+    std::vector<std::vector<size_t>> result(nsel, std::vector<size_t>(nbins));
+    for (const auto& bins : counts)
+        for (size_t s = 0; s < nsel; s++)
+            for (size_t i = 0; i < nbins; i++)
+                result[s][i] += bins[s * nbins + i];
+    return result;
+}
+
+// finds the bin of the value of the given rank, and the rank of the value in this bin
+static size_t select_bin(const std::vector<size_t>& counts, size_t& rank)
+{
+    size_t bin = 0;
+    while (bin + 1 < counts.size() && rank >= counts[bin])
+        rank -= counts[bin++];
+    return bin;
+}
+
+static bool radix_quantiles(const Image& image, const std::vector<size_t>& bands, const ImRect& region,
+    float quantile, float& low, float& high)
+{
+    std::vector<RadixSelection> selections(1, RadixSelection { 0, 0, 0 });
+    int shift = 32;
+    for (int bits : RADIX_BITS) {
+        shift -= bits;
+        std::vector<std::vector<size_t>> counts = count_keys(image, bands, region, selections, shift, bits);
+        if (selections.size() == 1) {
+            // the first pass counts all the values, which gives the ranks
+            size_t n = 0;
+            for (size_t c : counts[0])
+                n += c;
+            if (n == 0)
+                return false;
+            size_t lowrank = std::min<size_t>(n - 1, quantile * n);
+            size_t highrank = std::min<size_t>(n - 1, (1 - quantile) * n);
+            selections = { { lowrank, 0, 0 }, { highrank, 0, 0 } };
+            counts.push_back(counts[0]);
+        }
+        for (size_t s = 0; s < selections.size(); s++) {
+            uint32_t bin = select_bin(counts[s], selections[s].rank);
+            selections[s].prefix |= bin << shift;
+            selections[s].mask |= (((uint32_t)1 << bits) - 1) << shift;
+        }
     }
+    low = key_value(selections[0].prefix);
+    high = key_value(selections[1].prefix);
+    return true;
+}
+
+// values are the EXACT histograms of the bands between min and max
+static bool histogram_quantiles(const std::vector<std::vector<long>>& values, float min, float max,
+    const std::vector<size_t>& bands, float quantile, float& low, float& high)
+{
+    size_t nbins = values[0].size();
+    std::vector<size_t> counts(nbins);
+    for (size_t d : bands)
+        for (size_t i = 0; i < nbins; i++)
+            counts[i] += values[d][i];
+    size_t n = 0;
+    for (size_t c : counts)
+        n += c;
+    if (n == 0)
+        return false;
+
+    size_t lowrank = std::min<size_t>(n - 1, quantile * n);
+    size_t highrank = std::min<size_t>(n - 1, (1 - quantile) * n);
+    float width = (max - min) / (nbins - 1);
+    low = min + select_bin(counts, lowrank) * width;
+    high = min + select_bin(counts, highrank) * width;
+    return width * QUANTILE_HISTOGRAM_PRECISION <= high - low;
+}
+
+bool compute_quantiles(const std::shared_ptr<Image>& image, const std::vector<size_t>& bands, ImRect region,
+    float quantile, float& low, float& high)
+{
+    ImRect full(0, 0, image->w, image->h);
+    if (region.Min.x == 0 && region.Min.y == 0 && region.Max.x == 0 && region.Max.y == 0)
+        region = full;
+    region.ClipWithFull(full);
+    if (bands.empty() || region.GetWidth() <= 0 || region.GetHeight() <= 0)
+        return false;
+
+    // the histograms of the whole image are computed when it is loaded,
+    // and the histograms of the regions are immediate once the integral histogram is built
+    std::vector<std::vector<long>> values;
+    std::shared_ptr<Histogram> histogram = image->histogram;
+    std::shared_ptr<IntegralHistogram> integral = image->integralHistogram;
+    if (histogram && histogram->isLoaded() && histogram->mode == Histogram::Mode::EXACT
+        && histogram->image.lock() == image && histogram->region == region) {
+        values = histogram->values;
+    } else if (integral && integral->isLoaded()) {
+        values.assign(image->c, std::vector<long>(integral->nbins));
+        if (!integral->query(region, values))
+            values.clear();
+    }
+    if (!values.empty() && histogram_quantiles(values, image->min, image->max, bands, quantile, low, high))
+        return true;
+
+    return radix_quantiles(*image, bands, region, quantile, low, high);
 }
 
 void Histogram::draw(const Colormap& colormap, const float* highlights)
@@ -305,3 +642,171 @@ void Histogram::draw(const Colormap& colormap, const float* highlights)
             ImVec2(ImGui::GetWindowWidth() - 10, 6), bg, col);
     }
 }
+
+TEST_CASE("Histogram exact")
+{
+    size_t w = 301;
+    size_t h = 257;
+    size_t c = 3;
+    auto image = makeTestImage(w, h, c, [&](size_t i) { return i == (20 * w + 30) * c ? NAN : std::sin(i * 0.37f) * 100; });
+    const float* pixels = image->pixels;
+
+    for (ImRect region : { ImRect(0, 0, 0, 0), ImRect(13, 7, 250, 200) }) {
+        Histogram histogram;
+        histogram.request(image, Histogram::Mode::EXACT, region);
+        while (!histogram.isLoaded())
+            histogram.progress();
+
+        ImRect r = histogram.region;
+        std::vector<std::vector<long>> expected(c, std::vector<long>(histogram.nbins));
+        float f = (histogram.nbins - 1) / (image->max - image->min);
+        for (size_t y = r.Min.y; y < r.Max.y; y++) {
+            for (size_t x = r.Min.x; x < r.Max.x; x++) {
+                for (size_t d = 0; d < c; d++) {
+                    float v = pixels[(y * w + x) * c + d];
+                    int bin = std::isnan(v) ? -1 : (v - image->min) * f;
+                    if (bin >= 0 && bin < histogram.nbins)
+                        expected[d][bin]++;
+                }
+            }
+        }
+        CHECK(histogram.values == expected);
+    }
+}
+
+TEST_CASE("IntegralHistogram")
+{
+    size_t w = 517;
+    size_t h = 389;
+    size_t c = 2;
+    auto image = makeTestImage(w, h, c, [&](size_t i) { return i == (20 * w + 30) * c ? NAN : std::sin(i * 0.37f) * 100; });
+    const float* pixels = image->pixels;
+    image->integralHistogram->request(image);
+    while (!image->integralHistogram->isLoaded())
+        image->integralHistogram->progress();
+
+    for (ImRect region : { ImRect(0, 0, w, h), ImRect(13, 7, 250, 200), ImRect(0, 100, 517, 389),
+             ImRect(3, 5, 20, 30), ImRect(90, 90, 91, 389) }) {
+        INFO(region.Min.x << "," << region.Min.y << " " << region.Max.x << "," << region.Max.y);
+        Histogram exact;
+        exact.request(image, Histogram::Mode::EXACT, region);
+        std::vector<std::vector<long>> values(c, std::vector<long>(exact.nbins));
+        CHECK(image->integralHistogram->query(region, values));
+        CHECK(exact.isLoaded());
+
+        std::vector<std::vector<long>> expected(c, std::vector<long>(exact.nbins));
+        float f = (exact.nbins - 1) / (image->max - image->min);
+        for (size_t y = region.Min.y; y < region.Max.y; y++) {
+            for (size_t x = region.Min.x; x < region.Max.x; x++) {
+                for (size_t d = 0; d < c; d++) {
+                    float v = pixels[(y * w + x) * c + d];
+                    int bin = std::isnan(v) ? -1 : (v - image->min) * f;
+                    if (bin >= 0 && bin < exact.nbins)
+                        expected[d][bin]++;
+                }
+            }
+        }
+        CHECK(values == expected);
+        CHECK(exact.values == expected);
+    }
+
+    // about 1/8 of the image, the blocks on the borders are partial
+    CHECK(image->integralHistogram->getBytes() < w * h * c * sizeof(float) / 4);
+}
+
+TEST_CASE("quantiles")
+{
+    size_t w = 301;
+    size_t h = 203;
+    size_t c = 3;
+    auto image = makeTestImage(w, h, c, [](size_t i) {
+        return i == 7 ? NAN : i == 8 ? INFINITY : std::tan(i * 0.71f) * (i % 3 ? -1 : 1);
+    });
+    const float* pixels = image->pixels;
+
+    auto reference = [&](const std::vector<size_t>& bands, ImRect region, float quantile, float& low, float& high) {
+        std::vector<float> all;
+        for (size_t d : bands)
+            for (size_t y = region.Min.y; y < region.Max.y; y++)
+                for (size_t x = region.Min.x; x < region.Max.x; x++)
+                    if (std::isfinite(pixels[(y * w + x) * c + d]))
+                        all.push_back(pixels[(y * w + x) * c + d]);
+        std::sort(all.begin(), all.end());
+        low = all[quantile * all.size()];
+        high = all[(1 - quantile) * all.size()];
+    };
+
+    for (ImRect region : { ImRect(0, 0, w, h), ImRect(5, 17, 120, 203), ImRect(300, 0, 301, 1) }) {
+        for (float quantile : { 0.001f, 0.05f, 0.3f }) {
+            for (std::vector<size_t> bands : { std::vector<size_t> { 0, 1, 2 }, std::vector<size_t> { 1 } }) {
+                float low, high, rlow, rhigh;
+                REQUIRE(compute_quantiles(image, bands, region, quantile, low, high));
+                reference(bands, region, quantile, rlow, rhigh);
+                CHECK(low == rlow);
+                CHECK(high == rhigh);
+            }
+        }
+    }
+
+    // the values of 8-bit images are read from the histogram
+    auto image8 = makeTestImage(w, h, c, [](size_t i) { return (i * 7919) % 256; });
+    pixels = image8->pixels;
+    image8->histogram->request(image8, Histogram::Mode::EXACT);
+    while (!image8->histogram->isLoaded())
+        image8->histogram->progress();
+    float low, high, rlow, rhigh;
+    REQUIRE(compute_quantiles(image8, { 0, 1, 2 }, ImRect(0, 0, 0, 0), 0.05f, low, high));
+    reference({ 0, 1, 2 }, ImRect(0, 0, w, h), 0.05f, rlow, rhigh);
+    CHECK(low == rlow);
+    CHECK(high == rhigh);
+}
+
+TEST_CASE("Histogram smooth")
+{
+    size_t w = 203;
+    size_t h = 151;
+    size_t c = 2;
+    auto image = makeTestImage(w, h, c, [&](size_t i) { return i == (20 * w + 30) * c ? NAN : std::sin(i * 0.37f) * 100 + (i % 7); });
+    const float* pixels = image->pixels;
+
+    for (ImRect region : { ImRect(0, 0, 0, 0), ImRect(13, 7, 150, 100) }) {
+        Histogram histogram;
+        histogram.request(image, Histogram::Mode::SMOOTH, region);
+        while (!histogram.isLoaded())
+            histogram.progress();
+
+        // the cells sorted one by one, as in imscript
+        ImRect r = histogram.region;
+        int n = histogram.nbins;
+        float m = image->min;
+        float M = image->max;
+        for (size_t d = 0; d < c; d++) {
+            std::vector<long double> o(n);
+            for (size_t j = r.Min.y; j + 1 < r.Max.y; j++) {
+                for (size_t i = r.Min.x; i + 1 < r.Max.x; i++) {
+                    float q[4] = { pixels[(j * w + i) * c + d], pixels[(j * w + i + 1) * c + d],
+                        pixels[((j + 1) * w + i) * c + d], pixels[((j + 1) * w + i + 1) * c + d] };
+                    if (std::any_of(q, q + 4, [&](float v) { return !(v >= m && v <= M); }))
+                        continue;
+                    std::sort(q, q + 4);
+                    if (!(q[0] < q[1] && q[1] < q[2] && q[2] < q[3]))
+                        continue;
+                    long double b[4];
+                    for (int k = 0; k < 4; k++)
+                        b[k] = std::lrint((n - 1) * (q[k] - m) / (M - m));
+                    if (b[0] == b[1] || b[1] == b[2] || b[2] == b[3])
+                        continue;
+                    o[b[0]] += 2 / (b[2] + b[3] - b[1] - b[0]) / (b[1] - b[0]);
+                    o[b[1]] -= 2 / (b[2] + b[3] - b[1] - b[0]) / (b[1] - b[0]);
+                    o[b[2]] -= 2 / (b[2] + b[3] - b[1] - b[0]) / (b[3] - b[2]);
+                    o[b[3]] += 2 / (b[2] + b[3] - b[1] - b[0]) / (b[3] - b[2]);
+                }
+            }
+            for (int pass = 0; pass < 2; pass++)
+                for (int i = 1; i < n; i++)
+                    o[i] += o[i - 1];
+            for (int i = 0; i < n; i++)
+                CHECK(std::abs(histogram.values[d][i] - (long)o[i]) <= 1);
+        }
+    }
+}
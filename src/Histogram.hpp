@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include <vector>
@@ -15,8 +16,10 @@ struct Colormap;
 
 class Histogram : public Progressable {
 private:
-    bool loaded;
+    std::atomic<bool> loaded;
     mutable std::recursive_mutex lock;
+    size_t generation; // incremented by request(), to drop the work started before
+    std::vector<std::vector<double>> jumps; // second derivative of the SMOOTH histogram
 
 public:
     enum class Mode {
@@ -26,13 +29,14 @@ public:
     float min, max;
     std::vector<std::vector<long>> values;
     std::weak_ptr<Image> image;
-    size_t curh;
+    std::atomic<size_t> curh; // rows of the region already counted
     const int nbins;
     ImRect region;
 
 public:
     Histogram()
         : loaded(true)
+        , generation(0)
         , image(std::weak_ptr<Image>())
         , curh(0)
         , nbins(256)
@@ -53,3 +57,62 @@ public:
 
     void draw(const Colormap& colormap, const float* highlights);
 };
+
+// summed-area table of the EXACT histograms of an image, on a grid of blocks
+// the histogram of any region is read from the blocks it covers, and only its borders are counted
+class IntegralHistogram : public Progressable {
+    std::atomic<bool> loaded;
+    std::weak_ptr<Image> image;
+    size_t w, h;
+    size_t block;
+    size_t gw, gh; // number of blocks
+    std::atomic<size_t> curgy; // rows of blocks already summed
+    // counts of the pixels above and left of each corner of the grid, nbins per band
+    std::vector<uint32_t> table;
+
+    size_t cornerX(size_t gx) const;
+    size_t cornerY(size_t gy) const;
+    const uint32_t* corner(size_t gx, size_t gy) const;
+
+public:
+    const int nbins;
+
+    IntegralHistogram()
+        : loaded(false)
+        , w(0)
+        , h(0)
+        , block(0)
+        , gw(0)
+        , gh(0)
+        , curgy(0)
+        , nbins(256)
+    {
+    }
+    ~IntegralHistogram();
+
+    void request(std::shared_ptr<Image> image);
+
+    float getProgressPercentage() const override;
+
+    bool isLoaded() const override
+    {
+        return loaded;
+    }
+
+    void progress() override;
+
+    // adds the histogram of the region to values (the bins of Histogram::Mode::EXACT)
+    // returns false if the table is not built yet
+    bool query(ImRect region, std::vector<std::vector<long>>& values) const;
+
+    // of the table, counted in the limit of the ImageCache while it exists
+    size_t getBytes() const { return table.size() * sizeof(uint32_t); }
+};
+
+// values at the ranks quantile*n and (1-quantile)*n among the n finite values of the bands in the region
+// (ImRect(0, 0, 0, 0) for the whole image), without sorting them
+// they are read from the EXACT histograms of the image when their bins are fine enough,
+// otherwise they are selected by counting the values on the bits of their sortable keys
+// returns false if there is no finite value
+bool compute_quantiles(const std::shared_ptr<Image>& image, const std::vector<size_t>& bands, ImRect region,
+    float quantile, float& low, float& high);
@@ -1,18 +1,30 @@
 #include <algorithm>
 #include <cmath>
+#include <cstddef>
 #include <cstdlib>
 #include <limits>
 
+#include <doctest.h>
+
 #include "Histogram.hpp"
 #include "Image.hpp"
+#include "ImageCache.hpp"
+#include "ThreadPool.hpp"
+#include "testimages.hpp"
+
+// the blocks of 2x2 pixels are read from the image rather than stored (each level takes 1/2^(2l-1) of its size)
+#define MINMAX_PYRAMID_LEVEL 2
 
 Image::Image(float* pixels, size_t w, size_t h, size_t c)
     : pixels(pixels)
     , w(w)
     , h(h)
     , c(c)
+    , integerBits(0)
     , lastUsed(0)
     , histogram(std::make_shared<Histogram>())
+    , integralHistogram(std::make_shared<IntegralHistogram>())
+    , pyramid(std::make_shared<MinMaxPyramid>())
 {
     static int id = 0;
     id++;
@@ -74,3 +86,214 @@ std::array<bool, 3> Image::getPixelValueAtBands(size_t x, size_t y, BandIndices
     }
     return valids;
 }
+
+MinMaxPyramid::~MinMaxPyramid()
+{
+    ImageCache::countExtraBytes(-(ptrdiff_t)getBytes());
+}
+
+void MinMaxPyramid::request(std::shared_ptr<Image> image)
+{
+    if (this->image.lock() == image)
+        return;
+    // query reads the levels only once loaded is set again by progress
+    loaded.store(false, std::memory_order_release);
+    ImageCache::countExtraBytes(-(ptrdiff_t)getBytes());
+    this->image = image;
+    levels.clear();
+    curlevel = 0;
+    nlevels = 1;
+    for (int l = MINMAX_PYRAMID_LEVEL; image->w > ((size_t)1 << l) || image->h > ((size_t)1 << l); l++)
+        nlevels++;
+}
+
+float MinMaxPyramid::getProgressPercentage() const
+{
+    if (loaded)
+        return 1.f;
+    return nlevels ? (float)curlevel / nlevels : 0.f;
+}
+
+void MinMaxPyramid::progress()
+{
+    std::shared_ptr<Image> image = this->image.lock();
+    if (!image || loaded)
+        return;
+
+    int l = MINMAX_PYRAMID_LEVEL + levels.size();
+    size_t w = image->w;
+    size_t h = image->h;
+    size_t c = image->c;
+    size_t wl = (w + (1 << l) - 1) >> l;
+    size_t hl = (h + (1 << l) - 1) >> l;
+    std::vector<float> level(wl * hl * c * 2);
+    ThreadPool& pool = getThreadPool();
+    int nbands = std::max<int>(1, std::min<int>(hl, pool.getConcurrency()));
+    pool.parallelFor(nbands, [&](int band) {
+        for (size_t j = hl * band / nbands; j < hl * (band + 1) / nbands; j++) {
+            for (size_t i = 0; i < wl; i++) {
+                for (size_t d = 0; d < c; d++) {
+                    float min = std::numeric_limits<float>::max();
+                    float max = std::numeric_limits<float>::lowest();
+                    if (l == MINMAX_PYRAMID_LEVEL) {
+                        getRangeInBlock(*image, l, d, i, j, min, max);
+                    } else {
+                        // the previous level is complete
+                        for (size_t k = 0; k < 4; k++)
+                            getRangeInBlock(*image, l - 1, d, 2 * i + k % 2, 2 * j + k / 2, min, max);
+                    }
+                    level[((j * wl + i) * c + d) * 2] = min;
+                    level[((j * wl + i) * c + d) * 2 + 1] = max;
+                }
+            }
+        }
+    });
+    ImageCache::countExtraBytes(level.size() * sizeof(float));
+    levels.push_back(std::move(level));
+
+    curlevel = levels.size();
+    if (curlevel == nlevels)
+        loaded.store(true, std::memory_order_release);
+}
+
+size_t MinMaxPyramid::getBytes() const
+{
+    size_t bytes = 0;
+    for (const auto& level : levels)
+        bytes += level.size() * sizeof(float);
+    return bytes;
+}
+
+// the blocks outside of the image are empty
+void MinMaxPyramid::getRangeInBlock(const Image& image, int level, size_t d, size_t i, size_t j, float& min, float& max) const
+{
+    size_t w = image.w;
+    size_t h = image.h;
+    size_t c = image.c;
+    size_t wl = (w + (1 << level) - 1) >> level;
+    size_t hl = (h + (1 << level) - 1) >> level;
+    if (i >= wl || j >= hl)
+        return;
+
+    if (level < MINMAX_PYRAMID_LEVEL || levels.size() <= (size_t)(level - MINMAX_PYRAMID_LEVEL)) {
+        for (size_t y = j << level; y < std::min(h, (j + 1) << level); y++) {
+            for (size_t x = i << level; x < std::min(w, (i + 1) << level); x++) {
+                float v = image.pixels[(y * w + x) * c + d];
+                if (std::isfinite(v)) {
+                    min = std::min(min, v);
+                    max = std::max(max, v);
+                }
+            }
+        }
+    } else {
+        const float* m = &levels[level - MINMAX_PYRAMID_LEVEL][((j * wl + i) * c + d) * 2];
+        min = std::min(min, m[0]);
+        max = std::max(max, m[1]);
+    }
+}
+
+bool MinMaxPyramid::query(const Image& image, size_t d, size_t x0, size_t y0, size_t x1, size_t y1, float& min, float& max) const
+{
+    // the levels are complete once loaded is seen
+    if (!loaded.load(std::memory_order_acquire))
+        return false;
+
+    x1 = std::min(x1, image.w);
+    y1 = std::min(y1, image.h);
+    // the borders which are not aligned with the blocks of the next level are read at the current level
+    for (int l = 0; x0 < x1 && y0 < y1; l++) {
+        if (x0 % 2) {
+            for (size_t j = y0; j < y1; j++)
+                getRangeInBlock(image, l, d, x0, j, min, max);
+            x0++;
+        }
+        if (x1 % 2 && x0 < x1) {
+            x1--;
+            for (size_t j = y0; j < y1; j++)
+                getRangeInBlock(image, l, d, x1, j, min, max);
+        }
+        if (y0 % 2 && x0 < x1) {
+            for (size_t i = x0; i < x1; i++)
+                getRangeInBlock(image, l, d, i, y0, min, max);
+            y0++;
+        }
+        if (y1 % 2 && x0 < x1 && y0 < y1) {
+            y1--;
+            for (size_t i = x0; i < x1; i++)
+                getRangeInBlock(image, l, d, i, y1, min, max);
+        }
+        x0 /= 2;
+        y0 /= 2;
+        x1 /= 2;
+        y1 /= 2;
+    }
+    return true;
+}
+
+void Image::getRangeInRegion(size_t d, size_t x0, size_t y0, size_t x1, size_t y1, float& min, float& max) const
+{
+    if (pyramid->query(*this, d, x0, y0, x1, y1, min, max))
+        return;
+
+    for (size_t y = y0; y < std::min(y1, h); y++) {
+        for (size_t x = x0; x < std::min(x1, w); x++) {
+            float v = pixels[(y * w + x) * c + d];
+            if (std::isfinite(v)) {
+                min = std::min(min, v);
+                max = std::max(max, v);
+            }
+        }
+    }
+}
+
+TEST_CASE("Image::getRangeInRegion")
+{
+    size_t w = 203;
+    size_t h = 117;
+    size_t c = 2;
+    auto image = makeTestImage(w, h, c, [&](size_t i) {
+        if (i == (50 * w + 60) * c)
+            return NAN;
+        if (i == (51 * w + 61) * c + 1)
+            return -INFINITY;
+        return std::sin(i * 1.3f) * (i % 1000);
+    });
+    const float* pixels = image->pixels;
+
+    // from the pixels, then from the pyramid
+    for (int built = 0; built < 2; built++) {
+        INFO("pyramid built: " << built);
+        if (built) {
+            image->pyramid->request(image);
+            while (!image->pyramid->isLoaded())
+                image->pyramid->progress();
+            CHECK(image->pyramid->getBytes() < w * h * c * sizeof(float) / 4);
+        }
+        for (size_t x0 : { 0, 1, 7, 60 }) {
+            for (size_t y0 : { 0, 3, 50 }) {
+                for (size_t x1 : { 61, 64, 131, 203 }) {
+                    for (size_t y1 : { 51, 52, 100, 117 }) {
+                        for (size_t d = 0; d < c; d++) {
+                            float min = std::numeric_limits<float>::max();
+                            float max = std::numeric_limits<float>::lowest();
+                            image->getRangeInRegion(d, x0, y0, x1, y1, min, max);
+                            float rmin = std::numeric_limits<float>::max();
+                            float rmax = std::numeric_limits<float>::lowest();
+                            for (size_t y = y0; y < y1; y++) {
+                                for (size_t x = x0; x < x1; x++) {
+                                    float v = pixels[(y * w + x) * c + d];
+                                    if (std::isfinite(v)) {
+                                        rmin = std::min(rmin, v);
+                                        rmax = std::max(rmax, v);
+                                    }
+                                }
+                            }
+                            CHECK(min == rmin);
+                            CHECK(max == rmax);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
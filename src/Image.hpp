@@ -1,12 +1,17 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <vector>
 
 #include <imgui.h>
 
+#include "Progressable.hpp"
+
 #if 0
 struct ImageTile {
     unsigned id;
@@ -21,6 +26,8 @@ using BandIndices = std::array<size_t, 3>;
 #define BANDS_DEFAULT (BandIndices { 0, 1, 2 })
 
 class Histogram;
+class IntegralHistogram;
+class MinMaxPyramid;
 
 struct Image {
     std::string ID;
@@ -29,8 +36,11 @@ struct Image {
     ImVec2 size;
     float min;
     float max;
+    int integerBits; // of the unsigned integer samples the image was decoded from, 0 otherwise
     uint64_t lastUsed;
     std::shared_ptr<Histogram> histogram;
+    std::shared_ptr<IntegralHistogram> integralHistogram; // built in the background when a selection is shown
+    std::shared_ptr<MinMaxPyramid> pyramid; // built in the background for the displayed images
 
     std::set<std::string> usedBy;
 
@@ -39,4 +49,56 @@ struct Image {
 
     void getPixelValueAt(size_t x, size_t y, float* values, size_t d) const;
     std::array<bool, 3> getPixelValueAtBands(size_t x, size_t y, BandIndices bands, float* values) const;
+
+    // extends min and max with the finite values of the band d in [x0, x1[ x [y0, y1[
+    // read from the min/max pyramid once it is built, from the pixels before
+    void getRangeInRegion(size_t d, size_t x0, size_t y0, size_t x1, size_t y1, float& min, float& max) const;
+};
+
+// min and max of each band on blocks of 2^l x 2^l pixels, for each level l from MINMAX_PYRAMID_LEVEL
+// up to a single block, a region is covered by the largest blocks so that the cost follows its perimeter
+class MinMaxPyramid : public Progressable {
+    std::atomic<bool> loaded;
+    std::weak_ptr<Image> image;
+    std::vector<std::vector<float>> levels;
+    std::atomic<size_t> curlevel; // levels already built
+    size_t nlevels;
+
+    void getRangeInBlock(const Image& image, int level, size_t d, size_t i, size_t j, float& min, float& max) const;
+
+public:
+    MinMaxPyramid()
+        : loaded(false)
+        , curlevel(0)
+        , nlevels(0)
+    {
+    }
+    ~MinMaxPyramid();
+
+    void request(std::shared_ptr<Image> image);
+
+    float getProgressPercentage() const override;
+
+    bool isLoaded() const override
+    {
+        return loaded;
+    }
+
+    // builds the next level from the previous one
+    void progress() override;
+
+    // see Image::getRangeInRegion, returns false if the pyramid is not built yet
+    bool query(const Image& image, size_t d, size_t x0, size_t y0, size_t x1, size_t y1, float& min, float& max) const;
+
+    // of the levels, counted in the limit of the ImageCache while they exist
+    size_t getBytes() const;
+};
+
+// part of an image which is still being computed, sampled every step pixels from origin
+// (see ImageProvider::getPreview)
+struct ImagePreview {
+    std::shared_ptr<Image> image;
+    ImVec2 origin;
+    int step = 1;
+    ImVec2 size; // of the complete image
 };
@@ -1,3 +1,5 @@
+#include <atomic>
+#include <cstddef>
 #include <cstdlib>
 #include <memory>
 #include <mutex>
@@ -14,6 +16,8 @@ static std::unordered_map<std::string, std::shared_ptr<Image>> cache;
 static std::mutex lock;
 static size_t cacheSize = 0;
 static bool cacheFull = false;
+// not guarded by the lock, the images can be freed while it is held
+static std::atomic<ptrdiff_t> extraSize(0);
 
 bool has(const std::string& key)
 {
@@ -28,6 +32,15 @@ std::shared_ptr<Image> get(const std::string& key)
     return image;
 }
 
+std::shared_ptr<Image> find(const std::string& key)
+{
+    std::lock_guard<std::mutex> _lock(lock);
+    auto i = cache.find(key);
+    if (i == cache.end())
+        return nullptr;
+    return i->second;
+}
+
 std::shared_ptr<Image> getById(const std::string& id)
 {
     std::lock_guard<std::mutex> _lock(lock);
@@ -43,7 +56,7 @@ static bool hasSpaceFor(const Image& image)
 {
     size_t need = image.w * image.h * image.c * sizeof(float);
     size_t limit = gCacheLimitMB * 1000000;
-    return cacheSize + need < limit;
+    return cacheSize + extraSize + need < limit;
 }
 
 static bool makeRoomFor(const Image& image)
@@ -53,7 +66,9 @@ static bool makeRoomFor(const Image& image)
 
     if (need > limit)
         return false;
-    while (cacheSize + need > limit) {
+    while (cacheSize + extraSize + need > limit) {
+        if (cache.empty())
+            return false;
         std::string worst;
 
         // FIXME: slow, use a priority queue to sort old images upto a given space limit
@@ -124,6 +139,11 @@ bool isFull()
     return cacheFull;
 }
 
+void countExtraBytes(ptrdiff_t bytes)
+{
+    extraSize += bytes;
+}
+
 void flush()
 {
     std::lock_guard<std::mutex> _lock(lock);
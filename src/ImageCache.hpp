@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <memory>
 #include <string>
 
@@ -10,6 +11,7 @@ namespace ImageCache {
 bool has(const std::string& key);
 
 std::shared_ptr<Image> get(const std::string& key);
+std::shared_ptr<Image> find(const std::string& key); // nullptr if the key is not cached, unlike get
 std::shared_ptr<Image> getById(const std::string& id); // this is very bad
 
 void store(const std::string& key, std::shared_ptr<Image> image);
@@ -19,6 +21,10 @@ bool remove_rec(const std::string& key);
 
 bool isFull();
 
+// memory tied to the images besides their pixels (the integral histograms), counted in the limit
+// negative when it is freed
+void countExtraBytes(ptrdiff_t bytes);
+
 void flush();
 
 namespace Error {
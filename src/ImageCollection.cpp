@@ -2,6 +2,8 @@
 #include <memory>
 #include <system_error>
 
+#include <doctest.h>
+
 #include "ImageCollection.hpp"
 #include "ImageProvider.hpp"
 #include "Player.hpp"
@@ -105,6 +107,12 @@ std::shared_ptr<ImageProvider> SingleImageImageCollection::getImageProvider(int
 
 std::shared_ptr<ImageProvider> EditedImageCollection::getImageProvider(int index) const
 {
+    for (const auto& s : subexpressions) {
+        // the result of the prefix is worth caching if other edits or sequences use it too
+        if (get_edit_users(s.identity) > s.ownUsers || ImageCache::has(s.prefix->getKey(index)))
+            return s.rest->getImageProvider(index);
+    }
+
     std::string key = getKey(index);
     auto provider = [&]() {
         std::vector<std::shared_ptr<ImageProvider>> providers;
@@ -381,3 +389,70 @@ std::shared_ptr<ImageCollection> buildImageCollectionFromFilenames(const std::ve
     }
     return collection;
 }
+
+std::shared_ptr<ImageProvider> ProgressiveImageCollection::getImageProvider(int index) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (index < 0 || index >= totalLength)
+        return std::make_shared<ErrorImageProvider>("no image at index " + std::to_string(index) + " of the collection");
+    int i = locate(index);
+    return collections[i]->getImageProvider(index);
+}
+
+void ProgressiveImageCollection::progress()
+{
+    std::vector<fs::path> paths;
+    bool more = expansion.step(paths);
+
+    for (auto& path : paths) {
+        std::shared_ptr<ImageCollection> collection;
+        if (collections.empty()) {
+            // the first file gets its tag checked, as if it was alone in the expression
+            collection = selectCollection(path);
+#ifdef USE_IIO_NPY
+        } else if (path.extension() == ".npy") {
+            collection = std::make_shared<NumpyVideoImageCollection>(path.u8string());
+#endif
+        } else {
+            collection = std::make_shared<SingleImageImageCollection>(path.u8string());
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        offsets.push_back(totalLength);
+        collections.push_back(collection);
+        totalLength += collection->getLength();
+    }
+
+    if (!more || expansion.done()) {
+        loaded = true;
+    }
+}
+
+TEST_CASE("ProgressiveImageCollection")
+{
+    fs::path directory = fs::temp_directory_path() / "vpv-collection-test";
+    fs::create_directories(directory);
+    for (const char* name : { "a1.png", "a2.png", "a10.png" })
+        fs::ofstream(directory / name) << name;
+
+    // nothing is listed yet
+    ProgressiveImageCollection collection((directory / "*.png").string());
+    CHECK(collection.getLength() == 0);
+    CHECK(collection.getKey(0).empty());
+    CHECK(collection.getFilename(0).empty());
+    std::shared_ptr<ImageProvider> provider = collection.getImageProvider(0);
+    REQUIRE(provider->isLoaded());
+    CHECK(!provider->getResult().has_value());
+
+    while (!collection.isLoaded())
+        collection.progress();
+    CHECK(collection.getLength() == 3);
+    CHECK(collection.getFilename(2) == (directory / "a10.png").string());
+    CHECK(!collection.getKey(0).empty());
+    CHECK(collection.getKey(-1).empty());
+    CHECK(collection.getKey(3).empty());
+    CHECK(!collection.getImageProvider(-1)->getResult().has_value());
+    CHECK(!collection.getImageProvider(3)->getResult().has_value());
+
+    fs::remove_all(directory);
+}
@@ -1,11 +1,16 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include "Progressable.hpp"
+#include "collection_expression.hpp"
 #include "fs.hpp"
 
 struct Image;
@@ -24,6 +29,13 @@ public:
     virtual const std::string& getFilename(int index) const = 0;
     virtual std::string getKey(int index) const = 0;
     virtual void onFileReload(const std::string& filename) = 0;
+
+    // equal for the collections which give the same images (see create_edited_collection)
+    // the collections of files are only equal to themselves
+    virtual std::string getIdentity() const
+    {
+        return std::to_string((uintptr_t)this);
+    }
 };
 
 std::shared_ptr<ImageCollection> buildImageCollectionFromFilenames(const std::vector<fs::path>& filenames);
@@ -97,6 +109,80 @@ public:
     }
 };
 
+// Collection built from an expression, whose files are listed in the background.
+// progress() expands a bit more of the expression and appends the new files,
+// getLength() grows accordingly and can be read from any thread.
+class ProgressiveImageCollection : public ImageCollection, public Progressable {
+    mutable std::mutex mutex;
+    std::vector<std::shared_ptr<ImageCollection>> collections;
+    std::vector<int> offsets;
+    std::atomic<int> totalLength;
+    std::atomic<bool> loaded;
+    FilenamesExpansion expansion;
+
+    int locate(int& index) const
+    {
+        int i = std::upper_bound(offsets.begin(), offsets.end(), index) - offsets.begin() - 1;
+        index -= offsets[i];
+        return i;
+    }
+
+public:
+    ProgressiveImageCollection(const std::string& expr)
+        : totalLength(0)
+        , loaded(false)
+        , expansion(expr)
+    {
+    }
+
+    ~ProgressiveImageCollection() override = default;
+
+    const std::string& getFilename(int index) const override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index < 0 || index >= totalLength)
+            return empty;
+        int i = locate(index);
+        return collections[i]->getFilename(index);
+    }
+
+    std::string getKey(int index) const override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index < 0 || index >= totalLength)
+            return "";
+        int i = locate(index);
+        return collections[i]->getKey(index);
+    }
+
+    int getLength() const override
+    {
+        return totalLength;
+    }
+
+    std::shared_ptr<ImageProvider> getImageProvider(int index) const override;
+
+    void onFileReload(const std::string& filename) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& c : collections) {
+            c->onFileReload(filename);
+        }
+    }
+
+    float getProgressPercentage() const override
+    {
+        return loaded ? 1.f : 0.f;
+    }
+
+    bool isLoaded() const override
+    {
+        return loaded;
+    }
+
+    void progress() override;
+};
+
 #include "ImageCache.hpp"
 class SingleImageImageCollection : public ImageCollection {
     std::string filename;
@@ -175,6 +261,16 @@ class EditedImageCollection : public ImageCollection {
     std::vector<std::shared_ptr<ImageCollection>> collections;
 
 public:
+    // prefixes of the program which can be shared with other edits (see create_edited_collection),
+    // the result is then the rest of the program evaluated on the result of the prefix
+    struct Subexpression {
+        std::shared_ptr<EditedImageCollection> prefix;
+        std::shared_ptr<ImageCollection> rest;
+        std::string identity; // of the prefix
+        int ownUsers; // this edit and its longer prefixes which have the prefix too
+    };
+    std::vector<Subexpression> subexpressions; // from the longest prefix
+
     EditedImageCollection(EditType edittype, const std::string& editprog,
         const std::vector<std::shared_ptr<ImageCollection>>& collections)
         : edittype(edittype)
@@ -185,6 +281,8 @@ public:
 
     ~EditedImageCollection() override
     {
+        for (const auto& s : subexpressions)
+            release_edit_user(s.identity);
         collections.clear();
     }
 
@@ -201,6 +299,15 @@ public:
         return key;
     }
 
+    std::string getIdentity() const override
+    {
+        // the program may contain any character but its length delimits it
+        std::string identity("edit:" + std::to_string(edittype) + ":" + std::to_string(editprog.size()) + ":" + editprog);
+        for (const auto& c : collections)
+            identity += "[" + c->getIdentity() + "]";
+        return identity;
+    }
+
     int getLength() const override
     {
         int length = 1;
@@ -250,6 +357,11 @@ public:
         return parent->getKey(index);
     }
 
+    std::string getIdentity() const override
+    {
+        return "masked:" + std::to_string(masked) + "[" + parent->getIdentity() + "]";
+    }
+
     int getLength() const override
     {
         return parent->getLength() - 1;
@@ -291,6 +403,11 @@ public:
         return parent->getKey(index);
     }
 
+    std::string getIdentity() const override
+    {
+        return "fixed:" + std::to_string(index) + "[" + parent->getIdentity() + "]";
+    }
+
     int getLength() const override
     {
         return 1;
@@ -332,6 +449,11 @@ public:
         return parent->getKey(index);
     }
 
+    std::string getIdentity() const override
+    {
+        return "offset:" + std::to_string(offset) + "[" + parent->getIdentity() + "]";
+    }
+
     int getLength() const override
     {
         return parent->getLength() - offset;
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <cerrno>
+#include <cmath>
 #include <memory>
 
 #ifdef USE_IIO
@@ -10,7 +12,10 @@ extern "C" {
 #include "Image.hpp"
 #include "ImageProvider.hpp"
 #include "editors.hpp"
+#include "editshaders.hpp"
 #include "fs.hpp"
+#include "globals.hpp"
+#include "xmalloc.hpp"
 
 #ifdef USE_IIO
 static std::shared_ptr<Image> load_from_iio(const std::string& filename)
@@ -171,6 +176,7 @@ public:
 
             std::shared_ptr<Image> image = std::make_shared<Image>(pixels,
                 cinfo.output_width, cinfo.output_height, cinfo.output_components);
+            image->integerBits = 8;
             provider->onFinish(image);
             pixels = nullptr;
         }
@@ -323,6 +329,7 @@ struct PNGPrivate {
         }
 
         auto img = std::make_shared<Image>(pixels, width, height, channels);
+        img->integerBits = depth;
         pixels = nullptr;
         return img;
     }
@@ -551,6 +558,8 @@ void TIFFFileImageProvider::progress()
             if (!image) {
                 onFinish(makeError("iio: cannot load image '" + filename + "'"));
             } else {
+                if (p->fmt == SAMPLEFORMAT_UINT && p->bps <= 16)
+                    image->integerBits = p->bps;
                 onFinish(image);
             }
 #else
@@ -656,10 +665,89 @@ void EditedImageProvider::progress()
         }
     }
     std::string error;
-    std::shared_ptr<Image> image = edit_images(edittype, editprog, images, error);
+    std::shared_ptr<EditProgram> program = get_edit_program(edittype, editprog, images);
+    if (gGPUEdits && can_edit_images_glsl(*program, images)) {
+        // the shader is run by the main thread, check again at the next progress() if it is not done yet
+        if (!job)
+            job = submit_glsl_edit(*program, images);
+        if (!job->wait(10))
+            return;
+        std::shared_ptr<Image> image = job->result;
+        job = nullptr;
+        if (image) {
+            onFinish(image);
+            return;
+        }
+        // otherwise fall back to the CPU
+    }
+    if (gLazyEdits && can_edit_images_by_parts(*program)) {
+        editByParts(*program, images);
+        return;
+    }
+    std::shared_ptr<Image> image = edit_images(*program, images, error);
     if (image) {
         onFinish(image);
     } else {
         onFinish(makeError("cannot edit: " + error));
     }
 }
+
+// pixels evaluated at each progress(), small enough to follow the changes of the viewport
+#define EDIT_BAND_PIXELS (1 << 20)
+
+// the region shown by the window is evaluated first at the display resolution and published
+// as a preview, then the whole image is evaluated by bands of rows
+void EditedImageProvider::editByParts(EditProgram& program, const std::vector<std::shared_ptr<Image>>& images)
+{
+    std::string error;
+    int w = images[0]->w;
+    int h = images[0]->h;
+    int d = get_edit_output_dim(program, images, error);
+    if (!d) {
+        onFinish(makeError("cannot edit: " + error));
+        return;
+    }
+    if (!pixels)
+        pixels = (float*)xmalloc(sizeof(float) * w * h * d);
+
+    ImageViewport vp;
+    bool changed;
+    {
+        std::lock_guard<std::mutex> lock(viewportMutex);
+        vp = viewport;
+        changed = viewportChanged;
+        viewportChanged = false;
+    }
+    if (changed && vp.zoom > 0) {
+        // one sample per pixel of the window when zoomed out
+        int step = std::max(1, (int)std::floor(1.f / vp.zoom));
+        float cx = vp.center.x * w;
+        float cy = vp.center.y * h;
+        float hw = vp.winSize.x / (2.f * vp.zoom);
+        float hh = vp.winSize.y / (2.f * vp.zoom);
+        int x0 = std::max(0, (int)std::floor(cx - hw));
+        int y0 = std::max(0, (int)std::floor(cy - hh));
+        int x1 = std::min(w, (int)std::ceil(cx + hw));
+        int y1 = std::min(h, (int)std::ceil(cy + hh));
+        int ow = (x1 - x0 + step - 1) / step;
+        int oh = (y1 - y0 + step - 1) / step;
+        // not worth it when the region is a large part of what remains to be evaluated
+        if (ow > 0 && oh > 0 && (size_t)ow * oh * 4 <= (size_t)w * (h - nextRow)) {
+            std::shared_ptr<Image> image = edit_images_region(program, images, x0, y0, step, ow, oh, error);
+            if (image)
+                onPreview({ image, ImVec2(x0, y0), step, ImVec2(w, h) });
+        }
+    }
+
+    int y1 = std::min(h, nextRow + std::max(1, EDIT_BAND_PIXELS / w));
+    if (!edit_images_rows(program, images, pixels, nextRow, y1, error)) {
+        onFinish(makeError("cannot edit: " + error));
+        return;
+    }
+    nextRow = y1;
+    editProgress = (float)nextRow / h;
+    if (nextRow == h) {
+        onFinish(std::make_shared<Image>(pixels, w, h, d));
+        pixels = nullptr;
+    }
+}
@@ -4,8 +4,11 @@
 #include <thread>
 
 #include <cassert>
+#include <atomic>
+#include <cstdlib>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -16,6 +19,21 @@
 struct Image;
 
 #include "Image.hpp"
+
+// what a window shows of an image: the center of the View (relative to the image size),
+// the zoom (window pixels per image pixel) and the size of the window
+struct ImageViewport {
+    ImVec2 center;
+    float zoom;
+    ImVec2 winSize;
+
+    bool operator!=(const ImageViewport& o) const
+    {
+        return center.x != o.center.x || center.y != o.center.y || zoom != o.zoom
+            || winSize.x != o.winSize.x || winSize.y != o.winSize.y;
+    }
+};
+
 class ImageProvider : public Progressable {
 public:
     using Result = nonstd::expected<std::shared_ptr<Image>, std::string>;
@@ -23,6 +41,8 @@ public:
 private:
     bool loaded;
     Result result;
+    std::mutex previewMutex;
+    ImagePreview preview;
 
 protected:
     void onFinish(const Result& res)
@@ -31,6 +51,12 @@ protected:
         loaded = true;
     }
 
+    void onPreview(const ImagePreview& preview)
+    {
+        std::lock_guard<std::mutex> lock(previewMutex);
+        this->preview = preview;
+    }
+
     static Result makeError(typename Result::error_type e)
     {
         return nonstd::make_unexpected<typename Result::error_type>(std::move(e));
@@ -56,6 +82,19 @@ public:
     {
         return loaded;
     }
+
+    // part of the result published before the end, by the providers which compute it by parts
+    virtual ImagePreview getPreview()
+    {
+        std::lock_guard<std::mutex> lock(previewMutex);
+        return preview;
+    }
+
+    // called by the windows displaying the result while it is loading,
+    // the providers which compute it by parts start with the displayed region
+    virtual void setViewport(const ImageViewport& viewport)
+    {
+    }
 };
 
 #include "ImageCache.hpp"
@@ -107,6 +146,37 @@ public:
             }
         }
     }
+
+    ImagePreview getPreview() override
+    {
+        if (provider)
+            return provider->getPreview();
+        return ImageProvider::getPreview();
+    }
+
+    void setViewport(const ImageViewport& viewport) override
+    {
+        if (provider)
+            provider->setViewport(viewport);
+    }
+};
+
+// finished from the start, for the frames which cannot be loaded at all
+class ErrorImageProvider : public ImageProvider {
+public:
+    ErrorImageProvider(const std::string& error)
+    {
+        onFinish(makeError(error));
+    }
+
+    float getProgressPercentage() const override
+    {
+        return 1.f;
+    }
+
+    void progress() override
+    {
+    }
 };
 
 class FileImageProvider : public ImageProvider {
@@ -230,11 +300,23 @@ public:
 };
 
 #include "editors.hpp"
+class GLSLEditJob;
 class EditedImageProvider : public ImageProvider {
     EditType edittype;
     std::string editprog;
     std::vector<std::shared_ptr<ImageProvider>> providers;
     std::string key; // used for usedBy
+    std::shared_ptr<GLSLEditJob> job; // when the edit is evaluated by the GPU
+
+    // when the edit is evaluated by parts (see editByParts)
+    float* pixels;
+    int nextRow;
+    std::atomic<float> editProgress;
+    std::mutex viewportMutex;
+    ImageViewport viewport;
+    bool viewportChanged;
+
+    void editByParts(EditProgram& program, const std::vector<std::shared_ptr<Image>>& images);
 
 public:
     EditedImageProvider(EditType edittype, const std::string& editprog,
@@ -244,17 +326,23 @@ public:
         , editprog(editprog)
         , providers(providers)
         , key(key)
+        , pixels(nullptr)
+        , nextRow(0)
+        , editProgress(0.f)
+        , viewport()
+        , viewportChanged(false)
     {
     }
 
     ~EditedImageProvider() override
     {
         providers.clear();
+        free(pixels);
     }
 
     float getProgressPercentage() const override
     {
-        float percent = 0.f;
+        float percent = editProgress;
         for (const auto& p : providers) {
             percent += p->getProgressPercentage();
         }
@@ -263,6 +351,15 @@ public:
     }
 
     void progress() override;
+
+    void setViewport(const ImageViewport& viewport) override
+    {
+        std::lock_guard<std::mutex> lock(viewportMutex);
+        if (this->viewport != viewport) {
+            this->viewport = viewport;
+            viewportChanged = true;
+        }
+    }
 };
 
 class VideoImageProvider : public ImageProvider {
@@ -1,78 +1,75 @@
 #include "Macroblock.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <functional>
 #include <stdexcept>
 #include <tuple>
 
+#include <doctest.h>
+
 // Block constructors
 Block::Block()
     : pos(Pos({ 0, 0 }))
 {
 }
 
-Block::Block(unsigned int size, Pos pos, unsigned int split)
+Block::Block(unsigned int size, Pos pos, unsigned int split, ArrayView<MotionVector> motionVectors, ArrayView<unsigned int> modes)
     : size(size)
-    , pos(pos)
     , split(split)
-{
-}
-Block::Block(unsigned int size, Pos pos, unsigned int split, std::vector<std::tuple<int, int, int>> motionVectors)
-    : size(size)
+    , motionVectors(motionVectors)
+    , modes(modes)
     , pos(pos)
-    , split(split)
-    , motionVectors(std::move(motionVectors))
 {
 }
-Block::Block(unsigned int size, Pos pos, unsigned int split, std::vector<unsigned int> modes)
-    : size(size)
-    , pos(pos)
-    , split(split)
-    , modes(std::move(modes))
+
+// MacroblockFrame private methods
+
+void MacroblockFrame::beginMacroblock(MacroblockType type, Pos pos)
 {
+    if (firstRecords.empty()) {
+        firstRecords.push_back(0);
+        firstVectors.push_back(0);
+        firstModes.push_back(0);
+    }
+    xs.push_back(pos.x);
+    ys.push_back(pos.y);
+    types.push_back(static_cast<uint8_t>(type));
 }
 
-// Private methods
-Pos Macroblock::getScaledPos(const Pos& pos)
+void MacroblockFrame::addRecord(unsigned int split, const std::vector<MotionVector>& blockVectors, const std::vector<unsigned int>& blockModes)
 {
-    return Pos({ pos.x * MACROBLOCK_SIZE, pos.y * MACROBLOCK_SIZE });
+    splits.push_back(static_cast<uint8_t>(split));
+    vectors.insert(vectors.end(), blockVectors.begin(), blockVectors.end());
+    modes.insert(modes.end(), blockModes.begin(), blockModes.end());
+    firstVectors.push_back(static_cast<uint32_t>(vectors.size()));
+    firstModes.push_back(static_cast<uint32_t>(modes.size()));
 }
 
-// TODO: look into template functions maybe
-void Macroblock::initSubBlocksCommon(const Pos& parent_pos, unsigned int subSplit, const std::function<Block(unsigned int, Pos, unsigned int, unsigned int)>& blockConstructor)
+void MacroblockFrame::endMacroblock()
 {
-    auto& bs = blocks.emplace();
-    for (unsigned int i = 0; i < 2; ++i) {
-        for (unsigned int j = 0; j < 2; ++j) {
-            const unsigned int idx = 3 - (i * 2 + j);
-            auto sub_pos = Pos({ parent_pos.x * MACROBLOCK_SIZE + j * SUB_SIZE,
-                parent_pos.y * MACROBLOCK_SIZE + i * SUB_SIZE });
-
-            bs[idx] = blockConstructor(idx, sub_pos, subSplit & SUBSPLIT_MASK, idx);
-
-            subSplit >>= 2;
-        }
-    }
+    firstRecords.push_back(static_cast<uint32_t>(splits.size()));
 }
 
-void Macroblock::initSubBlocks(const Pos& parent_pos, const unsigned int subSplit,
-    const std::vector<std::vector<std::tuple<int, int, int>>>& vectors)
+void MacroblockFrame::addSubBlocks(unsigned int subSplit, const std::vector<std::vector<MotionVector>>& subVectors)
 {
-    initSubBlocksCommon(parent_pos, subSplit, [&](unsigned int idx, const Pos& sub_pos, unsigned int splitBits, unsigned int) {
-        if (vectors.empty()) {
-            return Block(SUB_SIZE, sub_pos, splitBits);
-        }
-        return Block(SUB_SIZE, sub_pos, splitBits, vectors[idx]);
-    });
+    static const std::vector<MotionVector> none;
+    for (unsigned int idx = 0; idx < 4; idx++) {
+        unsigned int splitBits = (subSplit >> (2 * (3 - idx))) & SUBSPLIT_MASK;
+        addRecord(splitBits, idx < subVectors.size() ? subVectors[idx] : none, {});
+    }
 }
 
-void Macroblock::initSubBlocks(const Pos& parent_pos, const unsigned int subSplit, const std::vector<std::vector<unsigned int>>& modes)
+void MacroblockFrame::addSubBlocks(unsigned int subSplit, const std::vector<std::vector<unsigned int>>& subModes)
 {
-    initSubBlocksCommon(parent_pos, subSplit, [&](unsigned int idx, const Pos& sub_pos, unsigned int splitBits, unsigned int) {
-        return Block(SUB_SIZE, sub_pos, splitBits, modes[idx]);
-    });
+    for (unsigned int idx = 0; idx < 4; idx++) {
+        unsigned int splitBits = (subSplit >> (2 * (3 - idx))) & SUBSPLIT_MASK;
+        addRecord(splitBits, {}, subModes[idx]);
+    }
 }
 
-void Macroblock::validateVectors(const std::vector<std::vector<std::tuple<int, int, int>>>& vectors, size_t outer, std::optional<size_t> inner)
+void MacroblockFrame::validateVectors(const std::vector<std::vector<MotionVector>>& vectors, size_t outer, std::optional<size_t> inner)
 {
     // May seem like unreachable code right now, but might produce segmentation fault later
     if (vectors.empty() && outer == 0) {
@@ -83,7 +80,7 @@ void Macroblock::validateVectors(const std::vector<std::vector<std::tuple<int, i
     }
 }
 
-void Macroblock::validateModes(const std::vector<std::vector<unsigned int>>& modes, unsigned int split, unsigned int subSplit)
+void MacroblockFrame::validateModes(const std::vector<std::vector<unsigned int>>& modes, unsigned int split, unsigned int subSplit)
 {
     if (modes.empty()) {
         throw std::invalid_argument("Invalid empty mode vector for block I!");
@@ -116,118 +113,484 @@ void Macroblock::validateModes(const std::vector<std::vector<unsigned int>>& mod
     }
 }
 
-// Macroblock constructors
+// MacroblockFrame public methods
 
-Macroblock::Macroblock(MacroblockType type, Pos pos, const std::tuple<int, int, int>& motionVector)
-    : Block(MACROBLOCK_SIZE, getScaledPos(pos), 3)
-    , type(type)
+void MacroblockFrame::addS(Pos pos, const MotionVector& motionVector)
 {
-    if (type != S) {
-        throw std::invalid_argument("Invalid type for Macroblock S structure");
-    }
-    this->motionVectors.push_back(motionVector);
+    beginMacroblock(S, pos);
+    addRecord(3, { motionVector }, {});
+    endMacroblock();
 }
 
-Macroblock::Macroblock(MacroblockType type,
-    Pos pos,
-    unsigned int split,
-    const std::vector<std::vector<unsigned int>>& modes,
-    unsigned int subSplit)
-    : Block(MACROBLOCK_SIZE, getScaledPos(pos), split)
-    , type(type)
+void MacroblockFrame::addI(Pos pos, unsigned int split, const std::vector<std::vector<unsigned int>>& blockModes, unsigned int subSplit)
 {
-    if (type != I) {
-        throw std::invalid_argument("Invalid type for Macroblock I structure");
-    }
-
     if (split == 1 || split == 2) {
         throw std::invalid_argument("Invalid splits for type I");
     }
 
-    validateModes(modes, split, subSplit);
+    validateModes(blockModes, split, subSplit);
+    if (split != 0 && subSplit != 0 && subSplit != 255) {
+        throw std::invalid_argument("Invalid sub splits for type I");
+    }
+    beginMacroblock(I, pos);
     if (split == 0) {
-        this->modes = modes.front();
+        addRecord(split, {}, blockModes.front());
     } else {
-        if (subSplit != 0 && subSplit != 255) {
-            throw std::invalid_argument("Invalid sub splits for type I");
-        }
-        initSubBlocks(pos, subSplit, modes);
+        addRecord(split, {}, {});
+        addSubBlocks(subSplit, blockModes);
     }
+    endMacroblock();
 }
 
-Macroblock::Macroblock(MacroblockType type, Pos pos, unsigned int split, unsigned int subSplit, const std::vector<std::vector<std::tuple<int, int, int>>>& motionVectors)
-    : Block(MACROBLOCK_SIZE, getScaledPos(pos), split)
-    , type(type)
+void MacroblockFrame::addP(Pos pos, unsigned int split, unsigned int subSplit, const std::vector<std::vector<MotionVector>>& motionVectors)
 {
-    if (type != P) {
-        throw std::invalid_argument("Invalid type for Macroblock P structure");
-    }
-
     switch (split) {
     case 0: {
         validateVectors(motionVectors, 1, 1);
-        this->motionVectors.push_back(motionVectors[0][0]);
+        beginMacroblock(P, pos);
+        addRecord(split, { motionVectors[0][0] }, {});
         break;
     }
     case 1:
         //TODO CHECK IF C++17 [[fallthrough]];
     case 2: {
         validateVectors(motionVectors, 1, 2);
-        this->motionVectors.push_back(motionVectors[0][0]);
-        this->motionVectors.push_back(motionVectors[0][1]);
+        beginMacroblock(P, pos);
+        addRecord(split, { motionVectors[0][0], motionVectors[0][1] }, {});
         break;
     }
     case 3: {
-        if (subSplit == 0) {
-            initSubBlocks(pos, subSplit, motionVectors);
-        } else {
+        if (subSplit != 0) {
             validateVectors(motionVectors, 4, std::nullopt);
-
-            initSubBlocks(pos, subSplit, motionVectors);
         }
+        beginMacroblock(P, pos);
+        addRecord(split, {}, {});
+        addSubBlocks(subSplit, motionVectors);
         break;
     }
     default:
         throw std::invalid_argument("Invalid split value for Macroblock P");
     }
+    endMacroblock();
 }
 
-Macroblock::Macroblock(MacroblockType type, Pos pos, unsigned int split, const std::vector<std::vector<std::tuple<int, int, int>>>& motionVectors)
-    : Block(MACROBLOCK_SIZE, getScaledPos(pos), split)
-    , type(type)
+void MacroblockFrame::addB(Pos pos, unsigned int split, const std::vector<std::vector<MotionVector>>& motionVectors)
 {
-    if (type != B) {
-        throw std::invalid_argument("Invalid type for Macroblock B structure");
-    }
     switch (split) {
     case 0: {
         // TODO: Fix validation with variable length 1 or 2
-        this->motionVectors.push_back(motionVectors[0][0]);
+        beginMacroblock(B, pos);
+        addRecord(split, { motionVectors[0][0] }, {});
         break;
     }
     case 1:
         //TODO CHECK IF C++17 [[fallthrough]];
     case 2: {
         // TODO: Fix validation with variable length 1 or 2
-        this->motionVectors.push_back(motionVectors[0][0]);
-        if (std::get<2>(motionVectors[0][0]) > 1) {
-            this->motionVectors.push_back(motionVectors[0][1]);
-        } else {
-            this->motionVectors.emplace_back(0, 0, 0);
-        }
-        this->motionVectors.push_back(motionVectors[1][0]);
-        if (std::get<2>(motionVectors[1][0]) > 1) {
-            this->motionVectors.push_back(motionVectors[1][1]);
-        } else {
-            this->motionVectors.emplace_back(0, 0, 0);
+        std::vector<MotionVector> blockVectors;
+        for (size_t i = 0; i < 2; i++) {
+            blockVectors.push_back(motionVectors[i][0]);
+            if (std::get<2>(motionVectors[i][0]) > 1) {
+                blockVectors.push_back(motionVectors[i][1]);
+            } else {
+                blockVectors.emplace_back(0, 0, 0);
+            }
         }
+        beginMacroblock(B, pos);
+        addRecord(split, blockVectors, {});
         break;
     }
     case 3: {
-        initSubBlocks(pos, 0, motionVectors);
+        beginMacroblock(B, pos);
+        addRecord(split, {}, {});
+        addSubBlocks(0, motionVectors);
         break;
     }
     default:
         throw std::invalid_argument("Invalid split value for Macroblock B");
     }
-}
\ No newline at end of file
+    endMacroblock();
+}
+
+Macroblock MacroblockFrame::operator[](size_t i) const
+{
+    auto recordVectors = [&](size_t r) {
+        return ArrayView<MotionVector>(vectors.data() + firstVectors[r], vectors.data() + firstVectors[r + 1]);
+    };
+    auto recordModes = [&](size_t r) {
+        return ArrayView<unsigned int>(modes.data() + firstModes[r], modes.data() + firstModes[r + 1]);
+    };
+
+    size_t r = firstRecords[i];
+    Pos pos({ xs[i] * MACROBLOCK_SIZE, ys[i] * MACROBLOCK_SIZE });
+    Macroblock macroblock(static_cast<MacroblockType>(types[i]),
+        Block(MACROBLOCK_SIZE, pos, splits[r], recordVectors(r), recordModes(r)));
+    if (firstRecords[i + 1] - r == 5) {
+        auto& bs = macroblock.blocks.emplace();
+        for (unsigned int idx = 0; idx < 4; idx++) {
+            // the first sub-block is the bottom right one
+            unsigned int k = 3 - idx;
+            Pos subPos({ pos.x + (k % 2) * SUB_SIZE, pos.y + (k / 2) * SUB_SIZE });
+            bs[idx] = Block(SUB_SIZE, subPos, splits[r + 1 + idx], recordVectors(r + 1 + idx), recordModes(r + 1 + idx));
+        }
+    }
+    return macroblock;
+}
+
+size_t MacroblockFrame::getBytes() const
+{
+    return xs.size() * sizeof(uint32_t) * 2 + types.size() + firstRecords.size() * sizeof(uint32_t)
+        + splits.size() + (firstVectors.size() + firstModes.size()) * sizeof(uint32_t)
+        + vectors.size() * sizeof(MotionVector) + modes.size() * sizeof(unsigned int);
+}
+
+void MacroblockFrame::shrinkToFit()
+{
+    xs.shrink_to_fit();
+    ys.shrink_to_fit();
+    types.shrink_to_fit();
+    firstRecords.shrink_to_fit();
+    splits.shrink_to_fit();
+    firstVectors.shrink_to_fit();
+    firstModes.shrink_to_fit();
+    vectors.shrink_to_fit();
+    modes.shrink_to_fit();
+}
+
+// MacroblockSummary
+
+void MacroblockSummary::add(const MacroblockSummary& other)
+{
+    for (size_t t = 0; t < typeCounts.size(); t++) {
+        typeCounts[t] += other.typeCounts[t];
+    }
+    vectorSumX += other.vectorSumX;
+    vectorSumY += other.vectorSumY;
+    vectors += other.vectors;
+}
+
+bool MacroblockSummary::empty() const
+{
+    return typeCounts[S] + typeCounts[I] + typeCounts[P] + typeCounts[B] == 0;
+}
+
+MacroblockType MacroblockSummary::getDominantType() const
+{
+    size_t dominant = 0;
+    for (size_t t = 1; t < typeCounts.size(); t++) {
+        if (typeCounts[t] > typeCounts[dominant]) {
+            dominant = t;
+        }
+    }
+    return static_cast<MacroblockType>(dominant);
+}
+
+ImVec2 MacroblockSummary::getMeanVector() const
+{
+    if (vectors == 0) {
+        return { 0, 0 };
+    }
+    return { vectorSumX / vectors, vectorSumY / vectors };
+}
+
+static void addVectors(const Block& block, MacroblockSummary& summary)
+{
+    for (const auto& v : block.motionVectors) {
+        summary.vectorSumX += static_cast<float>(std::get<0>(v));
+        summary.vectorSumY += static_cast<float>(std::get<1>(v));
+        summary.vectors++;
+    }
+}
+
+// MacroblockGrid
+
+static float getVectorsReach(const Block& block)
+{
+    float reach = 0;
+    for (const auto& v : block.motionVectors) {
+        reach = std::max(reach, static_cast<float>(std::abs(std::get<0>(v))));
+        reach = std::max(reach, static_cast<float>(std::abs(std::get<1>(v))));
+    }
+    return reach;
+}
+
+void MacroblockGrid::build(const MacroblockFrame& macroblocks)
+{
+    cols = 0;
+    rows = 0;
+    reach = 0;
+    for (size_t i = 0; i < macroblocks.size(); i++) {
+        Macroblock macroblock = macroblocks[i];
+        cols = std::max(cols, static_cast<unsigned int>(macroblock.getX()) / GRID_CELL_SIZE + 1);
+        rows = std::max(rows, static_cast<unsigned int>(macroblock.getY()) / GRID_CELL_SIZE + 1);
+        reach = std::max(reach, getVectorsReach(macroblock));
+        if (macroblock.blocks.has_value()) {
+            for (const auto& subBlock : macroblock.blocks.value()) {
+                reach = std::max(reach, getVectorsReach(subBlock));
+            }
+        }
+    }
+
+    auto cellOf = [&](const Macroblock& macroblock) {
+        return static_cast<size_t>(macroblock.getY()) / GRID_CELL_SIZE * cols + static_cast<size_t>(macroblock.getX()) / GRID_CELL_SIZE;
+    };
+    cellStarts.assign(static_cast<size_t>(cols) * rows + 1, 0);
+    for (size_t i = 0; i < macroblocks.size(); i++) {
+        cellStarts[cellOf(macroblocks[i]) + 1]++;
+    }
+    for (size_t c = 1; c < cellStarts.size(); c++) {
+        cellStarts[c] += cellStarts[c - 1];
+    }
+    indices.resize(macroblocks.size());
+    std::vector<size_t> filled(cellStarts.begin(), cellStarts.end() - 1);
+    for (size_t i = 0; i < macroblocks.size(); i++) {
+        indices[filled[cellOf(macroblocks[i])]++] = i;
+    }
+
+    // the super-cells of a level merge 2x2 cells of the previous one, up to a single one
+    summaries.clear();
+    if (!cols || !rows) {
+        return;
+    }
+    std::vector<MacroblockSummary> level(static_cast<size_t>(cols) * rows);
+    for (size_t i = 0; i < macroblocks.size(); i++) {
+        Macroblock macroblock = macroblocks[i];
+        MacroblockSummary& summary = level[cellOf(macroblock)];
+        summary.typeCounts[macroblock.type]++;
+        addVectors(macroblock, summary);
+        if (macroblock.blocks.has_value()) {
+            for (const auto& subBlock : macroblock.blocks.value()) {
+                addVectors(subBlock, summary);
+            }
+        }
+    }
+    summaries.push_back(std::move(level));
+    unsigned int levelCols = cols, levelRows = rows;
+    while (levelCols > 1 || levelRows > 1) {
+        unsigned int coarseCols = (levelCols + 1) / 2, coarseRows = (levelRows + 1) / 2;
+        std::vector<MacroblockSummary> coarse(static_cast<size_t>(coarseCols) * coarseRows);
+        const auto& fine = summaries.back();
+        for (unsigned int y = 0; y < levelRows; y++) {
+            for (unsigned int x = 0; x < levelCols; x++) {
+                coarse[static_cast<size_t>(y / 2) * coarseCols + x / 2].add(fine[static_cast<size_t>(y) * levelCols + x]);
+            }
+        }
+        summaries.push_back(std::move(coarse));
+        levelCols = coarseCols;
+        levelRows = coarseRows;
+    }
+}
+
+size_t MacroblockGrid::getBytes() const
+{
+    size_t bytes = (cellStarts.size() + indices.size()) * sizeof(size_t);
+    for (const auto& level : summaries)
+        bytes += level.size() * sizeof(MacroblockSummary);
+    return bytes;
+}
+
+void MacroblockGrid::getCellRange(float from, float to, float cellSize, unsigned int count, unsigned int& first, unsigned int& last)
+{
+    first = static_cast<unsigned int>(std::clamp(std::floor(from / cellSize), 0.f, static_cast<float>(count - 1)));
+    last = static_cast<unsigned int>(std::clamp(std::floor(to / cellSize), 0.f, static_cast<float>(count - 1)));
+}
+
+void MacroblockGrid::querySummaries(ImVec2 from, ImVec2 to, unsigned int level,
+    std::vector<std::pair<ImVec2, const MacroblockSummary*>>& cells) const
+{
+    if (level >= summaries.size() || to.x < 0 || to.y < 0) {
+        return;
+    }
+    float cellSize = static_cast<float>(GRID_CELL_SIZE << level);
+    unsigned int levelCols = (cols + (1u << level) - 1) >> level;
+    unsigned int levelRows = (rows + (1u << level) - 1) >> level;
+    if (from.x >= levelCols * cellSize || from.y >= levelRows * cellSize) {
+        return;
+    }
+    unsigned int x0, x1, y0, y1;
+    getCellRange(from.x, to.x, cellSize, levelCols, x0, x1);
+    getCellRange(from.y, to.y, cellSize, levelRows, y0, y1);
+    for (unsigned int y = y0; y <= y1; y++) {
+        for (unsigned int x = x0; x <= x1; x++) {
+            const MacroblockSummary& summary = summaries[level][static_cast<size_t>(y) * levelCols + x];
+            if (!summary.empty()) {
+                cells.emplace_back(ImVec2(x * cellSize, y * cellSize), &summary);
+            }
+        }
+    }
+}
+
+void MacroblockGrid::query(ImVec2 from, ImVec2 to, std::vector<size_t>& out) const
+{
+    if (!cols || !rows) {
+        return;
+    }
+    // the blocks starting before the region can cover it, and their vectors can point into it
+    float before = MACROBLOCK_SIZE + reach;
+    if (to.x + reach < 0 || to.y + reach < 0 || from.x - before >= cols * GRID_CELL_SIZE || from.y - before >= rows * GRID_CELL_SIZE) {
+        return;
+    }
+    unsigned int x0, x1, y0, y1;
+    getCellRange(from.x - before, to.x + reach, GRID_CELL_SIZE, cols, x0, x1);
+    getCellRange(from.y - before, to.y + reach, GRID_CELL_SIZE, rows, y0, y1);
+    for (unsigned int y = y0; y <= y1; y++) {
+        // the cells of a row are contiguous
+        size_t begin = cellStarts[static_cast<size_t>(y) * cols + x0];
+        size_t end = cellStarts[static_cast<size_t>(y) * cols + x1 + 1];
+        out.insert(out.end(), indices.begin() + begin, indices.begin() + end);
+    }
+}
+
+TEST_CASE("MacroblockFrame")
+{
+    MacroblockFrame frame;
+    frame.addS(Pos({ 1, 2 }), std::make_tuple(3, -4, 0));
+    frame.addI(Pos({ 2, 2 }), 0, { { 7 } });
+    // the sub-splits of the top left, top right, bottom left and bottom right sub-blocks are 1, 2, 3 and 0
+    frame.addP(Pos({ 3, 2 }), 3, 0b00111001, { { std::make_tuple(1, 1, 1) }, { std::make_tuple(2, 2, 1) }, { std::make_tuple(3, 3, 1) }, { std::make_tuple(4, 4, 1) } });
+    frame.addB(Pos({ 4, 2 }), 1, { { std::make_tuple(5, 5, 1) }, { std::make_tuple(6, 6, 2), std::make_tuple(7, 7, 3) } });
+    CHECK_THROWS_AS(frame.addI(Pos({ 5, 2 }), 1, { { 7 } }), std::invalid_argument);
+    CHECK_THROWS_AS(frame.addP(Pos({ 5, 2 }), 0, 0, {}), std::invalid_argument);
+    REQUIRE(frame.size() == 4);
+
+    Macroblock s = frame[0];
+    CHECK(s.type == S);
+    CHECK(s.getX() == 16);
+    CHECK(s.getY() == 32);
+    CHECK(s.split == 3);
+    REQUIRE(s.motionVectors.size() == 1);
+    CHECK(std::get<1>(s.motionVectors.front()) == -4);
+    CHECK(!s.blocks.has_value());
+
+    Macroblock i = frame[1];
+    CHECK(i.type == I);
+    REQUIRE(i.modes.size() == 1);
+    CHECK(i.modes.front() == 7);
+    CHECK(i.motionVectors.empty());
+
+    Macroblock p = frame[2];
+    CHECK(p.type == P);
+    REQUIRE(p.blocks.has_value());
+    CHECK(p.motionVectors.empty());
+    const auto& bs = p.blocks.value();
+    // the first sub-block is the bottom right one
+    CHECK(bs[0].getTopLeft().x == 48 + 8);
+    CHECK(bs[0].getTopLeft().y == 32 + 8);
+    CHECK(bs[0].getSize() == 8);
+    CHECK(bs[3].getTopLeft().x == 48);
+    CHECK(bs[3].getTopLeft().y == 32);
+    CHECK(bs[3].split == 1);
+    CHECK(bs[2].split == 2);
+    CHECK(bs[1].split == 3);
+    CHECK(bs[0].split == 0);
+    for (unsigned int idx = 0; idx < 4; idx++) {
+        REQUIRE(bs[idx].motionVectors.size() == 1);
+        CHECK(std::get<0>(bs[idx].motionVectors[0]) == static_cast<int>(idx + 1));
+    }
+
+    // the missing second vectors of a B block are replaced by zeros
+    Macroblock b = frame[3];
+    CHECK(b.type == B);
+    REQUIRE(b.motionVectors.size() == 4);
+    CHECK(std::get<0>(b.motionVectors[1]) == 0);
+    CHECK(std::get<0>(b.motionVectors[2]) == 6);
+    CHECK(std::get<0>(b.motionVectors[3]) == 7);
+
+    // no allocation per block
+    frame.shrinkToFit();
+    CHECK(frame.getBytes() < 4 * 64 + 9 * sizeof(MotionVector));
+}
+
+TEST_CASE("MacroblockGrid")
+{
+    // a 4K frame
+    MacroblockFrame macroblocks;
+    for (unsigned int y = 0; y < 135; y++) {
+        for (unsigned int x = 0; x < 240; x++) {
+            if (x == 100 && y == 100) {
+                // points 200 pixels to the left
+                macroblocks.addS(Pos({ x, y }), std::make_tuple(-200, 0, 0));
+            } else {
+                macroblocks.addI(Pos({ x, y }), 0, std::vector<std::vector<unsigned int>> { { 1 } });
+            }
+        }
+    }
+    MacroblockGrid grid;
+    grid.build(macroblocks);
+
+    auto intersecting = [&](ImVec2 from, ImVec2 to) {
+        std::vector<size_t> found;
+        grid.query(from, to, found);
+        std::sort(found.begin(), found.end());
+        CHECK(std::adjacent_find(found.begin(), found.end()) == found.end());
+        // all the blocks in the region are found, but not much more
+        size_t expected = 0;
+        for (size_t i = 0; i < macroblocks.size(); i++) {
+            Macroblock m = macroblocks[i];
+            if (m.getBottomRight().x > from.x && m.getX() < to.x && m.getBottomRight().y > from.y && m.getY() < to.y) {
+                CHECK(std::binary_search(found.begin(), found.end(), i));
+                expected++;
+            }
+        }
+        CHECK(found.size() <= expected + 2 * (to.x - from.x + to.y - from.y + 1000) + 1000);
+        return found;
+    };
+
+    intersecting(ImVec2(0, 0), ImVec2(3840, 2160));
+    intersecting(ImVec2(1000, 500), ImVec2(1300, 700));
+    intersecting(ImVec2(-50, -50), ImVec2(10, 10));
+    CHECK(intersecting(ImVec2(5000, 5000), ImVec2(6000, 6000)).empty());
+    CHECK(intersecting(ImVec2(-600, -600), ImVec2(-500, -500)).empty());
+
+    // the vector of the block (100, 100) reaches the region on its left
+    std::vector<size_t> found = intersecting(ImVec2(1400, 1600), ImVec2(1450, 1700));
+    CHECK(std::find(found.begin(), found.end(), 100 * 240 + 100) != found.end());
+}
+
+TEST_CASE("MacroblockGrid summaries")
+{
+    // 10x5 macroblocks, the P blocks move by (4, -2) and the S blocks by (0, 2)
+    MacroblockFrame macroblocks;
+    for (unsigned int y = 0; y < 5; y++) {
+        for (unsigned int x = 0; x < 10; x++) {
+            if (x < 6) {
+                macroblocks.addP(Pos({ x, y }), 0, 0, { { std::make_tuple(4, -2, 1) } });
+            } else {
+                macroblocks.addS(Pos({ x, y }), std::make_tuple(0, 2, 0));
+            }
+        }
+    }
+    MacroblockGrid grid;
+    grid.build(macroblocks);
+    // 3x2 cells, then 2x1 super-cells, then a single one
+    REQUIRE(grid.getSummaryLevels() == 3);
+
+    std::vector<std::pair<ImVec2, const MacroblockSummary*>> cells;
+    grid.querySummaries(ImVec2(0, 0), ImVec2(160, 80), 0, cells);
+    REQUIRE(cells.size() == 6);
+    CHECK(cells[0].second->getDominantType() == P);
+    CHECK(cells[0].second->typeCounts[P] == 16);
+    CHECK(cells[0].second->getMeanVector().x == 4);
+    CHECK(cells[2].first.x == 128);
+    CHECK(cells[2].second->getDominantType() == S);
+    CHECK(cells[2].second->getMeanVector().y == 2);
+
+    cells.clear();
+    grid.querySummaries(ImVec2(130, 0), ImVec2(140, 10), 1, cells);
+    REQUIRE(cells.size() == 1);
+    CHECK(cells[0].first.x == 128);
+    CHECK(cells[0].second->typeCounts[S] == 10);
+
+    cells.clear();
+    grid.querySummaries(ImVec2(-100, -100), ImVec2(1000, 1000), 2, cells);
+    REQUIRE(cells.size() == 1);
+    const MacroblockSummary& all = *cells[0].second;
+    CHECK(all.typeCounts[P] == 30);
+    CHECK(all.typeCounts[S] == 20);
+    CHECK(all.getDominantType() == P);
+    CHECK(all.getMeanVector().x == doctest::Approx(4 * 30 / 50.f));
+
+    cells.clear();
+    grid.querySummaries(ImVec2(500, 0), ImVec2(600, 10), 0, cells);
+    CHECK(cells.empty());
+}
@@ -4,14 +4,16 @@
 #include "imgui.h"
 
 #include <array>
-#include <functional>
+#include <cstdint>
 #include <optional>
+#include <tuple>
 #include <vector>
 
 constexpr unsigned int MACROBLOCK_SIZE = 16;
 constexpr unsigned int SUBSPLIT_MASK = 0b11; // 3
 constexpr unsigned int FULL_SUBSPLIT = 0b11111111; // 255, 2 bits each represent the subsplits (0 to 3)
 constexpr unsigned int SUB_SIZE = MACROBLOCK_SIZE / 2;
+constexpr unsigned int GRID_CELL_SIZE = 4 * MACROBLOCK_SIZE;
 
 struct Pos {
     unsigned int x = 0, y = 0;
@@ -29,17 +31,41 @@ enum MacroblockType {
     B
 };
 
+// a contiguous part of an array of a MacroblockFrame
+template <typename T>
+class ArrayView {
+public:
+    ArrayView() = default;
+    ArrayView(const T* first, const T* last)
+        : first(first)
+        , last(last)
+    {
+    }
+
+    const T* begin() const { return first; }
+    const T* end() const { return last; }
+    size_t size() const { return static_cast<size_t>(last - first); }
+    bool empty() const { return first == last; }
+    const T& front() const { return *first; }
+    const T& operator[](size_t i) const { return first[i]; }
+
+private:
+    const T* first = nullptr;
+    const T* last = nullptr;
+};
+
+using MotionVector = std::tuple<int, int, int>; // x, y, reference frame
+
+// a view of a block stored in a MacroblockFrame, valid while the frame is not modified
 class Block {
 public:
     unsigned int size = 0;
     unsigned int split = 0;
-    std::vector<std::tuple<int, int, int>> motionVectors;
-    std::vector<unsigned int> modes;
+    ArrayView<MotionVector> motionVectors;
+    ArrayView<unsigned int> modes;
 
     Block();
-    Block(unsigned int size, Pos pos, unsigned int split);
-    Block(unsigned int size, Pos pos, unsigned int split, std::vector<std::tuple<int, int, int>> motionVectors);
-    Block(unsigned int size, Pos pos, unsigned int split, std::vector<unsigned int> modes);
+    Block(unsigned int size, Pos pos, unsigned int split, ArrayView<MotionVector> motionVectors, ArrayView<unsigned int> modes);
 
     // TODO check if c++17 and look into [[nodiscard]] annotations
     // pos and size access through getters to provide float conversions for ImGui but stored as int, because of pixels
@@ -66,38 +92,98 @@ public:
     std::optional<std::array<Block, 4>> blocks = std::nullopt;
     MacroblockType type = S;
 
-    // Constructor for `BlockType::S` (default)
-    explicit Macroblock(MacroblockType type, Pos pos, const std::tuple<int, int, int>& motionVector);
-
-    // Constructor for `BlockType::I` (Intra-coded)
-    explicit Macroblock(MacroblockType type,
-        Pos pos,
-        unsigned int split,
-        const std::vector<std::vector<unsigned int>>& modes,
-        unsigned int subSplit = 0);
-
-    // Constructor for `BlockType::P` (Predicted) with motion vectors
-    explicit Macroblock(MacroblockType type,
-        Pos pos,
-        unsigned int split,
-        unsigned int subSplit,
-        const std::vector<std::vector<std::tuple<int, int, int>>>& motionVectors);
-
-    // Constructor for `BlockType::B` with motion vectors
-    explicit Macroblock(MacroblockType type,
-        Pos pos,
-        unsigned int split,
-        const std::vector<std::vector<std::tuple<int, int, int>>>& motionVectors);
+    Macroblock(MacroblockType type, const Block& block)
+        : Block(block)
+        , type(type)
+    {
+    }
+};
+
+/*
+ * The macroblocks of a frame, stored in flat arrays instead of a few allocations per block.
+ * Each macroblock has a record for itself, followed by 4 for its sub-blocks if it is split in mode 3
+ * (except S blocks); the records index the shared arrays of motion vectors and modes.
+ * The add functions validate the blocks like the JSON format expects, and throw std::invalid_argument.
+ */
+class MacroblockFrame {
+public:
+    // type S
+    void addS(Pos pos, const MotionVector& motionVector);
+    // type I (Intra-coded)
+    void addI(Pos pos, unsigned int split, const std::vector<std::vector<unsigned int>>& modes, unsigned int subSplit = 0);
+    // type P (Predicted) with motion vectors
+    void addP(Pos pos, unsigned int split, unsigned int subSplit, const std::vector<std::vector<MotionVector>>& motionVectors);
+    // type B with motion vectors
+    void addB(Pos pos, unsigned int split, const std::vector<std::vector<MotionVector>>& motionVectors);
+
+    size_t size() const { return types.size(); }
+    bool empty() const { return types.empty(); }
+    // the view of the macroblock i
+    Macroblock operator[](size_t i) const;
+    // of the arrays, without the unused capacity
+    size_t getBytes() const;
+    void shrinkToFit();
 
 private:
-    static Pos getScaledPos(const Pos& pos);
-    void initSubBlocksCommon(const Pos& parent_pos, unsigned int subSplit, const std::function<Block(unsigned int, Pos, unsigned int, unsigned int)>& blockConstructor);
+    // of each macroblock, the position is in macroblocks
+    std::vector<uint32_t> xs, ys;
+    std::vector<uint8_t> types;
+    std::vector<uint32_t> firstRecords; // with an extra one past the last record
+    // of each record
+    std::vector<uint8_t> splits;
+    std::vector<uint32_t> firstVectors, firstModes; // with an extra one past the last vector and mode
+    std::vector<MotionVector> vectors;
+    std::vector<unsigned int> modes;
 
-    void initSubBlocks(const Pos& parent_pos, unsigned int subSplit, const std::vector<std::vector<std::tuple<int, int, int>>>& vectors = {});
-    void initSubBlocks(const Pos& parent_pos, unsigned int subSplit, const std::vector<std::vector<unsigned int>>& modes);
+    void beginMacroblock(MacroblockType type, Pos pos);
+    void addRecord(unsigned int split, const std::vector<MotionVector>& blockVectors, const std::vector<unsigned int>& blockModes);
+    void endMacroblock();
+    // the sub-blocks are in the order of the JSON format, with 2 bits of subSplit per sub-block from the top left one
+    void addSubBlocks(unsigned int subSplit, const std::vector<std::vector<MotionVector>>& subVectors);
+    void addSubBlocks(unsigned int subSplit, const std::vector<std::vector<unsigned int>>& subModes);
 
-    static void validateVectors(const std::vector<std::vector<std::tuple<int, int, int>>>& vectors, size_t outer, std::optional<size_t> inner);
+    static void validateVectors(const std::vector<std::vector<MotionVector>>& vectors, size_t outer, std::optional<size_t> inner);
     static void validateModes(const std::vector<std::vector<unsigned int>>& modes, unsigned int split, unsigned int subSplit);
+};
+
+// the macroblocks of a super-cell, drawn instead of them when they are too small on the screen
+struct MacroblockSummary {
+    std::array<unsigned int, 4> typeCounts {}; // indexed by MacroblockType
+    float vectorSumX = 0, vectorSumY = 0; // of the motion vectors of the blocks and their sub-blocks
+    unsigned int vectors = 0;
+
+    void add(const MacroblockSummary& other);
+    bool empty() const;
+    MacroblockType getDominantType() const;
+    ImVec2 getMeanVector() const;
+};
+
+/*
+ * Uniform grid over the macroblocks, so that the overlay only goes through the visible ones.
+ * Each macroblock is listed in the cell of its top left corner, the cells of
+ * GRID_CELL_SIZE pixels are stored contiguously in row order.
+ * The cells are also summarized at coarser levels, level l having super-cells of GRID_CELL_SIZE << l pixels.
+ */
+class MacroblockGrid {
+public:
+    void build(const MacroblockFrame& macroblocks);
+
+    // appends the indices of the macroblocks whose block or motion vectors may intersect the region [from, to]
+    void query(ImVec2 from, ImVec2 to, std::vector<size_t>& indices) const;
+
+    unsigned int getSummaryLevels() const { return static_cast<unsigned int>(summaries.size()); }
+    size_t getBytes() const;
+    // appends the top left corners and the summaries of the non-empty super-cells of the level intersecting [from, to]
+    void querySummaries(ImVec2 from, ImVec2 to, unsigned int level,
+        std::vector<std::pair<ImVec2, const MacroblockSummary*>>& cells) const;
+
+private:
+    unsigned int cols = 0, rows = 0;
+    std::vector<size_t> cellStarts; // cell c has the indices cellStarts[c]..cellStarts[c+1]
+    std::vector<size_t> indices;
+    float reach = 0; // of the longest motion vector, in pixels along x or y
+    std::vector<std::vector<MacroblockSummary>> summaries; // of each level, in row order
 
+    static void getCellRange(float from, float to, float cellSize, unsigned int count, unsigned int& first, unsigned int& last);
 };
 #endif //MACROBLOCK_H
@@ -0,0 +1,131 @@
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <doctest.h>
+
+#include "MacroblockCache.hpp"
+#include "MacroblockCollection.hpp"
+#include "globals.hpp"
+
+namespace MacroblockCache {
+
+struct Entry {
+    std::shared_ptr<const MacroblockMetadata> metadata;
+    size_t bytes;
+    uint64_t lastUsed;
+};
+
+static std::unordered_map<std::string, Entry> cache;
+static std::mutex lock;
+static size_t cacheSize = 0;
+static bool cacheFull = false;
+// incremented at each use of the cache
+static uint64_t useCounter = 0;
+
+std::shared_ptr<const MacroblockMetadata> find(const std::string& key)
+{
+    std::lock_guard<std::mutex> _lock(lock);
+    auto i = cache.find(key);
+    if (i == cache.end())
+        return nullptr;
+    i->second.lastUsed = ++useCounter;
+    return i->second.metadata;
+}
+
+// releases the least recently used metadata until need bytes are available
+static bool makeRoomFor(size_t need)
+{
+    size_t limit = gMacroblockCacheLimitMB * 1000000;
+
+    if (need > limit)
+        return false;
+    while (cacheSize + need > limit) {
+        auto worst = cache.begin();
+        for (auto it = cache.begin(); it != cache.end(); it++) {
+            if (it->second.lastUsed < worst->second.lastUsed)
+                worst = it;
+        }
+        cacheSize -= worst->second.bytes;
+        cache.erase(worst);
+    }
+    return true;
+}
+
+void store(const std::string& key, std::shared_ptr<const MacroblockMetadata> metadata)
+{
+    std::lock_guard<std::mutex> _lock(lock);
+
+    if (cache.find(key) != cache.end())
+        return;
+    size_t bytes = metadata->getBytes();
+    cacheFull = cacheSize + bytes > gMacroblockCacheLimitMB * 1000000;
+    if (cacheFull && !makeRoomFor(bytes))
+        return;
+    cache[key] = Entry { metadata, bytes, ++useCounter };
+    cacheSize += bytes;
+}
+
+bool isFull()
+{
+    return cacheFull;
+}
+
+size_t getSize()
+{
+    std::lock_guard<std::mutex> _lock(lock);
+    return cacheSize;
+}
+
+void flush()
+{
+    std::lock_guard<std::mutex> _lock(lock);
+    cache.clear();
+    cacheSize = 0;
+    cacheFull = false;
+}
+
+}
+
+TEST_CASE("MacroblockCache")
+{
+    size_t previousLimit = gMacroblockCacheLimitMB;
+    gMacroblockCacheLimitMB = 1;
+    MacroblockCache::flush();
+
+    // three frames fit in the limit, not four
+    std::vector<std::shared_ptr<MacroblockMetadata>> frames;
+    for (int i = 0; i < 4; i++) {
+        auto metadata = std::make_shared<MacroblockMetadata>();
+        for (unsigned int j = 0; j < 6000; j++)
+            metadata->frame.addS(Pos({ j % 100, j / 100 }), MotionVector(i, j % 7, 0));
+        metadata->frame.shrinkToFit();
+        metadata->grid.build(metadata->frame);
+        frames.push_back(metadata);
+    }
+    size_t bytes = frames[0]->getBytes();
+    REQUIRE(3 * bytes <= 1000000);
+    REQUIRE(4 * bytes > 1000000);
+
+    MacroblockCache::store("0", frames[0]);
+    MacroblockCache::store("1", frames[1]);
+    MacroblockCache::store("2", frames[2]);
+    CHECK(!MacroblockCache::isFull());
+    CHECK(MacroblockCache::getSize() == 3 * bytes);
+
+    // the least recently used frame makes room for the next one
+    CHECK(MacroblockCache::find("0") == frames[0]);
+    MacroblockCache::store("3", frames[3]);
+    CHECK(MacroblockCache::isFull());
+    CHECK(MacroblockCache::find("1") == nullptr);
+    CHECK(MacroblockCache::find("0") == frames[0]);
+    CHECK(MacroblockCache::find("3") == frames[3]);
+    CHECK(MacroblockCache::getSize() == 3 * bytes);
+
+    MacroblockCache::flush();
+    CHECK(MacroblockCache::getSize() == 0);
+    CHECK(!MacroblockCache::isFull());
+    gMacroblockCacheLimitMB = previousLimit;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+struct MacroblockMetadata;
+
+// the macroblocks of the recent and upcoming frames, up to MACROBLOCK_CACHE_LIMIT
+namespace MacroblockCache {
+
+std::shared_ptr<const MacroblockMetadata> find(const std::string& key); // nullptr if the key is not cached
+
+void store(const std::string& key, std::shared_ptr<const MacroblockMetadata> metadata);
+
+bool isFull();
+
+size_t getSize();
+
+void flush();
+
+}
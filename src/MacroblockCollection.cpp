@@ -0,0 +1,602 @@
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <doctest.h>
+
+#include "MacroblockCache.hpp"
+#include "MacroblockCollection.hpp"
+#include "collection_expression.hpp"
+#include "json.hpp"
+
+namespace {
+
+/*
+ * Builds the macroblocks while the JSON is read (see nlohmann::json::sax_parse), without the DOM of the file.
+ * The depth is the number of opened containers: the root object is at depth 1, the 'macroblocks' array at depth 2,
+ * a block at depth 3, and its fields up to depth 6 (a motion vector in a row of 'motion_vectors').
+ * The values of the unknown keys are skipped, the unexpected values throw std::runtime_error.
+ */
+class MacroblockParser {
+public:
+    MacroblockFrame frame;
+    bool found = false; // the 'macroblocks' array
+
+    bool null() { return scalar("null"); }
+    bool boolean(bool) { return scalar("boolean"); }
+    bool number_integer(nlohmann::json::number_integer_t value) { return number(value); }
+    bool number_unsigned(nlohmann::json::number_unsigned_t value) { return number(value); }
+    bool number_float(nlohmann::json::number_float_t value, const std::string&) { return number(value); }
+    bool binary(nlohmann::json::binary_t&) { return scalar("binary"); }
+
+    bool string(std::string& value)
+    {
+        if (skipped())
+            return true;
+        if (depth != 3 || field != TYPE || value.empty())
+            return unexpected("string");
+        type = value[0];
+        return true;
+    }
+
+    bool key(std::string& key)
+    {
+        if (skipFrom >= 0)
+            return true;
+        if (depth == 1 && key == "macroblocks") {
+            field = MACROBLOCKS;
+        } else if (depth == 3 && key == "type") {
+            field = TYPE;
+        } else if (depth == 3 && key == "pos") {
+            field = POS;
+        } else if (depth == 3 && key == "split") {
+            field = SPLIT;
+        } else if (depth == 3 && key == "sub_split") {
+            field = SUB_SPLIT;
+        } else if (depth == 3 && key == "motion_vectors") {
+            field = MOTION_VECTORS;
+        } else if (depth == 3 && key == "modes") {
+            field = MODES;
+        } else {
+            skipFrom = depth;
+        }
+        return true;
+    }
+
+    bool start_object(size_t)
+    {
+        depth++;
+        if (skipFrom >= 0 || depth == 1)
+            return true;
+        if (depth != 3 || field != MACROBLOCKS)
+            return unexpected("object");
+        beginBlock();
+        return true;
+    }
+
+    bool end_object()
+    {
+        if (depth == 3 && skipFrom < 0)
+            endBlock();
+        return end();
+    }
+
+    bool start_array(size_t)
+    {
+        depth++;
+        if (skipFrom >= 0)
+            return true;
+        if (depth == 2 && field == MACROBLOCKS) {
+            found = true;
+        } else if (depth == 4 && field == POS) {
+            posCount = 0;
+        } else if (depth == 4 && field == MOTION_VECTORS) {
+            recycleRows(motionVectors, spareVectors);
+        } else if (depth == 4 && field == MODES) {
+            recycleRows(modes, spareModes);
+        } else if (depth == 5 && field == MOTION_VECTORS) {
+            newRow(motionVectors, spareVectors);
+        } else if (depth == 5 && field == MODES) {
+            newRow(modes, spareModes);
+        } else if (depth == 6 && field == MOTION_VECTORS) {
+            components = 0;
+        } else {
+            return unexpected("array");
+        }
+        return true;
+    }
+
+    bool end_array()
+    {
+        if (skipFrom < 0) {
+            if (depth == 2) {
+                field = NONE;
+            } else if (depth == 4 && field == POS && posCount < 2) {
+                return unexpected("position");
+            } else if (depth == 6) {
+                if (components < 3)
+                    return unexpected("motion vector");
+                motionVectors.back().emplace_back(vector[0], vector[1], vector[2]);
+            }
+        }
+        return end();
+    }
+
+    template <typename Exception>
+    bool parse_error(size_t, const std::string&, const Exception& e)
+    {
+        throw std::runtime_error(e.what());
+    }
+
+private:
+    enum Field {
+        NONE,
+        MACROBLOCKS,
+        TYPE,
+        POS,
+        SPLIT,
+        SUB_SPLIT,
+        MOTION_VECTORS,
+        MODES,
+    };
+
+    int depth = 0;
+    int skipFrom = -1; // the depth of the key whose value is skipped
+    Field field = NONE;
+
+    // of the current block, the rows keep their capacity from one block to the next
+    char type = 'S';
+    std::array<unsigned int, 2> pos {};
+    unsigned int posCount = 0;
+    unsigned int split = 0, subSplit = 0;
+    std::vector<std::vector<MotionVector>> motionVectors, spareVectors;
+    std::vector<std::vector<unsigned int>> modes, spareModes;
+    std::array<int, 3> vector {};
+    unsigned int components = 0;
+
+    template <typename T>
+    static void recycleRows(std::vector<std::vector<T>>& rows, std::vector<std::vector<T>>& spare)
+    {
+        for (auto& row : rows) {
+            row.clear();
+            spare.push_back(std::move(row));
+        }
+        rows.clear();
+    }
+
+    template <typename T>
+    static void newRow(std::vector<std::vector<T>>& rows, std::vector<std::vector<T>>& spare)
+    {
+        if (spare.empty()) {
+            rows.emplace_back();
+        } else {
+            rows.push_back(std::move(spare.back()));
+            spare.pop_back();
+        }
+    }
+
+    static bool unexpected(const char* what)
+    {
+        throw std::runtime_error(std::string("unexpected ") + what + " in the macroblocks");
+    }
+
+    // the end of a skipped value, if it is a scalar
+    bool skipped()
+    {
+        if (skipFrom < 0)
+            return false;
+        if (depth == skipFrom)
+            skipFrom = -1;
+        return true;
+    }
+
+    bool scalar(const char* what)
+    {
+        return skipped() || unexpected(what);
+    }
+
+    bool end()
+    {
+        depth--;
+        if (depth == skipFrom)
+            skipFrom = -1;
+        else if (depth == 2 && skipFrom < 0)
+            field = MACROBLOCKS; // the next block
+        return true;
+    }
+
+    template <typename T>
+    bool number(T value)
+    {
+        if (skipped())
+            return true;
+        if (depth == 3 && field == SPLIT) {
+            split = static_cast<unsigned int>(value);
+        } else if (depth == 3 && field == SUB_SPLIT) {
+            subSplit = static_cast<unsigned int>(value);
+        } else if (depth == 4 && field == POS) {
+            if (posCount < 2)
+                pos[posCount] = static_cast<unsigned int>(value);
+            posCount++;
+        } else if (depth == 5 && field == MODES) {
+            modes.back().push_back(static_cast<unsigned int>(value));
+        } else if (depth == 6 && field == MOTION_VECTORS) {
+            if (components < 3)
+                vector[components] = static_cast<int>(value);
+            components++;
+        } else {
+            return unexpected("number");
+        }
+        return true;
+    }
+
+    void beginBlock()
+    {
+        type = 'S';
+        pos = { 0, 0 };
+        split = 0;
+        subSplit = 0;
+        recycleRows(motionVectors, spareVectors);
+        recycleRows(modes, spareModes);
+    }
+
+    void endBlock()
+    {
+        switch (type) {
+        case 'I':
+            frame.addI(Pos(pos), split, modes, subSplit);
+            break;
+        case 'P':
+            frame.addP(Pos(pos), split, subSplit, motionVectors);
+            break;
+        case 'B':
+            frame.addB(Pos(pos), split, motionVectors);
+            break;
+        case 'S':
+            if (motionVectors.empty() || motionVectors.front().empty())
+                throw std::invalid_argument("S block without motion vector");
+            frame.addS(Pos(pos), motionVectors.front().front());
+            break;
+        default:
+            frame.addI(Pos(pos), 0, {}, 0);
+            break;
+        }
+    }
+};
+
+}
+
+MacroblockFrame parseMacroblocks(std::istream& jsonFile)
+{
+    MacroblockParser parser;
+    nlohmann::json::sax_parse(jsonFile, &parser);
+    if (!parser.found) {
+        throw std::runtime_error("JSON file is missing 'macroblocks' array.");
+    }
+    parser.frame.shrinkToFit();
+    return std::move(parser.frame);
+}
+
+MacroblockProvider::MacroblockProvider(std::shared_ptr<const MacroblockCollection> collection, int index,
+    std::shared_ptr<const MacroblockMetadata> cached)
+    : collection(collection)
+    , index(index)
+    , result(cached)
+    , loaded(cached != nullptr)
+{
+}
+
+void MacroblockProvider::progress()
+{
+    if (loaded)
+        return;
+    // another provider of the same frame might have been faster
+    std::string key = collection->getKey(index);
+    std::shared_ptr<const MacroblockMetadata> metadata = MacroblockCache::find(key);
+    if (!metadata) {
+        metadata = collection->load(index);
+        MacroblockCache::store(key, metadata);
+    }
+    result = metadata;
+    loaded = true;
+}
+
+MacroblockCollection::MacroblockCollection(const std::string& expression)
+    : filenames(buildFilenamesFromExpression(expression))
+{
+    if (filenames.size() == 1) {
+        fs::path extension = filenames[0].extension();
+        lines = extension == ".jsonl" || extension == ".ndjson";
+    }
+}
+
+std::string MacroblockCollection::getKey(int index) const
+{
+    if (lines)
+        return filenames[0].string() + ":" + std::to_string(index);
+    if (filenames.size() == 1)
+        return filenames[0].string();
+    if (index < 0 || static_cast<size_t>(index) >= filenames.size())
+        return "";
+    return filenames[index].string();
+}
+
+std::shared_ptr<MacroblockProvider> MacroblockCollection::getProvider(int index) const
+{
+    std::string key = getKey(index);
+    if (key.empty())
+        return nullptr;
+    return std::make_shared<MacroblockProvider>(shared_from_this(), index, MacroblockCache::find(key));
+}
+
+bool MacroblockCollection::readLine(int index, std::string& line) const
+{
+    std::streamoff offset;
+    {
+        std::lock_guard<std::mutex> _lock(indexLock);
+        if (!indexed) {
+            // skips the lines without copying them, the file can be much larger than the cache
+            std::ifstream file(filenames[0], std::ios::binary);
+            while (file.peek() != std::ifstream::traits_type::eof()) {
+                lineOffsets.push_back(file.tellg());
+                file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            }
+            indexed = true;
+        }
+        if (index < 0 || static_cast<size_t>(index) >= lineOffsets.size())
+            return false;
+        offset = lineOffsets[index];
+    }
+
+    std::ifstream file(filenames[0], std::ios::binary);
+    file.seekg(offset);
+    return static_cast<bool>(std::getline(file, line));
+}
+
+std::shared_ptr<const MacroblockMetadata> MacroblockCollection::load(int index) const
+{
+    auto metadata = std::make_shared<MacroblockMetadata>();
+    std::string filename = lines ? filenames[0].string() : getKey(index);
+    try {
+        if (lines) {
+            std::string line;
+            // the frames after the last line and the blank lines have no macroblocks
+            if (!readLine(index, line) || line.find_first_not_of(" \t\r") == std::string::npos)
+                return metadata;
+            std::istringstream json(line);
+            metadata->frame = parseMacroblocks(json);
+        } else {
+            std::ifstream json(filename);
+            if (!json.is_open()) {
+                fprintf(stderr, "could not open json file '%s', skipped\n", filename.c_str());
+                return metadata;
+            }
+            metadata->frame = parseMacroblocks(json);
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "invalid macroblocks in '%s' (frame %d): %s\n", filename.c_str(), index + 1, e.what());
+        metadata->frame = MacroblockFrame();
+    }
+    metadata->grid.build(metadata->frame);
+    return metadata;
+}
+
+TEST_CASE("MacroblockCollection")
+{
+    MacroblockCache::flush();
+    fs::path directory = fs::temp_directory_path() / "vpv-macroblocks-test";
+    fs::create_directories(directory);
+    const char* block = "{\"macroblocks\": [{\"type\": \"S\", \"pos\": [1, 2], \"motion_vectors\": [[[3, 4, 0]]]}";
+
+    SUBCASE("one frame per line")
+    {
+        std::ofstream(directory / "frames.jsonl") << block << "]}\n"
+                                                  << "\n"
+                                                  << "{\"macroblocks\": 3}\n"
+                                                  << block << ", {\"type\": \"B\", \"pos\": [2, 2], \"split\": 0, \"motion_vectors\": [[[1, 1, 0], [2, 2, 1]]]}]}\n";
+        auto collection = std::make_shared<MacroblockCollection>((directory / "frames.jsonl").string());
+        CHECK(collection->getKey(0) != collection->getKey(3));
+        CHECK(collection->load(0)->frame.size() == 1);
+        CHECK(collection->load(1)->frame.empty()); // blank
+        CHECK(collection->load(2)->frame.empty()); // invalid
+        CHECK(collection->load(4)->frame.empty()); // after the last line
+        auto metadata = collection->load(3);
+        REQUIRE(metadata->frame.size() == 2);
+        CHECK(metadata->frame[1].type == B);
+        CHECK(metadata->frame[1].getTopLeft().x == 2 * MACROBLOCK_SIZE);
+        std::vector<size_t> visible;
+        metadata->grid.query(ImVec2(0, 0), ImVec2(100, 100), visible);
+        CHECK(visible.size() == 2);
+
+        // the second provider finds the macroblocks in the cache
+        auto provider = collection->getProvider(3);
+        CHECK(!provider->isLoaded());
+        provider->progress();
+        CHECK(provider->isLoaded());
+        CHECK(provider->getResult()->frame.size() == 2);
+        auto cached = collection->getProvider(3);
+        CHECK(cached->isLoaded());
+        CHECK(cached->getResult() == provider->getResult());
+    }
+
+    SUBCASE("one file per frame")
+    {
+        std::ofstream(directory / "0.json") << block << "]}";
+        std::ofstream(directory / "1.json") << "{\"macroblocks\": []}";
+        auto collection = std::make_shared<MacroblockCollection>((directory / "*.json").string());
+        CHECK(collection->load(0)->frame.size() == 1);
+        CHECK(collection->load(1)->frame.empty());
+        CHECK(collection->getProvider(1) != nullptr);
+        CHECK(collection->getProvider(2) == nullptr);
+    }
+
+    SUBCASE("the same file for each frame")
+    {
+        std::ofstream(directory / "all.json") << block << "]}";
+        auto collection = std::make_shared<MacroblockCollection>((directory / "all.json").string());
+        CHECK(collection->getKey(0) == collection->getKey(5));
+        CHECK(collection->load(5)->frame.size() == 1);
+    }
+
+    fs::remove_all(directory);
+    MacroblockCache::flush();
+}
+
+// the parsing through the DOM of the whole file, which parseMacroblocks replaced, to check it and to compare their speed
+static MacroblockFrame parseMacroblocksWithDOM(std::istream& jsonFile)
+{
+    nlohmann::json j;
+    jsonFile >> j;
+
+    if (!j.contains("macroblocks") || !j["macroblocks"].is_array()) {
+        throw std::runtime_error("JSON file is missing 'macroblocks' array.");
+    }
+
+    MacroblockFrame macroblocks;
+    for (const auto& block : j["macroblocks"]) {
+
+        auto pos = Pos(block.value("pos", std::array<unsigned int, 2>()));
+        std::vector<std::vector<std::tuple<int, int, int>>> motionVectors;
+
+        if (block.contains("motion_vectors")) {
+            for (const auto& row : block["motion_vectors"]) {
+                std::vector<std::tuple<int, int, int>> rowVectors;
+                for (const auto& vec : row) {
+                    rowVectors.emplace_back(vec.at(0), vec.at(1), vec.at(2));
+                }
+                motionVectors.push_back(rowVectors);
+            }
+        }
+        char block_type = block.value("type", "S").at(0);
+        unsigned int split = block.value("split", 0);
+
+        switch (block_type) {
+        case 'I':
+            macroblocks.addI(pos, split, block.value("modes", std::vector<std::vector<unsigned int>>()), block.value("sub_split", 0));
+            break;
+        case 'P':
+            macroblocks.addP(pos, split, block.value("sub_split", 0), motionVectors);
+            break;
+        case 'B':
+            macroblocks.addB(pos, split, motionVectors);
+            break;
+        case 'S':
+            if (motionVectors.empty() || motionVectors.front().empty())
+                throw std::invalid_argument("S block without motion vector");
+            macroblocks.addS(pos, motionVectors.front().front());
+            break;
+        default:
+            macroblocks.addI(pos, 0, std::vector<std::vector<unsigned int>>(), 0);
+            break;
+        }
+    }
+
+    macroblocks.shrinkToFit();
+    return macroblocks;
+}
+
+static void checkSameBlock(const Block& a, const Block& b)
+{
+    CHECK(a.getX() == b.getX());
+    CHECK(a.getY() == b.getY());
+    CHECK(a.size == b.size);
+    CHECK(a.split == b.split);
+    CHECK(std::vector<MotionVector>(a.motionVectors.begin(), a.motionVectors.end())
+        == std::vector<MotionVector>(b.motionVectors.begin(), b.motionVectors.end()));
+    CHECK(std::vector<unsigned int>(a.modes.begin(), a.modes.end())
+        == std::vector<unsigned int>(b.modes.begin(), b.modes.end()));
+}
+
+static MacroblockFrame parseMacroblocks(const std::string& text, bool dom = false)
+{
+    std::istringstream json(text);
+    return dom ? parseMacroblocksWithDOM(json) : parseMacroblocks(json);
+}
+
+TEST_CASE("parseMacroblocks")
+{
+    const char* text = R"({"codec": {"name": "h264", "profiles": [1, 2, {"x": null}]},
+        "macroblocks": [
+            {"type": "S", "pos": [1, 2], "motion_vectors": [[[3, -4, 0]]], "extra": [[1], {"a": "b"}]},
+            {"type": "I", "pos": [2, 2], "split": 0, "modes": [[7]]},
+            {"type": "I", "pos": [3, 2], "split": 3, "sub_split": 255, "modes": [[1, 2, 3, 4], [5, 6, 7, 8], [0, 1, 2, 3], [4, 5, 6, 7]]},
+            {"pos": [4, 2], "type": "P", "split": 3, "sub_split": 57, "motion_vectors": [[[1, 1, 1]], [[2, 2, 1]], [[3, 3, 1], [4, 4, 2]], [[5, 5, 1]]]},
+            {"type": "P", "pos": [5, 2], "split": 1, "motion_vectors": [[[1, 2, 0], [3, 4, 0]]], "qp": 27.5},
+            {"type": "B", "pos": [6, 2], "split": 2, "motion_vectors": [[[5, 5, 1]], [[6, 6, 2], [7, 7, 3]]]},
+            {"type": "B", "pos": [7, 2], "split": 3, "motion_vectors": [[[1, 0, 1]], [[2, 0, 1]], [[3, 0, 1]], [[4, 0, 1]]]}
+        ],
+        "frame": 3})";
+
+    // the same macroblocks as through the DOM
+    MacroblockFrame frame = parseMacroblocks(text);
+    MacroblockFrame expected = parseMacroblocks(text, true);
+    REQUIRE(frame.size() == 7);
+    REQUIRE(expected.size() == 7);
+    for (size_t i = 0; i < frame.size(); i++) {
+        Macroblock a = frame[i];
+        Macroblock b = expected[i];
+        CHECK(a.type == b.type);
+        checkSameBlock(a, b);
+        REQUIRE(a.blocks.has_value() == b.blocks.has_value());
+        if (a.blocks.has_value()) {
+            for (size_t k = 0; k < 4; k++)
+                checkSameBlock(a.blocks.value()[k], b.blocks.value()[k]);
+        }
+    }
+    CHECK(frame.getBytes() == expected.getBytes());
+
+    CHECK_THROWS_AS(parseMacroblocks(R"({"frames": []})"), std::runtime_error);
+    CHECK_THROWS_AS(parseMacroblocks(R"([{"macroblocks": []}])"), std::runtime_error);
+    CHECK_THROWS_AS(parseMacroblocks(R"({"macroblocks": {}})"), std::runtime_error);
+    CHECK_THROWS_AS(parseMacroblocks(R"({"macroblocks": [{"pos": "a"}]})"), std::runtime_error);
+    CHECK_THROWS_AS(parseMacroblocks(R"({"macroblocks": [{"type": "S", "motion_vectors": [[[1, 2]]]}]})"), std::runtime_error);
+    CHECK_THROWS_AS(parseMacroblocks(R"({"macroblocks": [{"type": "S", "pos": [1, 2], "motion_vectors": [[[1, 2, 0]]]})"), std::runtime_error);
+    CHECK_THROWS_AS(parseMacroblocks(R"({"macroblocks": [{"type": "P", "split": 7}]})"), std::invalid_argument);
+    CHECK(parseMacroblocks(R"({"macroblocks": []})").empty());
+}
+
+// run with: tests -tc="macroblocks parsing benchmark" --no-skip
+TEST_CASE("macroblocks parsing benchmark" * doctest::skip())
+{
+    // the blocks of 30 frames of 1920x1088
+    const unsigned int cols = 120, rows = 68;
+    std::string text = "{\"macroblocks\": [";
+    for (unsigned int i = 0; i < 30 * cols * rows; i++) {
+        std::string pos = "\"pos\": [" + std::to_string(i % cols) + ", " + std::to_string(i / cols % rows) + "]";
+        if (i)
+            text += ",\n";
+        switch (i % 4) {
+        case 0:
+            text += "{\"type\": \"S\", " + pos + ", \"motion_vectors\": [[[3, -4, 0]]]}";
+            break;
+        case 1:
+            text += "{\"type\": \"I\", " + pos + ", \"split\": 3, \"sub_split\": 255, \"modes\": [[1, 2, 3, 4], [5, 6, 7, 8], [0, 1, 2, 3], [4, 5, 6, 7]]}";
+            break;
+        case 2:
+            text += "{\"type\": \"P\", " + pos + ", \"split\": 3, \"sub_split\": 57, \"motion_vectors\": [[[1, 1, 1]], [[2, -2, 1]], [[3, 3, 1], [-4, 4, 2]], [[5, 5, 1]]]}";
+            break;
+        case 3:
+            text += "{\"type\": \"B\", " + pos + ", \"split\": 2, \"motion_vectors\": [[[5, 5, 1]], [[6, -6, 2], [7, 7, 3]]]}";
+            break;
+        }
+    }
+    text += "]}";
+
+    double times[2];
+    size_t sizes[2];
+    for (int dom = 0; dom < 2; dom++) {
+        auto start = std::chrono::steady_clock::now();
+        MacroblockFrame frame = parseMacroblocks(text, dom);
+        times[dom] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        sizes[dom] = frame.size();
+    }
+    CHECK(sizes[0] == sizes[1]);
+    MESSAGE(sizes[0] << " macroblocks in " << text.size() / 1000000. << "MB of JSON: sax " << times[0] << "ms, dom " << times[1] << "ms");
+}
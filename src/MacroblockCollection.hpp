@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Macroblock.hpp"
+#include "Progressable.hpp"
+#include "fs.hpp"
+
+// the macroblocks of a frame, with the grid to draw only the visible ones
+struct MacroblockMetadata {
+    MacroblockFrame frame;
+    MacroblockGrid grid;
+
+    size_t getBytes() const { return frame.getBytes() + grid.getBytes(); }
+};
+
+// reads a JSON object with a 'macroblocks' array, throws std::exception if it is invalid
+MacroblockFrame parseMacroblocks(std::istream& json);
+
+class MacroblockCollection;
+
+// loads the macroblocks of a frame on the I/O thread and stores them in the MacroblockCache
+class MacroblockProvider : public Progressable {
+    std::shared_ptr<const MacroblockCollection> collection;
+    int index;
+    std::shared_ptr<const MacroblockMetadata> result;
+    std::atomic<bool> loaded;
+
+public:
+    MacroblockProvider(std::shared_ptr<const MacroblockCollection> collection, int index,
+        std::shared_ptr<const MacroblockMetadata> cached);
+
+    float getProgressPercentage() const override { return loaded ? 1.f : 0.f; }
+    bool isLoaded() const override { return loaded; }
+    void progress() override;
+
+    // once loaded, empty if the frame could not be read
+    std::shared_ptr<const MacroblockMetadata> getResult() const { return result; }
+};
+
+/*
+ * The macroblocks of the frames of a sequence, given by metadata:<expression>:
+ * several files have the macroblocks of one frame each, in the order of the expression,
+ * a single .jsonl (or .ndjson) file has one frame per line, the lines are indexed at the first load,
+ * and a single .json file has the macroblocks shown on every frame.
+ */
+class MacroblockCollection : public std::enable_shared_from_this<MacroblockCollection> {
+public:
+    explicit MacroblockCollection(const std::string& expression);
+
+    bool empty() const { return filenames.empty(); }
+    // the frames showing the same macroblocks have the same key
+    std::string getKey(int index) const;
+    // already loaded if the macroblocks are cached, nullptr if the frame has no file
+    std::shared_ptr<MacroblockProvider> getProvider(int index) const;
+    // reads the macroblocks of the frame, they are empty if they cannot be read (the error is printed)
+    std::shared_ptr<const MacroblockMetadata> load(int index) const;
+
+private:
+    std::vector<fs::path> filenames;
+    bool lines = false;
+
+    // of the lines of the single file, built by the first load
+    mutable std::mutex indexLock;
+    mutable bool indexed = false;
+    mutable std::vector<std::streamoff> lineOffsets;
+
+    // false if the file has less lines
+    bool readLine(int index, std::string& line) const;
+};
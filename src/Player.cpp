@@ -187,10 +187,30 @@ void Player::checkBounds()
 void Player::reconfigureBounds()
 {
     minFrame = 1;
-    maxFrame = 0;
     currentMinFrame = minFrame;
     currentMaxFrame = std::numeric_limits<int>::max();
 
+    updateMaxFrame();
+    checkBounds();
+}
+
+void Player::onSequenceGrowth()
+{
+    int previousMaxFrame = maxFrame;
+    updateMaxFrame();
+
+    // keep following the end of the sequences unless the range was restricted by the user
+    if (currentMaxFrame >= previousMaxFrame) {
+        currentMaxFrame = maxFrame;
+    }
+    // the frame is not clamped: it might have been requested (p:frame:)
+    // before the sequences were completely listed
+}
+
+void Player::updateMaxFrame()
+{
+    maxFrame = 0;
+
     std::vector<std::weak_ptr<Sequence>> to_remove;
     for (const auto& ptr : sequences) {
         if (const auto& seq = ptr.lock()) {
@@ -205,8 +225,6 @@ void Player::reconfigureBounds()
     for (const auto& ptr : to_remove) {
         sequences.erase(ptr);
     }
-
-    checkBounds();
 }
 
 void Player::onSequenceAttach(std::weak_ptr<Sequence> s)
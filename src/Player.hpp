@@ -11,6 +11,8 @@ struct Player : std::enable_shared_from_this<Player> {
 private:
     std::set<std::weak_ptr<struct Sequence>, std::owner_less<std::weak_ptr<struct Sequence>>> sequences;
 
+    void updateMaxFrame();
+
 public:
     std::string ID;
 
@@ -40,6 +42,7 @@ public:
     void checkShortcuts();
     void checkBounds();
     void reconfigureBounds();
+    void onSequenceGrowth();
 
     void onSequenceAttach(std::weak_ptr<struct Sequence> s);
     void onSequenceDetach(std::weak_ptr<struct Sequence> s);
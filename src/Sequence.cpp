@@ -35,8 +35,14 @@ Sequence::Sequence()
     uneditedCollection = nullptr;
 
     valid = false;
+    knownLength = 0;
 
     loadedFrame = -1;
+
+    autoScale = false;
+    autoScaleQuantile = 0;
+    autoScalePending = false;
+    regionAutoScaleUsed = false;
 }
 
 Sequence::~Sequence()
@@ -48,7 +54,8 @@ void Sequence::setImageCollection(std::shared_ptr<ImageCollection> new_imagecoll
     uneditedCollection = new_imagecollection;
     name = new_name;
 
-    valid = uneditedCollection->getLength();
+    knownLength = uneditedCollection->getLength();
+    valid = knownLength;
     loadedFrame = -1;
 
     // validation updates the collection member
@@ -56,21 +63,28 @@ void Sequence::setImageCollection(std::shared_ptr<ImageCollection> new_imagecoll
     editGUI.validate(*this);
 }
 
-void Sequence::setSVGGlobs(const std::vector<std::string>& svgglobs)
+// the 'auto' SVGs are next to the images, with the same names
+static void addAutoSVGFilenames(const ImageCollection& collection, std::vector<fs::path>& files)
+{
+    for (int i = files.size(); i < collection.getLength(); i++) {
+        std::string filename = collection.getFilename(i);
+        int h;
+        for (h = filename.size() - 1; h > 0 && filename[h] != '.'; h--)
+            ;
+        filename.resize(h);
+        filename = filename + ".svg";
+        files.push_back(filename);
+    }
+}
+
+void Sequence::setSVGGlobs(const std::vector<std::string>& new_svgglobs)
 {
+    svgglobs = new_svgglobs;
     svgcollection.clear();
     for (const auto& glob : svgglobs) {
         std::vector<fs::path> files;
         if (glob == "auto") {
-            for (int i = 0; i < uneditedCollection->getLength(); i++) {
-                std::string filename = uneditedCollection->getFilename(i);
-                int h;
-                for (h = filename.size() - 1; h > 0 && filename[h] != '.'; h--)
-                    ;
-                filename.resize(h);
-                filename = filename + ".svg";
-                files.push_back(filename);
-            }
+            addAutoSVGFilenames(*uneditedCollection, files);
         } else {
             files = buildFilenamesFromExpression(glob);
         }
@@ -89,8 +103,32 @@ int Sequence::getDesiredFrameIndex() const
     return std::min(player->frame, collection->getLength());
 }
 
+void Sequence::onCollectionGrowth()
+{
+    // the collection is still being listed in the background (see ProgressiveImageCollection)
+    valid = knownLength;
+    if (player)
+        player->onSequenceGrowth();
+    if (!image && !imageprovider && error.empty())
+        forgetImage();
+    // only the new files get their 'auto' SVGs, the other globs are not listed again
+    for (size_t i = 0; i < svgglobs.size() && i < svgcollection.size(); i++) {
+        if (svgglobs[i] != "auto")
+            continue;
+        if (svgcollection[i].size() > (size_t)knownLength)
+            svgcollection[i].clear();
+        addAutoSVGFilenames(*uneditedCollection, svgcollection[i]);
+    }
+    gActive = std::max(gActive, 2);
+}
+
 void Sequence::tick()
 {
+    if (uneditedCollection && uneditedCollection->getLength() != knownLength) {
+        knownLength = uneditedCollection->getLength();
+        onCollectionGrowth();
+    }
+
     bool shouldShowDifferentFrame = false;
     if (player && collection && loadedFrame != getDesiredFrameIndex()) {
         shouldShowDifferentFrame = true;
@@ -110,17 +148,50 @@ void Sequence::tick()
         }
         gActive = std::max(gActive, 2);
         imageprovider = nullptr;
+        preview = ImagePreview();
         if (image) {
             auto mode = gSmoothHistogram ? Histogram::Mode::SMOOTH : Histogram::Mode::EXACT;
             image->histogram->request(image, mode);
+            autoScalePending = gAutoScalePlayback && autoScale && colormap;
         }
     }
 
-    if (image && colormap && !colormap->initialized) {
-        colormap->autoCenterAndRadius(image->min, image->max);
+    if (autoScalePending && image) {
+        // the quantiles are read from the histograms computed in the background,
+        // instead of sorting the pixels here (see compute_quantiles)
+        std::shared_ptr<Progressable> histogram = getAutoScaleHistogram();
+        if (!histogram || histogram->isLoaded()) {
+            autoScalePending = false;
+            if (autoScale)
+                autoScaleAndBias(autoScaleFrom, autoScaleTo, autoScaleQuantile);
+        }
+    }
+
+    if (imageprovider) {
+        preview = imageprovider->getPreview();
+    }
+
+    if (player && collection && macroblockCollection && collection->getLength() > 0) {
+        int frame = getDesiredFrameIndex() - 1;
+        std::string key = macroblockCollection->getKey(frame);
+        if (key != macroblocksKey) {
+            macroblocksKey = key;
+            macroblocks = nullptr;
+            macroblockprovider = macroblockCollection->getProvider(frame);
+        }
+        if (macroblockprovider && macroblockprovider->isLoaded()) {
+            macroblocks = macroblockprovider->getResult();
+            macroblockprovider = nullptr;
+            gActive = std::max(gActive, 2);
+        }
+    }
+
+    std::shared_ptr<Image> shown = image ? image : preview.image;
+    if (shown && colormap && !colormap->initialized) {
+        colormap->autoCenterAndRadius(shown->min, shown->max);
 
         if (!colormap->shader) {
-            switch (image->c) {
+            switch (shown->c) {
             case 1:
                 colormap->shader = getShader("gray");
                 break;
@@ -141,6 +212,7 @@ void Sequence::tick()
 void Sequence::forgetImage()
 {
     image = nullptr;
+    preview = ImagePreview();
     if (player && collection && collection->getLength() > 0) {
         int desiredFrame = getDesiredFrameIndex();
         imageprovider = collection->getImageProvider(desiredFrame - 1);
@@ -154,6 +226,11 @@ void Sequence::autoScaleAndBias(ImVec2 p1, ImVec2 p2, float quantile)
     if (!img)
         return;
 
+    autoScale = true;
+    autoScaleFrom = p1;
+    autoScaleTo = p2;
+    autoScaleQuantile = quantile;
+
     BandIndices bands = colormap->bands;
     float low = std::numeric_limits<float>::max();
     float high = std::numeric_limits<float>::lowest();
@@ -183,81 +260,50 @@ void Sequence::autoScaleAndBias(ImVec2 p1, ImVec2 p2, float quantile)
     }
 
     if (quantile == 0) {
+        regionAutoScaleUsed |= !norange;
         if (norange) {
             low = img->min;
             high = img->max;
         } else {
-            const float* data = (const float*)img->pixels;
             for (int d = 0; d < 3; d++) {
-                int b = bands[d];
+                size_t b = bands[d];
                 if (b >= img->c)
                     continue;
-                for (int y = p1.y; y < p2.y; y++) {
-                    for (int x = p1.x; x < p2.x; x++) {
-                        float v = data[b + img->c * (x + y * img->w)];
-                        if (std::isfinite(v)) {
-                            low = std::min(low, v);
-                            high = std::max(high, v);
-                        }
-                    }
-                }
+                img->getRangeInRegion(b, p1.x, p1.y, std::ceil(p2.x), std::ceil(p2.y), low, high);
             }
         }
     } else {
-        std::vector<float> all;
-        const float* data = (const float*)img->pixels;
-        if (norange) {
-            if (img->c <= 3 && bands == BANDS_DEFAULT) {
-                // fast path
-                all = std::vector<float>(data, data + img->w * img->h * img->c);
-            } else {
-                for (int d = 0; d < 3; d++) {
-                    int b = bands[d];
-                    if (b >= img->c)
-                        continue;
-                    for (int y = 0; y < img->h; y++) {
-                        for (int x = 0; x < img->w; x++) {
-                            float v = data[b + img->c * (x + y * img->w)];
-                            all.push_back(v);
-                        }
-                    }
-                }
-            }
-        } else {
-            if (img->c <= 3 && bands == BANDS_DEFAULT) {
-                // fast path
-                for (int y = p1.y; y < p2.y; y++) {
-                    const float* start = &data[0 + img->c * ((int)p1.x + y * img->w)];
-                    const float* end = &data[0 + img->c * ((int)p2.x + y * img->w)];
-                    all.insert(all.end(), start, end);
-                }
-            } else {
-                for (int d = 0; d < 3; d++) {
-                    int b = bands[d];
-                    if (b >= img->c)
-                        continue;
-                    for (int y = p1.y; y < p2.y; y++) {
-                        for (int x = p1.x; x < p2.x; x++) {
-                            float v = data[b + img->c * (x + y * img->w)];
-                            all.push_back(v);
-                        }
-                    }
-                }
-            }
+        std::vector<size_t> used;
+        for (int d = 0; d < 3; d++) {
+            if (bands[d] < img->c)
+                used.push_back(bands[d]);
         }
-        all.erase(std::remove_if(all.begin(), all.end(),
-                      [](float x) { return !std::isfinite(x); }),
-            all.end());
-        std::sort(all.begin(), all.end());
-        low = all[quantile * all.size()];
-        high = all[(1 - quantile) * all.size()];
+        ImRect region(0, 0, 0, 0);
+        if (!norange)
+            region = ImRect(std::floor(p1.x), std::floor(p1.y), std::ceil(p2.x), std::ceil(p2.y));
+        if (!compute_quantiles(img, used, region, quantile, low, high))
+            return;
     }
 
     colormap->autoCenterAndRadius(low, high);
 }
 
+std::shared_ptr<Progressable> Sequence::getAutoScaleHistogram() const
+{
+    std::shared_ptr<Image> image = this->image;
+    if (!autoScalePending || !image || autoScaleQuantile == 0)
+        return nullptr;
+    // only the exact histogram of the whole image can be used, the integral one gives any region
+    bool norange = autoScaleFrom.x == autoScaleTo.x && autoScaleFrom.y == autoScaleTo.y
+        && autoScaleFrom.x == 0 && autoScaleTo.x == 0;
+    if (norange && image->histogram->mode == Histogram::Mode::EXACT)
+        return image->histogram;
+    return image->integralHistogram;
+}
+
 void Sequence::snapScaleAndBias()
 {
+    autoScale = false;
     std::shared_ptr<Image> img = getCurrentImage();
     if (!img)
         return;
@@ -325,8 +371,12 @@ end:
 
 const std::string Sequence::getTitle(int ncharname) const
 {
-    if (!valid)
+    if (!valid) {
+        auto progressive = std::dynamic_pointer_cast<ProgressiveImageCollection>(uneditedCollection);
+        if (progressive && !progressive->isLoaded())
+            return "(the sequence '" + name + "' is being listed)";
         return "(the sequence '" + name + "' contains no images)";
+    }
     if (!player)
         return "(no player associated with the sequence '" + name + "')";
     if (!colormap)
@@ -475,9 +525,3 @@ bool Sequence::putScriptSVG(const std::string& key, const std::string& buf)
     }
     return true;
 }
-
-void Sequence::setMacroblocks(const std::vector<Macroblock>& blocks) {
-    macroblocks = blocks;
-}
-
-
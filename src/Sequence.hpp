@@ -10,10 +10,11 @@
 #include <imgui_internal.h>
 
 #include "EditGUI.hpp"
+#include "Image.hpp"
 #include "collection_expression.hpp"
 #include "editors.hpp"
 #include "fs.hpp"
-#include "Macroblock.hpp"
+#include "MacroblockCollection.hpp"
 
 struct View;
 struct Player;
@@ -29,8 +30,10 @@ struct Sequence : std::enable_shared_from_this<Sequence> {
 
     std::shared_ptr<ImageCollection> collection;
     std::vector<std::vector<fs::path>> svgcollection;
+    std::vector<std::string> svgglobs;
     std::map<std::string, std::shared_ptr<SVG>> scriptSVGs;
     bool valid;
+    int knownLength;
 
     int loadedFrame;
     mutable float previousFactor;
@@ -40,12 +43,24 @@ struct Sequence : std::enable_shared_from_this<Sequence> {
     std::shared_ptr<Colormap> colormap;
     std::shared_ptr<ImageProvider> imageprovider;
     std::shared_ptr<Image> image;
+    ImagePreview preview; // shown while the image is loading
     std::string error;
 
     std::shared_ptr<ImageCollection> uneditedCollection;
     EditGUI editGUI;
 
-    std::vector<Macroblock> macroblocks;
+    std::shared_ptr<MacroblockCollection> macroblockCollection;
+    std::shared_ptr<MacroblockProvider> macroblockprovider;
+    std::shared_ptr<const MacroblockMetadata> macroblocks; // of the desired frame, null while they are loading
+    std::string macroblocksKey;
+
+    // the last automatic adjustment, applied again to each new frame if AUTOSCALE_PLAYBACK is set
+    bool autoScale;
+    ImVec2 autoScaleFrom, autoScaleTo;
+    float autoScaleQuantile;
+    bool autoScalePending; // the new frame waits for its histogram, the previous adjustment is kept meanwhile
+    // the contrast was adjusted on a region, the min/max pyramids of the next images are built in the background
+    bool regionAutoScaleUsed;
 
     Sequence();
     ~Sequence();
@@ -58,6 +73,9 @@ struct Sequence : std::enable_shared_from_this<Sequence> {
     void forgetImage();
 
     void autoScaleAndBias(ImVec2 p1 = ImVec2(0, 0), ImVec2 p2 = ImVec2(0, 0), float quantile = 0.);
+    // the histogram giving the quantiles of the pending adjustment, built by the compute thread
+    // so that compute_quantiles does not sort the pixels, nullptr if the adjustment does not need one
+    std::shared_ptr<Progressable> getAutoScaleHistogram() const;
     void snapScaleAndBias();
 
     std::shared_ptr<Image> getCurrentImage();
@@ -79,8 +97,7 @@ struct Sequence : std::enable_shared_from_this<Sequence> {
 
     bool putScriptSVG(const std::string& key, const std::string& buf);
 
-    void setMacroblocks(const std::vector<Macroblock>& blocks);
-
 private:
     int getDesiredFrameIndex() const;
+    void onCollectionGrowth();
 };
@@ -137,9 +137,10 @@ void Program::bind()
 {
     GLDEBUG();
     glUseProgram(_program_id);
-    GLint loc = glGetUniformLocation(_program_id, "tex");
+    // the layers of the image are bound to the second unit by SetShaderCallback
+    GLint loc = glGetUniformLocation(_program_id, "bandLayers");
     if (loc >= 0) {
-        glUniform1i(loc, 0);
+        glUniform1i(loc, 1);
     }
     GLDEBUG();
 }
@@ -1,128 +1,743 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <list>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAS_F16C_TARGET
+#endif
 
 #include <GL/gl3w.h>
+#include <doctest.h>
 
+#include "GLTestContext.hpp"
 #include "Image.hpp"
 #include "OpenGLDebug.hpp"
 #include "Texture.hpp"
+#include "ThreadPool.hpp"
 #include "globals.hpp"
+#include "testimages.hpp"
 
 #define TEXTURE_MAX_SIZE 1024
+// each staging buffer holds a full RGBA layer of a tile, the uploads fall back to glTexSubImage3D when they are all in use
+#define STAGING_BUFFERS 8
 
-static std::list<TextureTile> tileCache;
-
-static void initTile(TextureTile t)
+static size_t channelsOfFormat(unsigned format)
 {
-    GLuint internalFormat;
-    switch (t.format) {
+    switch (format) {
     case GL_RED:
-        internalFormat = GL_R32F;
-        break;
+        return 1;
     case GL_RG:
-        internalFormat = GL_RG32F;
-        break;
+        return 2;
     case GL_RGB:
-        internalFormat = GL_RGB32F;
-        break;
+        return 3;
     case GL_RGBA:
-        internalFormat = GL_RGBA32F;
-        break;
+        return 4;
     default:
         assert(0);
+        return 0;
     }
+}
+
+static void initTile(TextureTile t)
+{
+    static const GLuint internalFormats[][4] = {
+        { GL_R32F, GL_RG32F, GL_RGB32F, GL_RGBA32F },
+        { GL_R16F, GL_RG16F, GL_RGB16F, GL_RGBA16F },
+        { GL_R8, GL_RG8, GL_RGB8, GL_RGBA8 },
+        { GL_R16, GL_RG16, GL_RGB16, GL_RGBA16 },
+    };
+    GLuint internalFormat = internalFormats[(int)t.storage][channelsOfFormat(t.format) - 1];
 
-    glBindTexture(GL_TEXTURE_2D, t.id);
+    GLenum target = t.layers ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+    glBindTexture(target, t.id);
     GLDEBUG();
-    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, t.w, t.h, 0, t.format, GL_FLOAT, nullptr);
+    if (t.layers)
+        glTexImage3D(target, 0, internalFormat, t.w, t.h, t.layers, 0, t.format, GL_FLOAT, nullptr);
+    else
+        glTexImage2D(target, 0, internalFormat, t.w, t.h, 0, t.format, GL_FLOAT, nullptr);
     GLDEBUG();
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     GLDEBUG();
     switch (gDownsamplingQuality) {
     case 0:
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
         break;
     case 1:
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         break;
     case 2:
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
         break;
     case 3:
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
         break;
     }
     GLDEBUG();
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     GLDEBUG();
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     GLDEBUG();
 
-    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindTexture(target, 0);
     GLDEBUG();
 }
 
-static TextureTile takeTile(size_t w, size_t h, unsigned format)
+// copies the bands picked by bandidx in the area of the image to out, whose rows are rowLength pixels long
+// out has 3 channels (0 for the missing bands)
+static void reshapeArea(const Image& img, ImRect area, BandIndices bandidx, float* out, size_t rowLength)
 {
-    for (auto it = tileCache.begin(); it != tileCache.end(); it++) {
-        TextureTile t = *it;
-        if (t.w == w && t.h == h && t.format == format) {
-            tileCache.erase(it);
-            return t;
+    size_t sx = area.Min.x;
+    size_t sy = area.Min.y;
+    size_t aw = area.GetWidth();
+    size_t ah = area.GetHeight();
+    for (size_t y = 0; y < ah; y++) {
+        const float* row = img.pixels + ((sy + y) * img.w + sx) * img.c;
+        float* o = out + y * rowLength * 3;
+        for (int c = 0; c < 3; c++) {
+            size_t b = bandidx[c];
+            if (b >= img.c) {
+                for (size_t x = 0; x < aw; x++)
+                    o[x * 3 + c] = 0;
+            } else {
+                for (size_t x = 0; x < aw; x++)
+                    o[x * 3 + c] = row[x * img.c + b];
+            }
         }
     }
+}
 
-    TextureTile tile;
-    if (!tileCache.empty()) {
-        tile = tileCache.back();
-        tileCache.pop_back();
-    } else {
-        glGenTextures(1, &tile.id);
-        GLDEBUG();
+TextureStorage chooseTextureStorage(const Image& img, float precision)
+{
+    if (gExactTextures)
+        return TextureStorage::FLOAT32;
+    if (img.integerBits && img.min >= 0) {
+        if (img.integerBits <= 8 && img.max <= 255)
+            return TextureStorage::UNORM8;
+        if (img.integerBits <= 16 && img.max <= 65535)
+            return TextureStorage::UNORM16;
     }
+    // the rounding error of half floats is at most half of the spacing of the largest values
+    float largest = std::max(std::abs(img.min), std::abs(img.max));
+    if (!(largest <= 65504))
+        return TextureStorage::FLOAT32;
+    if (largest == 0 || std::ldexp(1.f, std::ilogb(largest) - 11) <= precision)
+        return TextureStorage::FLOAT16;
+    return TextureStorage::FLOAT32;
+}
+
+float getStorageNormalization(TextureStorage storage)
+{
+    switch (storage) {
+    case TextureStorage::UNORM8:
+        return 255;
+    case TextureStorage::UNORM16:
+        return 65535;
+    default:
+        return 1;
+    }
+}
+
+static size_t getStorageBytes(TextureStorage storage)
+{
+    switch (storage) {
+    case TextureStorage::FLOAT32:
+        return 4;
+    case TextureStorage::UNORM8:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+size_t getTextureBytes(const Image& img, TextureStorage storage, int level)
+{
+    size_t s = (size_t)1 << level;
+    size_t layers = (img.c + 3) / 4;
+    return ((img.w + s - 1) / s) * ((img.h + s - 1) / s) * std::min<size_t>(img.c, 4) * layers * getStorageBytes(storage);
+}
+
+int chooseTextureLevel(float magnification)
+{
+    if (!(magnification < 1))
+        return 0;
+    // the coarsest levels of the largest images are a few pixels wide
+    if (!(magnification > std::ldexp(1.f, -16)))
+        return 16;
+    return std::min(16, (int)std::floor(std::log2(1 / magnification)));
+}
+
+static GLenum getStorageType(TextureStorage storage)
+{
+    switch (storage) {
+    case TextureStorage::FLOAT32:
+        return GL_FLOAT;
+    case TextureStorage::FLOAT16:
+        return GL_HALF_FLOAT;
+    case TextureStorage::UNORM8:
+        return GL_UNSIGNED_BYTE;
+    default:
+        return GL_UNSIGNED_SHORT;
+    }
+}
+
+// the unused tiles are kept for the textures of the same size and format
+// each bucket is ordered like the pool, from the least recently given tile
+struct TileKey {
+    size_t w, h;
+    unsigned format;
+    TextureStorage storage;
+    unsigned layers;
+
+    bool operator==(const TileKey& other) const
+    {
+        return w == other.w && h == other.h && format == other.format
+            && storage == other.storage && layers == other.layers;
+    }
+};
+
+struct TileKeyHash {
+    size_t operator()(const TileKey& k) const
+    {
+        size_t h = std::hash<size_t>()(k.w);
+        h = h * 31 + std::hash<size_t>()(k.h);
+        h = h * 31 + k.format;
+        h = h * 31 + (size_t)k.storage;
+        return h * 31 + k.layers;
+    }
+};
+
+static std::list<TextureTile> tilePool;
+static std::unordered_map<TileKey, std::deque<std::list<TextureTile>::iterator>, TileKeyHash> tileBuckets;
+static TilePoolStats tilePoolStats;
+
+static TileKey getTileKey(const TextureTile& t)
+{
+    return TileKey { t.w, t.h, t.format, t.storage, t.layers };
+}
+
+static size_t getTileBytes(const TextureTile& t)
+{
+    return t.w * t.h * channelsOfFormat(t.format) * std::max(t.layers, 1u) * getStorageBytes(t.storage);
+}
+
+static void releaseOldestTile()
+{
+    const TextureTile& t = tilePool.front();
+    auto bucket = tileBuckets.find(getTileKey(t));
+    bucket->second.pop_front();
+    if (bucket->second.empty())
+        tileBuckets.erase(bucket);
+    tilePoolStats.tiles--;
+    tilePoolStats.bytes -= getTileBytes(t);
+    tilePoolStats.released++;
+    glDeleteTextures(1, &t.id);
+    GLDEBUG();
+    tilePool.pop_front();
+}
+
+static TextureTile takeTile(size_t w, size_t h, unsigned format, unsigned layers, TextureStorage storage)
+{
+    TextureTile tile;
     tile.w = w;
     tile.h = h;
     tile.format = format;
+    tile.storage = storage;
+    tile.layers = layers;
+
+    auto bucket = tileBuckets.find(getTileKey(tile));
+    if (bucket != tileBuckets.end()) {
+        auto it = bucket->second.back();
+        tile = *it;
+        bucket->second.pop_back();
+        if (bucket->second.empty())
+            tileBuckets.erase(bucket);
+        tilePool.erase(it);
+        tilePoolStats.tiles--;
+        tilePoolStats.bytes -= getTileBytes(tile);
+        tilePoolStats.reused++;
+        return tile;
+    }
+
+    glGenTextures(1, &tile.id);
+    GLDEBUG();
     initTile(tile);
+    tilePoolStats.created++;
     return tile;
 }
 
 static void giveTile(TextureTile t)
 {
-    tileCache.push_back(t);
+    tilePool.push_back(t);
+    tileBuckets[getTileKey(t)].push_back(std::prev(tilePool.end()));
+    tilePoolStats.tiles++;
+    tilePoolStats.bytes += getTileBytes(t);
+    size_t limit = gTilePoolLimitMB * 1000000;
+    while (tilePoolStats.bytes > limit)
+        releaseOldestTile();
 }
 
-void Texture::create(size_t w, size_t h, unsigned format)
+TilePoolStats get_tile_pool_stats()
 {
-    for (auto t : tiles) {
-        giveTile(t);
+    return tilePoolStats;
+}
+
+static unsigned formatOfChannels(size_t c)
+{
+    static const unsigned formats[] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+    return formats[std::min<size_t>(c, 4) - 1];
+}
+
+// rounds to the nearest half float, ties to even, like the F16C instructions
+static uint16_t floatToHalf(float f)
+{
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int exponent = (x >> 23) & 0xff;
+    uint32_t mantissa = x & 0x7fffff;
+    if (exponent == 0xff) // the NaNs are quieted
+        return sign | 0x7c00 | (mantissa ? 0x200 | (mantissa >> 13) : 0);
+    int e = exponent - 127 + 15;
+    if (e >= 0x1f)
+        return sign | 0x7c00;
+    uint32_t h, rest, half;
+    if (e <= 0) {
+        // subnormal half float, in units of 2^-24
+        if (e < -10)
+            return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - e;
+        h = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        half = 1u << (shift - 1);
+    } else {
+        h = (e << 10) | (mantissa >> 13);
+        rest = mantissa & 0x1fff;
+        half = 0x1000;
     }
-    tiles.clear();
+    // a carry in the exponent gives the next power of two, or the infinity
+    if (rest > half || (rest == half && (h & 1)))
+        h++;
+    return sign | h;
+}
+
+#ifdef HAS_F16C_TARGET
+__attribute__((target("avx,f16c"))) static void floatsToHalvesF16C(const float* in, uint16_t* out, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i*)(out + i), h);
+    }
+    for (; i < n; i++)
+        out[i] = floatToHalf(in[i]);
+}
+#endif
+
+static void floatsToHalves(const float* in, uint16_t* out, size_t n)
+{
+#ifdef HAS_F16C_TARGET
+    static const bool f16c = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+    if (f16c) {
+        floatsToHalvesF16C(in, out, n);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++)
+        out[i] = floatToHalf(in[i]);
+}
+
+// the values of the UNORM storages are in the range of the type (see chooseTextureStorage)
+// they are integers, except the averages of the downsampled levels which are rounded
+static void convertSamples(const float* in, size_t n, TextureStorage storage, void* out)
+{
+    switch (storage) {
+    case TextureStorage::FLOAT32:
+        std::memcpy(out, in, n * sizeof(float));
+        break;
+    case TextureStorage::FLOAT16:
+        floatsToHalves(in, (uint16_t*)out, n);
+        break;
+    case TextureStorage::UNORM8:
+        for (size_t i = 0; i < n; i++)
+            ((uint8_t*)out)[i] = in[i] + .5f;
+        break;
+    case TextureStorage::UNORM16:
+        for (size_t i = 0; i < n; i++)
+            ((uint16_t*)out)[i] = in[i] + .5f;
+        break;
+    }
+}
+
+// contiguous, so that the compiler vectorizes it
+static void addRow(float* __restrict sums, const float* __restrict row, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        sums[i] += row[i];
+}
+
+// copies the bands 4*layer..4*layer+3 of the area of the level to out, whose rows are rowLength texels long
+// each texel of the level reduces a block of 2^level x 2^level pixels of the image, cut by its borders:
+// to its first pixel with the downsampling quality 0, otherwise to the average of the block
+// out has min(img.c, 4) channels, the bands past the last one are set to 0
+static void copyLayer(const Image& img, ImRect area, size_t layer, int level, TextureStorage storage, void* out, size_t rowLength)
+{
+    size_t channels = std::min<size_t>(img.c, 4);
+    size_t first = layer * 4;
+    size_t count = std::min(channels, img.c - first);
+    size_t bytes = getStorageBytes(storage);
+    size_t s = (size_t)1 << level;
+    size_t sx = area.Min.x;
+    size_t sy = area.Min.y;
+    size_t aw = area.GetWidth();
+    size_t ah = area.GetHeight();
+    bool average = level > 0 && gDownsamplingQuality > 0;
+    // the pixels of the image under the area
+    size_t x0 = sx * s;
+    size_t x1 = std::min((sx + aw) * s, img.w);
+    std::vector<float> gathered(channels == img.c && !level ? 0 : aw * channels);
+    std::vector<float> sums(average ? (x1 - x0) * img.c : 0);
+    for (size_t y = 0; y < ah; y++) {
+        const float* row = img.pixels + ((sy + y) * s * img.w + x0) * img.c;
+        if (average) {
+            size_t nrows = std::min(s, img.h - (sy + y) * s);
+            std::copy(row, row + sums.size(), sums.begin());
+            for (size_t r = 1; r < nrows; r++)
+                addRow(sums.data(), row + r * img.w * img.c, sums.size());
+            for (size_t x = 0; x < aw; x++) {
+                size_t npixels = std::min(s, x1 - x0 - x * s);
+                float norm = 1.f / (npixels * nrows);
+                for (size_t k = 0; k < count; k++) {
+                    const float* block = sums.data() + x * s * img.c + first + k;
+                    float sum = 0;
+                    for (size_t p = 0; p < npixels; p++)
+                        sum += block[p * img.c];
+                    gathered[x * channels + k] = sum * norm;
+                }
+                for (size_t k = count; k < channels; k++)
+                    gathered[x * channels + k] = 0;
+            }
+            row = gathered.data();
+        } else if (!gathered.empty()) {
+            for (size_t x = 0; x < aw; x++) {
+                for (size_t k = 0; k < count; k++)
+                    gathered[x * channels + k] = row[x * s * img.c + first + k];
+                for (size_t k = count; k < channels; k++)
+                    gathered[x * channels + k] = 0;
+            }
+            row = gathered.data();
+        }
+        convertSamples(row, aw * channels, storage, (uint8_t*)out + y * rowLength * channels * bytes);
+    }
+}
+
+static void updateLayer(const TextureTile& t, ImRect totile, size_t layer, const void* data)
+{
+    glBindTexture(GL_TEXTURE_2D_ARRAY, t.id);
+    GLDEBUG();
+    // the rows of the compact storages are not always aligned on 4 bytes
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    GLDEBUG();
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, totile.Min.x, totile.Min.y, layer,
+        totile.GetWidth(), totile.GetHeight(), 1, t.format, getStorageType(t.storage), data);
+    GLDEBUG();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    GLDEBUG();
+    if (gDownsamplingQuality >= 2) {
+        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        GLDEBUG();
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    GLDEBUG();
+}
+
+struct StagingBuffer {
+    GLuint pbo;
+    GLsync fence; // of the last copy from the buffer
+    bool inUse;
+};
+
+struct TextureUpload {
+    std::shared_ptr<Image> image;
+    ImRect area; // in texels of the level
+    size_t layer;
+    int level;
+    size_t channels;
+    TextureTile tile;
+    ImRect totile;
+    size_t buffer;
+    void* mapped;
+    std::atomic<bool> filled;
+    std::atomic<bool> cancelled; // the tile was overwritten or given to another texture, the buffer is only recycled
+    bool done; // the buffer was recycled by run_texture_uploads
+};
+
+static std::vector<StagingBuffer> stagingBuffers;
+// in the order of the requests, which are filled in the same order
+static std::deque<std::shared_ptr<TextureUpload>> uploads;
+
+// fills the staging buffers while the main thread draws
+struct UploadWorker {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<TextureUpload>> queue;
+    bool stopping = false;
+
+    void submit(const std::shared_ptr<TextureUpload>& upload)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!thread.joinable())
+                thread = std::thread([this] { work(); });
+            queue.push_back(upload);
+        }
+        cv.notify_one();
+    }
+
+    void work()
+    {
+        while (true) {
+            std::shared_ptr<TextureUpload> upload;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (stopping)
+                    return;
+                upload = queue.front();
+                queue.pop_front();
+            }
+            if (!upload->cancelled) {
+                // the rows are copied by the thread pool, the buffer is not read by OpenGL until it is unmapped
+                size_t rowLength = upload->area.GetWidth();
+                size_t ah = upload->area.GetHeight();
+                int nbands = std::max<int>(1, std::min<int>(ah, getThreadPool().getConcurrency()));
+                getThreadPool().parallelFor(nbands, [&](int band) {
+                    ImRect rows = upload->area;
+                    rows.Min.y = upload->area.Min.y + (size_t)(ah * band / nbands);
+                    rows.Max.y = upload->area.Min.y + (size_t)(ah * (band + 1) / nbands);
+                    size_t rowBytes = rowLength * upload->channels * getStorageBytes(upload->tile.storage);
+                    uint8_t* out = (uint8_t*)upload->mapped + (size_t)(rows.Min.y - upload->area.Min.y) * rowBytes;
+                    copyLayer(*upload->image, rows, upload->layer, upload->level, upload->tile.storage, out, rowLength);
+                });
+            }
+            upload->image = nullptr;
+            upload->filled = true;
+        }
+    }
+
+    ~UploadWorker()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        if (thread.joinable())
+            thread.join();
+    }
+};
+
+// the worker uses the thread pool, so it has to be destroyed first
+static UploadWorker& getUploadWorker()
+{
+    getThreadPool();
+    static UploadWorker worker;
+    return worker;
+}
+
+// returns the index of a staging buffer which is no longer read by OpenGL, or -1
+static int acquireStagingBuffer()
+{
+    for (size_t i = 0; i < stagingBuffers.size(); i++) {
+        StagingBuffer& b = stagingBuffers[i];
+        if (b.inUse)
+            continue;
+        if (b.fence) {
+            GLenum status = glClientWaitSync(b.fence, 0, 0);
+            GLDEBUG();
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                continue;
+            glDeleteSync(b.fence);
+            GLDEBUG();
+            b.fence = nullptr;
+        }
+        b.inUse = true;
+        return i;
+    }
+    if (stagingBuffers.size() >= STAGING_BUFFERS)
+        return -1;
+
+    StagingBuffer b;
+    glGenBuffers(1, &b.pbo);
+    GLDEBUG();
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, b.pbo);
+    GLDEBUG();
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, TEXTURE_MAX_SIZE * TEXTURE_MAX_SIZE * 4 * sizeof(float), nullptr, GL_STREAM_DRAW);
+    GLDEBUG();
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    GLDEBUG();
+    b.fence = nullptr;
+    b.inUse = true;
+    stagingBuffers.push_back(b);
+    return stagingBuffers.size() - 1;
+}
+
+bool run_texture_uploads()
+{
+    while (!uploads.empty() && uploads.front()->filled) {
+        std::shared_ptr<TextureUpload> upload = uploads.front();
+        uploads.pop_front();
+        upload->done = true;
+        StagingBuffer& b = stagingBuffers[upload->buffer];
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, b.pbo);
+        GLDEBUG();
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        GLDEBUG();
+        if (!upload->cancelled) {
+            updateLayer(upload->tile, upload->totile, upload->layer, nullptr);
+            gActive = std::max(gActive, 2);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        GLDEBUG();
 
+        b.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        GLDEBUG();
+        b.inUse = false;
+    }
+    if (!uploads.empty()) {
+        // the main loop has to come back to finish the uploads
+        gActive = std::max(gActive, 1);
+        return true;
+    }
+    return false;
+}
+
+void release_texture_objects()
+{
+    // the worker may still be filling some buffers
+    while (run_texture_uploads())
+        continue;
+    for (const auto& b : stagingBuffers) {
+        if (b.fence)
+            glDeleteSync(b.fence);
+        glDeleteBuffers(1, &b.pbo);
+        GLDEBUG();
+    }
+    stagingBuffers.clear();
+    while (!tilePool.empty())
+        releaseOldestTile();
+}
+
+// the staging buffers hold a tile, and the tiles are allocated around the streamed areas,
+// so they stay at TEXTURE_MAX_SIZE even if OpenGL allows larger ones
+static size_t getTileSize()
+{
     static size_t ts = 0;
     if (!ts) {
         GLDEBUG();
-        int _ts;
-        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &_ts);
+        int maxSize;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
         GLDEBUG();
-        ts = _ts;
-        ts = TEXTURE_MAX_SIZE;
-    }
-    for (size_t y = 0; y < h; y += ts) {
-        for (size_t x = 0; x < w; x += ts) {
-            size_t tw = std::min(ts, w - x);
-            size_t th = std::min(ts, h - y);
-            TextureTile t = takeTile(tw, th, format);
-            t.x = x;
-            t.y = y;
-            tiles.push_back(t);
+        ts = std::min<size_t>(maxSize, TEXTURE_MAX_SIZE);
+    }
+    return ts;
+}
+
+void Texture::create(size_t w, size_t h, unsigned format, unsigned layers, TextureStorage storage, int level)
+{
+    cancelUploads();
+    // the tiles of another storage are drawn until the new ones are ready, the older ones are given back
+    bool drawn = std::any_of(tiles.begin(), tiles.end(),
+        [](const TextureTile& t) { return t.ready.GetWidth() > 0 && t.ready.GetHeight() > 0; });
+    if (drawn && !retired && size.x == w && size.y == h && this->level == level) {
+        retired.reset(new Texture);
+        retired->tiles = std::move(tiles);
+        retired->size = size;
+        retired->format = this->format;
+        retired->layers = this->layers;
+        retired->storage = this->storage;
+        retired->level = this->level;
+    } else {
+        for (auto t : tiles) {
+            giveTile(t);
         }
     }
+    tiles.clear();
 
     this->size.x = w;
     this->size.y = h;
     this->format = format;
+    this->layers = layers;
+    this->storage = storage;
+    this->level = level;
+    this->loadedRect = ImRect();
+}
+
+void Texture::allocateTiles(ImRect area)
+{
+    area.ClipWithFull(ImRect(ImVec2(0, 0), size));
+    if (area.GetWidth() <= 0 || area.GetHeight() <= 0)
+        return;
+
+    size_t ts = getTileSize();
+    size_t w = size.x;
+    size_t h = size.y;
+    for (size_t y = (size_t)area.Min.y / ts * ts; y < area.Max.y; y += ts) {
+        for (size_t x = (size_t)area.Min.x / ts * ts; x < area.Max.x; x += ts) {
+            bool allocated = std::any_of(tiles.begin(), tiles.end(),
+                [&](const TextureTile& t) { return t.x == (int)x && t.y == (int)y; });
+            if (allocated)
+                continue;
+            TextureTile t = takeTile(std::min(ts, w - x), std::min(ts, h - y), format, layers, storage);
+            t.x = x;
+            t.y = y;
+            t.streamed = ImRect();
+            t.ready = ImRect();
+            tiles.push_back(t);
+        }
+    }
+}
+
+size_t Texture::getBytes() const
+{
+    size_t bytes = 0;
+    for (const auto& t : tiles)
+        bytes += getTileBytes(t);
+    if (retired)
+        bytes += retired->getBytes();
+    return bytes;
+}
+
+bool Texture::updateReadiness()
+{
+    pending.erase(std::remove_if(pending.begin(), pending.end(),
+                      [](const std::shared_ptr<TextureUpload>& u) { return u->done; }),
+        pending.end());
+    bool complete = true;
+    for (auto& t : tiles) {
+        bool waiting = std::any_of(pending.begin(), pending.end(),
+            [&](const std::shared_ptr<TextureUpload>& u) { return u->tile.id == t.id && !u->cancelled; });
+        if (waiting)
+            complete = false;
+        else
+            t.ready = t.streamed;
+    }
+    if (complete)
+        retired = nullptr;
+    return complete;
 }
 
 void Texture::upload(const Image& img, ImRect area, BandIndices bandidx)
@@ -142,11 +757,12 @@ void Texture::upload(const Image& img, ImRect area, BandIndices bandidx)
     size_t w = img.w;
     size_t h = img.h;
 
-    if (size.x != w || size.y != h || format != glformat) {
+    if (size.x != w || size.y != h || format != glformat || layers || storage != TextureStorage::FLOAT32 || level) {
         create(w, h, glformat);
     }
+    allocateTiles(area);
 
-    for (auto t : tiles) {
+    for (auto& t : tiles) {
         ImRect intersect(t.x, t.y, t.x + t.w, t.y + t.h);
         intersect.ClipWithFull(area);
         ImRect totile = intersect;
@@ -156,35 +772,21 @@ void Texture::upload(const Image& img, ImRect area, BandIndices bandidx)
             continue;
         }
 
+        // the pending uploads of the tile would overwrite this one
+        for (const auto& u : pending) {
+            if (u->tile.id == t.id)
+                u->cancelled = true;
+        }
+        t.streamed = totile;
+        t.ready = totile;
+
         const float* data;
         if (!needsreshape) {
             data = img.pixels + (w * (size_t)intersect.Min.y + (size_t)intersect.Min.x) * img.c;
             glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
         } else {
-            // NOTE: all this copy and upload is slow
-            // 1) use opengl buffer to avoid pausing at each tile's upload
-            // 2° prepare the reshapebuffers in a thread
-            // storing these images as planar would help with cache
             static float* reshapebuffer = new float[TEXTURE_MAX_SIZE * TEXTURE_MAX_SIZE * 3];
-            for (int c = 0; c < 3; c++) {
-                size_t b = bandidx[c];
-                if (b >= img.c) {
-                    for (int y = 0; y < t.h; y++) {
-                        for (int x = 0; x < t.w; x++) {
-                            reshapebuffer[(y * TEXTURE_MAX_SIZE + x) * 3 + c] = 0;
-                        }
-                    }
-                    continue;
-                }
-                int sx = intersect.Min.x;
-                int sy = intersect.Min.y;
-                for (int y = 0; y < intersect.GetHeight(); y++) {
-                    for (int x = 0; x < intersect.GetWidth(); x++) {
-                        float v = img.pixels[((sy + y) * img.w + sx + x) * img.c + b];
-                        reshapebuffer[(y * TEXTURE_MAX_SIZE + x) * 3 + c] = v;
-                    }
-                }
-            }
+            reshapeArea(img, intersect, bandidx, reshapebuffer, TEXTURE_MAX_SIZE);
             data = reshapebuffer;
             glPixelStorei(GL_UNPACK_ROW_LENGTH, TEXTURE_MAX_SIZE);
         }
@@ -209,10 +811,436 @@ void Texture::upload(const Image& img, ImRect area, BandIndices bandidx)
     }
 }
 
+void Texture::stream(const std::shared_ptr<Image>& img, ImRect area, float precision, int level)
+{
+    GLDEBUG();
+    unsigned int glformat = formatOfChannels(img->c);
+    size_t channels = std::min<size_t>(img->c, 4);
+    unsigned nlayers = (img->c + 3) / 4;
+    TextureStorage wanted = chooseTextureStorage(*img, precision);
+    // the texture can be shown with several colormaps (see TextureCache), the most precise one is kept
+    if (!tiles.empty() && storage == TextureStorage::FLOAT32 && wanted == TextureStorage::FLOAT16)
+        wanted = TextureStorage::FLOAT32;
+
+    float s = 1 << level;
+    size_t w = std::ceil(img->w / s);
+    size_t h = std::ceil(img->h / s);
+
+    if (size.x != w || size.y != h || format != glformat || layers != nlayers || storage != wanted || this->level != level) {
+        create(w, h, glformat, nlayers, wanted, level);
+    }
+    pending.erase(std::remove_if(pending.begin(), pending.end(),
+                      [](const std::shared_ptr<TextureUpload>& u) { return u->done; }),
+        pending.end());
+    loadedRect.Add(area);
+
+    // the texels whose blocks intersect the area
+    ImRect texels(ImFloor(area.Min / s), ImVec2(std::ceil(area.Max.x / s), std::ceil(area.Max.y / s)));
+    texels.ClipWithFull(ImRect(0, 0, w, h));
+    allocateTiles(texels);
+
+    for (auto& t : tiles) {
+        ImRect intersect(t.x, t.y, t.x + t.w, t.y + t.h);
+        intersect.ClipWithFull(texels);
+        ImRect totile = intersect;
+        totile.Translate(ImVec2(-t.x, -t.y));
+
+        if (intersect.GetWidth() == 0 || intersect.GetHeight() == 0) {
+            continue;
+        }
+        // the ready area stays the previous one until all the layers of this one have landed
+        t.streamed = totile;
+
+        for (size_t layer = 0; layer < nlayers; layer++) {
+            int buffer = acquireStagingBuffer();
+            void* mapped = nullptr;
+            if (buffer >= 0) {
+                size_t bytes = intersect.GetWidth() * intersect.GetHeight() * channels * getStorageBytes(storage);
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffers[buffer].pbo);
+                GLDEBUG();
+                mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+                GLDEBUG();
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                GLDEBUG();
+                if (!mapped)
+                    stagingBuffers[buffer].inUse = false;
+            }
+
+            if (!mapped) {
+                // the pending uploads of the layer would overwrite this one
+                for (const auto& u : pending) {
+                    if (u->tile.id == t.id && u->layer == layer)
+                        u->cancelled = true;
+                }
+                const void* data;
+                if (channels == img->c && storage == TextureStorage::FLOAT32 && !level) {
+                    data = img->pixels + (img->w * (size_t)intersect.Min.y + (size_t)intersect.Min.x) * img->c;
+                    glPixelStorei(GL_UNPACK_ROW_LENGTH, img->w);
+                } else {
+                    static float* layerbuffer = new float[TEXTURE_MAX_SIZE * TEXTURE_MAX_SIZE * 4];
+                    copyLayer(*img, intersect, layer, level, storage, layerbuffer, TEXTURE_MAX_SIZE);
+                    data = layerbuffer;
+                    glPixelStorei(GL_UNPACK_ROW_LENGTH, TEXTURE_MAX_SIZE);
+                }
+                GLDEBUG();
+                updateLayer(t, totile, layer, data);
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+                GLDEBUG();
+                continue;
+            }
+
+            auto u = std::make_shared<TextureUpload>();
+            u->image = img;
+            u->area = intersect;
+            u->layer = layer;
+            u->level = level;
+            u->channels = channels;
+            u->tile = t;
+            u->totile = totile;
+            u->buffer = buffer;
+            u->mapped = mapped;
+            u->filled = false;
+            u->cancelled = false;
+            u->done = false;
+
+            uploads.push_back(u);
+            pending.push_back(u);
+            getUploadWorker().submit(u);
+        }
+    }
+}
+
+void Texture::cancelUploads()
+{
+    for (const auto& u : pending)
+        u->cancelled = true;
+    pending.clear();
+}
+
 Texture::~Texture()
 {
+    cancelUploads();
     for (auto t : tiles) {
         giveTile(t);
     }
     tiles.clear();
 }
+
+TEST_CASE("floatsToHalves")
+{
+    CHECK(floatToHalf(0.f) == 0x0000);
+    CHECK(floatToHalf(-0.f) == 0x8000);
+    CHECK(floatToHalf(1.f) == 0x3c00);
+    CHECK(floatToHalf(-2.f) == 0xc000);
+    CHECK(floatToHalf(65504.f) == 0x7bff);
+    CHECK(floatToHalf(65520.f) == 0x7c00); // rounded to the infinity
+    CHECK(floatToHalf(1.f + 1.f / 2048) == 0x3c00); // tie to even
+    CHECK(floatToHalf(1.f + 3.f / 2048) == 0x3c02);
+    CHECK(floatToHalf(std::ldexp(1.f, -24)) == 0x0001);
+    CHECK(floatToHalf(std::ldexp(1.f, -26)) == 0x0000);
+    CHECK(floatToHalf(std::ldexp(1.f, -14) - std::ldexp(1.f, -25)) == 0x0400); // subnormal rounded to normal
+    CHECK(floatToHalf(INFINITY) == 0x7c00);
+    CHECK((floatToHalf(NAN) & 0x7e00) == 0x7e00);
+
+    // the vectorized conversion gives the same halves, also for the remainder
+    std::vector<float> values;
+    for (int e = -30; e <= 17; e++)
+        for (int m = 0; m < 64; m++)
+            values.push_back(std::ldexp(1.f + m / 64.f + 1.f / 4096, e) * (m % 3 ? 1 : -1));
+    values.push_back(INFINITY);
+    values.push_back(-INFINITY);
+    values.push_back(1.f / 3);
+    std::vector<uint16_t> halves(values.size());
+    floatsToHalves(values.data(), halves.data(), values.size());
+    size_t mismatches = 0;
+    for (size_t i = 0; i < values.size(); i++)
+        mismatches += halves[i] != floatToHalf(values[i]);
+    CHECK(mismatches == 0);
+}
+
+// needs an OpenGL 3.3 context, see GLTestContext
+TEST_CASE("Texture::stream")
+{
+    GLTestContext gl;
+    if (!gl)
+        return;
+
+    // more tiles than staging buffers, so that some of them fall back to glTexSubImage3D
+    size_t w = TEXTURE_MAX_SIZE * 3 + 17;
+    size_t h = TEXTURE_MAX_SIZE * 2 + 5;
+    // the values are integers exactly represented by each storage
+    auto makeImage = [&](size_t c, size_t offset, int integerBits) {
+        float* pixels = (float*)malloc(sizeof(float) * w * h * c);
+        for (size_t i = 0; i < w * h * c; i++)
+            pixels[i] = (i + offset) % 251;
+        auto image = std::make_shared<Image>(pixels, w, h, c);
+        image->integerBits = integerBits;
+        return image;
+    };
+
+    for (size_t c : { 1, 3, 4, 6 })
+    for (TextureStorage storage : { TextureStorage::FLOAT32, TextureStorage::FLOAT16,
+             TextureStorage::UNORM8, TextureStorage::UNORM16 }) {
+        INFO(c << " channels, storage " << (int)storage);
+        int integerBits = storage == TextureStorage::UNORM8 ? 8 : storage == TextureStorage::UNORM16 ? 16 : 0;
+        float precision = storage == TextureStorage::FLOAT16 ? 1 : 0;
+        auto image = makeImage(c, 0, integerBits);
+        auto other = makeImage(c, 1, integerBits);
+        ImRect area(5, 3, w - 100, h);
+        size_t channels = std::min<size_t>(c, 4);
+
+        Texture streamed;
+        auto compare = [&]() {
+            while (run_texture_uploads())
+                continue;
+            REQUIRE(streamed.layers == (c + 3) / 4);
+            REQUIRE(streamed.storage == storage);
+            for (const auto& t : streamed.tiles) {
+                // read in the type of the storage, to compare the bits
+                std::vector<float> pixels(t.w * t.h * t.layers * 4);
+                glBindTexture(GL_TEXTURE_2D_ARRAY, t.id);
+                glGetTexImage(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, getStorageType(storage), pixels.data());
+                glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+                // the texels outside of the area are not initialized
+                ImRect inside(t.x, t.y, t.x + t.w, t.y + t.h);
+                inside.ClipWithFull(area);
+                size_t mismatches = 0;
+                for (size_t l = 0; l < t.layers; l++)
+                    for (size_t y = inside.Min.y; y < inside.Max.y; y++)
+                        for (size_t x = inside.Min.x; x < inside.Max.x; x++)
+                            for (size_t k = 0; k < channels; k++) {
+                                size_t b = l * 4 + k;
+                                float value = b < c ? image->pixels[(y * w + x) * c + b] : 0;
+                                size_t i = ((l * t.h + y - t.y) * t.w + x - t.x) * 4 + k;
+                                switch (storage) {
+                                case TextureStorage::FLOAT32:
+                                    mismatches += pixels[i] != value;
+                                    break;
+                                case TextureStorage::FLOAT16:
+                                    mismatches += ((uint16_t*)pixels.data())[i] != floatToHalf(value);
+                                    break;
+                                case TextureStorage::UNORM8:
+                                    mismatches += ((uint8_t*)pixels.data())[i] != value;
+                                    break;
+                                case TextureStorage::UNORM16:
+                                    mismatches += ((uint16_t*)pixels.data())[i] != value;
+                                    break;
+                                }
+                            }
+                CHECK(mismatches == 0);
+            }
+        };
+
+        // the pending uploads are overwritten by the second stream
+        streamed.stream(other, ImRect(0, 0, w, h), precision);
+        streamed.stream(image, area, precision);
+        compare();
+        // the staging buffers are free again once OpenGL is done with them
+        streamed.stream(other, ImRect(0, 0, w, h), precision);
+        while (run_texture_uploads())
+            continue;
+        glFinish();
+        streamed.stream(image, area, precision);
+        compare();
+    }
+
+    release_texture_objects();
+}
+
+TEST_CASE("Texture::updateReadiness")
+{
+    GLTestContext gl;
+    if (!gl)
+        return;
+
+    // less tiles than staging buffers, so that all of them are uploaded by the worker
+    size_t w = TEXTURE_MAX_SIZE * 2 + 7;
+    size_t h = 300;
+    auto image = makeTestImage(w, h, 1, [](size_t i) { return (i % 1000) / 7.f; });
+    auto isEmpty = [](const ImRect& r) { return r.GetWidth() <= 0 || r.GetHeight() <= 0; };
+    auto isSame = [](const ImRect& a, const ImRect& b) {
+        return a.Min.x == b.Min.x && a.Min.y == b.Min.y && a.Max.x == b.Max.x && a.Max.y == b.Max.y;
+    };
+
+    // the tiles go back to the pool before it is released
+    {
+        // the tiles are not drawn before their uploads land
+        Texture texture;
+        texture.stream(image, ImRect(0, 0, w, 100), 1);
+        REQUIRE(texture.storage == TextureStorage::FLOAT16);
+        REQUIRE(texture.tiles.size() == 3);
+        CHECK(!texture.updateReadiness());
+        for (const auto& t : texture.tiles)
+            CHECK(isEmpty(t.ready));
+        while (run_texture_uploads())
+            continue;
+        CHECK(texture.updateReadiness());
+        for (const auto& t : texture.tiles) {
+            CHECK(isSame(t.ready, t.streamed));
+            CHECK(t.ready.Max.y == 100);
+        }
+
+        // a larger area keeps the previous one drawn until it lands
+        texture.stream(image, ImRect(0, 0, w, h), 1);
+        CHECK(!texture.updateReadiness());
+        for (const auto& t : texture.tiles)
+            CHECK(t.ready.Max.y == 100);
+        while (run_texture_uploads())
+            continue;
+        CHECK(texture.updateReadiness());
+        for (const auto& t : texture.tiles)
+            CHECK(t.ready.Max.y == h);
+
+        // the tiles of the previous storage are kept until the new ones are ready
+        texture.stream(image, ImRect(0, 0, w, h), 0);
+        REQUIRE(texture.storage == TextureStorage::FLOAT32);
+        REQUIRE(texture.getRetired());
+        CHECK(texture.getRetired()->storage == TextureStorage::FLOAT16);
+        CHECK(texture.getRetired()->tiles.size() == 3);
+        CHECK(texture.getBytes() == getTextureBytes(*image, TextureStorage::FLOAT32) + getTextureBytes(*image, TextureStorage::FLOAT16));
+        CHECK(!texture.updateReadiness());
+        while (run_texture_uploads())
+            continue;
+        CHECK(texture.updateReadiness());
+        CHECK(!texture.getRetired());
+        CHECK(texture.getBytes() == getTextureBytes(*image, TextureStorage::FLOAT32));
+    }
+
+    release_texture_objects();
+}
+
+TEST_CASE("tile pool")
+{
+    GLTestContext gl;
+    if (!gl)
+        return;
+
+    size_t previousLimit = gTilePoolLimitMB;
+    gTilePoolLimitMB = 1;
+    auto makeImage = [](size_t size) {
+        float* pixels = (float*)calloc(size * size, sizeof(float));
+        pixels[0] = 0.5f;
+        return std::make_shared<Image>(pixels, size, size, 1);
+    };
+    // returns the bytes of the tile given back to the pool
+    auto streamAndRelease = [&](size_t size) {
+        Texture texture;
+        texture.stream(makeImage(size), ImRect(0, 0, size, size));
+        while (run_texture_uploads())
+            continue;
+        return texture.getBytes();
+    };
+
+    TilePoolStats before = get_tile_pool_stats();
+    size_t bytes400 = streamAndRelease(400);
+    TilePoolStats after = get_tile_pool_stats();
+    CHECK(after.created == before.created + 1);
+    CHECK(after.tiles == before.tiles + 1);
+    CHECK(after.bytes == before.bytes + bytes400);
+
+    // a texture of the same size reuses the tile
+    streamAndRelease(400);
+    TilePoolStats reused = get_tile_pool_stats();
+    CHECK(reused.reused == after.reused + 1);
+    CHECK(reused.created == after.created);
+    CHECK(reused.tiles == after.tiles);
+
+    // another size does not fit next to it, the oldest tile is released
+    release_texture_objects();
+    streamAndRelease(400);
+    size_t bytes350 = streamAndRelease(350);
+    CHECK(bytes400 + bytes350 > gTilePoolLimitMB * 1000000);
+    TilePoolStats evicted = get_tile_pool_stats();
+    CHECK(evicted.tiles == 1);
+    CHECK(evicted.bytes == bytes350);
+    streamAndRelease(350);
+    CHECK(get_tile_pool_stats().reused == evicted.reused + 1);
+    streamAndRelease(400);
+    CHECK(get_tile_pool_stats().created == evicted.created + 1);
+
+    release_texture_objects();
+    CHECK(get_tile_pool_stats().tiles == 0);
+    CHECK(get_tile_pool_stats().bytes == 0);
+    gTilePoolLimitMB = previousLimit;
+}
+
+TEST_CASE("chooseTextureLevel")
+{
+    CHECK(chooseTextureLevel(4) == 0);
+    CHECK(chooseTextureLevel(1) == 0);
+    CHECK(chooseTextureLevel(0.75) == 0);
+    CHECK(chooseTextureLevel(0.5) == 1);
+    CHECK(chooseTextureLevel(0.3) == 1);
+    CHECK(chooseTextureLevel(0.01) == 6);
+    CHECK(chooseTextureLevel(0) == 16);
+}
+
+TEST_CASE("Texture::stream levels")
+{
+    GLTestContext gl;
+    if (!gl)
+        return;
+
+    // the last blocks are cut by the borders
+    size_t w = TEXTURE_MAX_SIZE * 4 + 13;
+    size_t h = 1021;
+    size_t c = 5;
+    float* pixels = (float*)malloc(sizeof(float) * w * h * c);
+    for (size_t i = 0; i < w * h * c; i++)
+        pixels[i] = (i * 7) % 101;
+    auto image = std::make_shared<Image>(pixels, w, h, c);
+
+    int previousQuality = gDownsamplingQuality;
+    for (int quality : { 0, 1 }) {
+        gDownsamplingQuality = quality;
+        int level = 3;
+        size_t s = 1 << level;
+        Texture texture;
+        texture.stream(image, ImRect(0, 0, w, h), 0, level);
+        while (run_texture_uploads())
+            continue;
+        REQUIRE(texture.size.x == (w + s - 1) / s);
+        REQUIRE(texture.size.y == (h + s - 1) / s);
+        REQUIRE(texture.tiles.size() == 1);
+        CHECK(texture.getBytes() == getTextureBytes(*image, TextureStorage::FLOAT32, level));
+
+        const TextureTile& t = texture.tiles[0];
+        std::vector<float> read(t.w * t.h * t.layers * 4);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, t.id);
+        glGetTexImage(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, GL_FLOAT, read.data());
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        size_t mismatches = 0;
+        for (size_t y = 0; y < t.h; y++) {
+            for (size_t x = 0; x < t.w; x++) {
+                for (size_t b = 0; b < c; b++) {
+                    float expected = 0;
+                    if (quality == 0) {
+                        expected = pixels[(y * s * w + x * s) * c + b];
+                    } else {
+                        size_t n = 0;
+                        for (size_t j = y * s; j < std::min(h, (y + 1) * s); j++)
+                            for (size_t i = x * s; i < std::min(w, (x + 1) * s); i++, n++)
+                                expected += pixels[(j * w + i) * c + b];
+                        expected /= n;
+                    }
+                    float value = read[((b / 4 * t.h + y) * t.w + x) * 4 + b % 4];
+                    mismatches += std::abs(value - expected) > 1e-4f * expected;
+                }
+            }
+        }
+        CHECK(mismatches == 0);
+    }
+    gDownsamplingQuality = previousQuality;
+
+    // at full resolution, only the tiles under the area are allocated
+    Texture texture;
+    texture.stream(image, ImRect(TEXTURE_MAX_SIZE + 10, 20, TEXTURE_MAX_SIZE + 30, 40));
+    CHECK(texture.tiles.size() == 1);
+    texture.stream(image, ImRect(TEXTURE_MAX_SIZE - 10, 20, TEXTURE_MAX_SIZE + 30, 40));
+    CHECK(texture.tiles.size() == 2);
+    CHECK(texture.getBytes() == 2 * TEXTURE_MAX_SIZE * h * 4 * 2 * sizeof(float));
+    while (run_texture_uploads())
+        continue;
+
+    release_texture_objects();
+}
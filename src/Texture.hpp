@@ -9,23 +9,89 @@
 
 #include "Image.hpp"
 
+// how the values of the images are stored in the tiles
+enum class TextureStorage {
+    FLOAT32,
+    FLOAT16,
+    UNORM8, // the shaders read the values divided by 255
+    UNORM16, // the shaders read the values divided by 65535
+};
+
+// picks the most compact storage which keeps the differences of values larger than precision
+TextureStorage chooseTextureStorage(const Image& img, float precision);
+// the factor between the values of the image and the values read by the shaders
+float getStorageNormalization(TextureStorage storage);
+// the video memory taken by the whole image streamed with the given storage and level
+size_t getTextureBytes(const Image& img, TextureStorage storage, int level = 0);
+// the coarsest level whose texels are not smaller than the pixels of the screen,
+// for images displayed with the given number of screen pixels per image pixel
+int chooseTextureLevel(float magnification);
+
 struct TextureTile {
     unsigned id;
     int x, y;
     size_t w, h;
     unsigned format;
+    TextureStorage storage;
+    unsigned layers; // 0 for a GL_TEXTURE_2D, otherwise a GL_TEXTURE_2D_ARRAY with 4 bands per layer
+    // in texels of the tile, the last streamed area and the part of it whose uploads have landed,
+    // only the ready part can be drawn, the rest holds older or pooled content
+    ImRect streamed;
+    ImRect ready;
 };
 
+struct TextureUpload;
+
 struct Texture {
-    std::vector<TextureTile> tiles;
-    ImVec2 size;
+    std::vector<TextureTile> tiles; // only the ones covering the streamed areas, their positions are in texels
     unsigned format = -1;
+    unsigned layers = 0;
+    TextureStorage storage = TextureStorage::FLOAT32;
+    int level = 0; // each texel covers 2^level x 2^level pixels of the image
+    ImVec2 size; // in texels
+    ImRect loadedRect; // the area of the image streamed since the tiles were created, in pixels of the image
 
     ~Texture();
 
     void upload(const Image& img, ImRect area, BandIndices bandidx = { 0, 1, 2 });
+    // uploads all the bands of the image in the layers of the tiles, so that the shaders can pick them
+    // the pixels are copied to staging buffers by a worker thread
+    // and the tiles are updated a few frames later by run_texture_uploads
+    // the storage of the tiles is picked by chooseTextureStorage(*img, precision)
+    // above level 0, the blocks of pixels are reduced on the CPU following DOWNSAMPLING_QUALITY
+    void stream(const std::shared_ptr<Image>& img, ImRect area, float precision = 0, int level = 0);
     ImVec2 getSize() const { return size; }
+    size_t getBytes() const;
+    // updates the ready areas of the tiles from the landed uploads, needs to be called before drawing them
+    // returns whether the tiles are ready, otherwise the retired tiles can be drawn below the ready areas
+    bool updateReadiness();
+    // the tiles replaced by the last change of storage, kept until the new ones are ready
+    const Texture* getRetired() const { return retired.get(); }
 
 private:
-    void create(size_t w, size_t h, unsigned format);
+    std::vector<std::shared_ptr<TextureUpload>> pending;
+    std::unique_ptr<Texture> retired;
+
+    void create(size_t w, size_t h, unsigned format, unsigned layers = 0,
+        TextureStorage storage = TextureStorage::FLOAT32, int level = 0);
+    // takes the missing tiles intersecting the area, in texels
+    void allocateTiles(ImRect area);
+    void cancelUploads();
+};
+
+// copies the filled staging buffers to their tiles, in the order of the requests
+// returns whether some uploads are still pending, needs the OpenGL context
+bool run_texture_uploads();
+// deletes the staging buffers and the tiles which are not used by a texture, before destroying the OpenGL context
+void release_texture_objects();
+
+// the tiles given back by the textures are kept for reuse up to TILE_POOL_LIMIT,
+// the least recently given ones are deleted first
+struct TilePoolStats {
+    size_t tiles = 0; // in the pool
+    size_t bytes = 0;
+    size_t reused = 0;
+    size_t created = 0;
+    size_t released = 0;
 };
+TilePoolStats get_tile_pool_stats();
@@ -0,0 +1,210 @@
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <utility>
+
+#include <GL/gl3w.h>
+#include <doctest.h>
+
+#include "GLTestContext.hpp"
+#include "Image.hpp"
+#include "Texture.hpp"
+#include "TextureCache.hpp"
+#include "globals.hpp"
+
+namespace TextureCache {
+
+struct Entry {
+    std::weak_ptr<Image> image; // the address of a released image can be reused by a new one
+    std::shared_ptr<Texture> texture;
+    uint64_t lastUsed;
+};
+
+static std::map<std::pair<const Image*, int>, Entry> cache;
+// incremented at each use of the cache
+static uint64_t useCounter = 0;
+// of the last get, the textures used after it are upcoming frames
+static uint64_t lastDisplayed = 0;
+
+static void removeReleasedImages()
+{
+    for (auto it = cache.begin(); it != cache.end();) {
+        if (it->second.image.expired())
+            it = cache.erase(it);
+        else
+            it++;
+    }
+}
+
+size_t getSize()
+{
+    size_t size = 0;
+    for (const auto& it : cache)
+        size += it.second.texture->getBytes();
+    return size;
+}
+
+// releases the least recently used textures which are not displayed and were used before the given time
+// until need bytes are available, returns false if it is not possible
+static bool makeRoomFor(size_t need, uint64_t usedBefore)
+{
+    size_t limit = gGPUCacheLimitMB * 1000000;
+    size_t size = getSize();
+    while (size + need > limit) {
+        auto worst = cache.end();
+        for (auto it = cache.begin(); it != cache.end(); it++) {
+            const Entry& e = it->second;
+            if (e.texture.use_count() > 1 || e.lastUsed >= usedBefore)
+                continue;
+            if (worst == cache.end() || e.lastUsed < worst->second.lastUsed)
+                worst = it;
+        }
+        if (worst == cache.end())
+            return false;
+        size -= worst->second.texture->getBytes();
+        cache.erase(worst);
+    }
+    return true;
+}
+
+static size_t missingBytes(size_t wanted, size_t current)
+{
+    return wanted > current ? wanted - current : 0;
+}
+
+static Entry* find(const std::shared_ptr<Image>& image, int level)
+{
+    auto it = cache.find(std::make_pair(image.get(), level));
+    if (it == cache.end())
+        return nullptr;
+    if (it->second.image.lock() != image) {
+        cache.erase(it);
+        return nullptr;
+    }
+    return &it->second;
+}
+
+std::shared_ptr<Texture> get(const std::shared_ptr<Image>& image, int level)
+{
+    removeReleasedImages();
+    lastDisplayed = ++useCounter;
+
+    Entry* entry = find(image, level);
+    if (!entry) {
+        Entry e;
+        e.image = image;
+        e.texture = std::make_shared<Texture>();
+        entry = &(cache[std::make_pair(image.get(), level)] = e);
+    }
+    entry->lastUsed = lastDisplayed;
+    std::shared_ptr<Texture> texture = entry->texture;
+    makeRoomFor(missingBytes(getTextureBytes(*image, texture->storage, level), texture->getBytes()), lastDisplayed);
+    return texture;
+}
+
+bool prefetch(const std::shared_ptr<Image>& image, float precision, int level)
+{
+    removeReleasedImages();
+
+    ImRect whole(0, 0, image->w, image->h);
+    TextureStorage storage = chooseTextureStorage(*image, precision);
+    Entry* entry = find(image, level);
+    if (entry && entry->texture->loadedRect.Contains(whole)
+        && !(entry->texture->storage == TextureStorage::FLOAT16 && storage == TextureStorage::FLOAT32)) {
+        entry->lastUsed = ++useCounter;
+        return false;
+    }
+
+    size_t need = missingBytes(getTextureBytes(*image, storage, level), entry ? entry->texture->getBytes() : 0);
+    if (!makeRoomFor(need, lastDisplayed))
+        return false;
+
+    // the map was changed by makeRoomFor
+    entry = find(image, level);
+    if (!entry) {
+        Entry e;
+        e.image = image;
+        e.texture = std::make_shared<Texture>();
+        entry = &(cache[std::make_pair(image.get(), level)] = e);
+    }
+    entry->lastUsed = ++useCounter;
+    entry->texture->stream(image, whole, precision, level);
+    return true;
+}
+
+void flush()
+{
+    cache.clear();
+}
+
+}
+
+// needs an OpenGL 3.3 context, see GLTestContext
+TEST_CASE("TextureCache")
+{
+    GLTestContext gl;
+    if (!gl)
+        return;
+
+    // each texture takes 1MB
+    size_t previousLimit = gGPUCacheLimitMB;
+    gGPUCacheLimitMB = 3;
+    std::vector<std::shared_ptr<Image>> frames;
+    for (int i = 0; i < 5; i++) {
+        float* pixels = (float*)malloc(sizeof(float) * 500 * 500);
+        for (size_t j = 0; j < 500 * 500; j++)
+            pixels[j] = (i * 7 + j) % 13;
+        frames.push_back(std::make_shared<Image>(pixels, 500, 500, 1));
+    }
+
+    // the displayed frame stays, the next frames are streamed until the limit
+    std::shared_ptr<Texture> displayed = TextureCache::get(frames[0]);
+    displayed->stream(frames[0], ImRect(0, 0, 500, 500));
+    CHECK(TextureCache::prefetch(frames[1], 0));
+    CHECK(TextureCache::prefetch(frames[2], 0));
+    CHECK(!TextureCache::prefetch(frames[3], 0));
+    CHECK(!TextureCache::prefetch(frames[1], 0)); // already resident
+    CHECK(TextureCache::getSize() == 3000000);
+    while (run_texture_uploads())
+        continue;
+
+    // the prefetched texture is displayed without upload
+    displayed = TextureCache::get(frames[1]);
+    CHECK(displayed->loadedRect.Contains(ImRect(0, 0, 500, 500)));
+    CHECK(displayed->getBytes() == 1000000);
+    std::vector<float> pixels(500 * 500);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, displayed->tiles[0].id);
+    glGetTexImage(GL_TEXTURE_2D_ARRAY, 0, GL_RED, GL_FLOAT, pixels.data());
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    size_t mismatches = 0;
+    for (size_t j = 0; j < 500 * 500; j++)
+        mismatches += pixels[j] != frames[1]->pixels[j];
+    CHECK(mismatches == 0);
+
+    // another window showing the same image with more contrast shares the texture
+    std::shared_ptr<Texture> other = TextureCache::get(frames[1]);
+    CHECK(other.get() == displayed.get());
+    other->stream(frames[1], ImRect(0, 0, 500, 500), 1);
+    CHECK(other->storage == TextureStorage::FLOAT32);
+    other = nullptr;
+
+    // the frames shown before the current one make room for the next ones
+    CHECK(!TextureCache::prefetch(frames[2], 0));
+    CHECK(TextureCache::prefetch(frames[3], 0));
+    CHECK(!TextureCache::prefetch(frames[4], 0));
+    CHECK(TextureCache::getSize() == 3000000);
+    CHECK(TextureCache::get(frames[0])->tiles.empty());
+
+    // the released images are forgotten, once the uploads do not hold them anymore
+    while (run_texture_uploads())
+        continue;
+    displayed = nullptr;
+    frames.clear();
+    TextureCache::get(std::make_shared<Image>((float*)calloc(1, sizeof(float)), 1, 1, 1));
+    CHECK(TextureCache::getSize() == 0);
+
+    TextureCache::flush();
+    release_texture_objects();
+    gGPUCacheLimitMB = previousLimit;
+}
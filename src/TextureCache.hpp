@@ -0,0 +1,27 @@
+#pragma once
+
+#include <memory>
+
+struct Image;
+struct Texture;
+
+// keeps the textures of the recently displayed and upcoming images on the GPU, within GPU_CACHE_LIMIT
+// the images are identified by their address, the textures hold all their bands
+// each level of detail of an image has its own texture (see chooseTextureLevel)
+// the windows showing the same image share its texture, which is released once none of them shows it
+// needs the OpenGL context
+namespace TextureCache {
+
+// the texture of the image, which is empty if the image was not streamed yet
+// the least recently used textures which are not displayed are released to stay within the limit
+std::shared_ptr<Texture> get(const std::shared_ptr<Image>& image, int level = 0);
+
+// streams the whole image ahead of its display if it fits in the limit without releasing
+// the textures used since the last get, returns whether an upload was started
+bool prefetch(const std::shared_ptr<Image>& image, float precision, int level = 0);
+
+size_t getSize();
+
+void flush();
+
+}
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include <doctest.h>
+
+#include "ThreadPool.hpp"
+#include "globals.hpp"
+
+ThreadPool::ThreadPool(int nthreads)
+    : stopping(false)
+{
+    for (int i = 0; i < nthreads; i++) {
+        workers.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::work()
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+int ThreadPool::getConcurrency() const
+{
+    return workers.size() + 1;
+}
+
+void ThreadPool::parallelFor(int n, const std::function<void(int)>& fn)
+{
+    if (n <= 0) {
+        return;
+    }
+    if (n == 1 || workers.empty()) {
+        for (int i = 0; i < n; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    struct State {
+        std::atomic<int> next { 0 };
+        int done = 0;
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+    auto state = std::make_shared<State>();
+    int total = n;
+
+    // helpers may start after everything is done, so they only hold the state and not fn
+    auto run = [state, total](const std::function<void(int)>& fn) {
+        int count = 0;
+        for (int i; (i = state->next++) < total;) {
+            fn(i);
+            count++;
+        }
+        if (count) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->done += count;
+            if (state->done == total) {
+                state->cv.notify_all();
+            }
+        }
+    };
+
+    auto shared_fn = std::make_shared<std::function<void(int)>>(fn);
+    int nhelpers = std::min<int>(workers.size(), n - 1);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int i = 0; i < nhelpers; i++) {
+            tasks.emplace_back([run, shared_fn] { run(*shared_fn); });
+        }
+    }
+    cv.notify_all();
+
+    run(fn);
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait(lock, [&] { return state->done == total; });
+}
+
+ThreadPool& getThreadPool()
+{
+    static ThreadPool pool(std::max(1, gThreads > 0 ? gThreads : (int)std::thread::hardware_concurrency()) - 1);
+    return pool;
+}
+
+TEST_CASE("ThreadPool::parallelFor")
+{
+    ThreadPool pool(3);
+    CHECK(pool.getConcurrency() == 4);
+
+    SUBCASE("each index is run once")
+    {
+        std::vector<std::atomic<int>> counts(1000);
+        pool.parallelFor(counts.size(), [&](int i) { counts[i]++; });
+        CHECK(std::all_of(counts.begin(), counts.end(), [](const auto& c) { return c == 1; }));
+    }
+
+    SUBCASE("nested")
+    {
+        std::atomic<int> sum { 0 };
+        pool.parallelFor(8, [&](int i) {
+            pool.parallelFor(8, [&](int j) { sum += i * 8 + j; });
+        });
+        CHECK(sum == 64 * 63 / 2);
+    }
+
+    SUBCASE("no worker")
+    {
+        ThreadPool single(0);
+        int sum = 0;
+        single.parallelFor(10, [&](int i) { sum += i; });
+        CHECK(sum == 45);
+    }
+}
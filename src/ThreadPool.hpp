@@ -0,0 +1,33 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping;
+
+    void work();
+
+public:
+    ThreadPool(int nthreads);
+    ~ThreadPool();
+
+    // number of threads working on a parallelFor, including the caller
+    int getConcurrency() const;
+
+    // runs fn(0) ... fn(n-1) and returns once they are all done
+    // the calling thread takes part in the work, so that nested or concurrent calls
+    // cannot deadlock, even when all the workers are busy
+    void parallelFor(int n, const std::function<void(int)>& fn);
+};
+
+// shared pool of gThreads threads (all cores if 0), created on first use
+ThreadPool& getThreadPool();
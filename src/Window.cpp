@@ -31,6 +31,8 @@ extern "C" {
 #include "SVG.hpp"
 #include "Sequence.hpp"
 #include "Shader.hpp"
+#include "Texture.hpp"
+#include "TextureCache.hpp"
 #include "View.hpp"
 #include "Window.hpp"
 #include "config.hpp"
@@ -505,6 +507,12 @@ void Window::display()
     ImGui::End();
 }
 
+// below these sizes on the screen, the macroblocks are summarized and their sub-blocks are not drawn
+constexpr float MACROBLOCK_DETAIL_PIXELS = 8;
+constexpr float SUBBLOCK_DETAIL_PIXELS = 32;
+// the smallest size of the super-cells summarizing the macroblocks
+constexpr float SUPERCELL_PIXELS = 16;
+
 static ImVec2 rotate(ImVec2 v, float angle_rad)
 {
     return {
@@ -651,6 +659,21 @@ static ImU32 getMotionVectorColor(MacroblockType type, unsigned int referenceFra
     ;
 }
 
+// the cell is drawn with the color of its most frequent type, and its mean vector from its center
+static void drawMacroblockSummary(ImVec2 from, ImVec2 to, ImVec2 center, ImVec2 meanVector, const MacroblockSummary& summary)
+{
+    MacroblockType type = summary.getDominantType();
+    if (gMacroblockOverlayShown) {
+        drawMacroblockOverlays(from, to, getMacroblockColor(type));
+    }
+    if (gMacroblockBordersShown > 0) {
+        ImGui::GetWindowDrawList()->AddRect(from, to, IM_COL32_WHITE, 0, ~0, 0.2f);
+        if (gMacroblockVectorsShown && summary.vectors > 0) {
+            drawMacroblockVector(center, meanVector, getMotionVectorColor(type, 0), 0, false);
+        }
+    }
+}
+
 static ImVec2 getMotionVectorBase(MacroblockType type, Block block, unsigned int vectorIndex)
 {
     float halfSize = block.getSize() / 2.f;
@@ -721,9 +744,17 @@ void Window::displaySequence(Sequence& seq)
     ImVec2 delta = ImGui::GetIO().MouseDelta;
     bool dragging = ImGui::IsMouseDown(0) && (delta.x || delta.y);
     if (seq.colormap && seq.view && seq.player) {
+        // edits evaluated by parts start with what this window shows
+        if (!seq.image && seq.imageprovider)
+            seq.imageprovider->setViewport({ view.center, view.zoom * factor, winSize });
+
         if (gShowImage && seq.colormap->shader) {
             ImGui::PushClipRect(clip.Min, clip.Max, true);
-            displayarea.draw(seq.getCurrentImage(), clip.Min, winSize, *seq.colormap, *seq.view, factor);
+            if (!seq.image && seq.preview.image) {
+                displayarea.draw(seq.preview, clip.Min, winSize, *seq.colormap, *seq.view, factor);
+            } else {
+                displayarea.draw(seq.getCurrentImage(), clip.Min, winSize, *seq.colormap, *seq.view, factor);
+            }
             ImGui::PopClipRect();
         }
 
@@ -800,94 +831,75 @@ void Window::displaySequence(Sequence& seq)
             }
         }
 
-        if (gMacroblockBordersShown > 0 || gMacroblockOverlayShown) {
-            for (const auto& win : gWindows) {
-                const auto& s = win->getCurrentSequence();
-                if (!s)
-                    continue;
-                std::shared_ptr<Image> img = s->getCurrentImage();
-                if (!img)
-                    continue;
+        std::shared_ptr<const MacroblockMetadata> macroblocks = seq.macroblocks;
+        if ((gMacroblockBordersShown > 0 || gMacroblockOverlayShown) && seq.getCurrentImage() && macroblocks) {
+            // only the blocks which can be seen in the window are drawn
+            ImVec2 visibleFrom = view.window2image(ImVec2(0, 0), displayarea.getCurrentSize(), winSize, factor);
+            ImVec2 visibleTo = view.window2image(winSize, displayarea.getCurrentSize(), winSize, factor);
+            std::vector<size_t> visibleBlocks;
+            float blockPixels = MACROBLOCK_SIZE * view.zoom * factor;
+            if (blockPixels < MACROBLOCK_DETAIL_PIXELS) {
+                // the blocks are too small to be seen, they are summarized by super-cells
+                unsigned int level = 0;
+                while (level + 1 < macroblocks->grid.getSummaryLevels() && (GRID_CELL_SIZE << level) * view.zoom * factor < SUPERCELL_PIXELS) {
+                    level++;
+                }
+                ImVec2 cellSize(GRID_CELL_SIZE << level, GRID_CELL_SIZE << level);
+                std::vector<std::pair<ImVec2, const MacroblockSummary*>> cells;
+                macroblocks->grid.querySummaries(visibleFrom, visibleTo, level, cells);
+                for (const auto& cell : cells) {
+                    ImVec2 from = cell.first;
+                    ImVec2 to = ImMin(from + cellSize, displayarea.getCurrentSize());
+                    ImVec2 center = (from + to) * 0.5f;
+                    ImVec2 centerwin = getWindowPosition(seq, center) + clip.Min;
+                    ImVec2 meanVector = getWindowPosition(seq, center + cell.second->getMeanVector()) + clip.Min - centerwin;
+                    drawMacroblockSummary(getWindowPosition(seq, from) + clip.Min, getWindowPosition(seq, to) + clip.Min,
+                        centerwin, meanVector, *cell.second);
+                }
+            } else {
+                macroblocks->grid.query(visibleFrom, visibleTo, visibleBlocks);
+            }
+            bool subBlocksShown = blockPixels >= SUBBLOCK_DETAIL_PIXELS;
+            ImVec2 hover = getWindowPosition(seq, gHoveredPixel) + clip.Min;
 
-                for (const auto& macroblock : seq.macroblocks) {
+            for (size_t index : visibleBlocks) {
+                const Macroblock& macroblock = macroblocks->frame[index];
 
-                    ImVec2 from = macroblock.getTopLeft();
-                    ImVec2 to = macroblock.getBottomRight();
+                ImVec2 from = macroblock.getTopLeft();
+                ImVec2 to = macroblock.getBottomRight();
 
-                    ImVec2 fromwin = getWindowPosition(seq, from);
-                    ImVec2 towin = getWindowPosition(seq, to);
+                ImVec2 fromwin = getWindowPosition(seq, from);
+                ImVec2 towin = getWindowPosition(seq, to);
 
-                    fromwin += clip.Min;
-                    towin += clip.Min;
+                fromwin += clip.Min;
+                towin += clip.Min;
 
-                    if (gMacroblockOverlayShown) {
-                        ImU32 color = getMacroblockColor(macroblock.type);
-                        drawMacroblockOverlays(fromwin, towin, color);
-                    }
+                if (gMacroblockOverlayShown) {
+                    ImU32 color = getMacroblockColor(macroblock.type);
+                    drawMacroblockOverlays(fromwin, towin, color);
+                }
 
-                    if (gMacroblockBordersShown > 0) {
-                        drawBlockBorders(fromwin, towin, macroblock);
+                if (gMacroblockBordersShown > 0) {
+                    drawBlockBorders(fromwin, towin, macroblock);
+
+                    if (gMacroblockBordersShown > 1 && subBlocksShown && macroblock.blocks.has_value()) {
+                        for (const auto& subBlock : macroblock.blocks.value()) {
+                            ImVec2 subFrom = subBlock.getTopLeft();
+                            ImVec2 subTo = subBlock.getBottomRight();
+
+                            ImVec2 subFromwin = getWindowPosition(seq, subFrom);
+                            ImVec2 subTowin = getWindowPosition(seq, subTo);
+
+                            subFromwin += clip.Min;
+                            subTowin += clip.Min;
+
+                            drawBlockBorders(subFromwin, subTowin, subBlock);
 
-                        if (gMacroblockBordersShown > 1 && macroblock.blocks.has_value()) {
-                            for (const auto& subBlock : macroblock.blocks.value()) {
-                                ImVec2 subFrom = subBlock.getTopLeft();
-                                ImVec2 subTo = subBlock.getBottomRight();
-
-                                ImVec2 subFromwin = getWindowPosition(seq, subFrom);
-                                ImVec2 subTowin = getWindowPosition(seq, subTo);
-
-                                subFromwin += clip.Min;
-                                subTowin += clip.Min;
-
-                                drawBlockBorders(subFromwin, subTowin, subBlock);
-
-                                if (gMacroblockVectorsShown) {
-                                    unsigned int vectorIndex = 0;
-                                    for (auto motionVector : subBlock.motionVectors) {
-                                        int referenceFrame = std::get<2>(motionVector);
-                                        from = getMotionVectorBase(macroblock.type, subBlock, vectorIndex++);
-                                        fromwin = getWindowPosition(seq, from);
-                                        fromwin += clip.Min;
-                                        ImVec2 vectorTowin = getWindowPosition(seq, from + ImVec2(static_cast<float>(std::get<0>(motionVector)), static_cast<float>(std::get<1>(motionVector))));
-                                        vectorTowin += clip.Min;
-
-                                        vectorTowin -= fromwin;
-                                        float hoverThreshold = seq.view->zoom * factor * 20.0f;
-                                        ImVec2 hover = getWindowPosition(seq, gHoveredPixel);
-                                        hover += clip.Min;
-                                        bool showReferenceFrame = ImLengthSqr(fromwin - hover) < hoverThreshold * hoverThreshold;
-
-                                        drawMacroblockVector(fromwin, vectorTowin, getMotionVectorColor(macroblock.type, referenceFrame), referenceFrame, showReferenceFrame);
-                                    }
-                                }
-                                if (gMacroblockModesShown) {
-                                    unsigned int modeIndex = 0;
-                                    float fontSize = seq.view->zoom * factor;
-                                    float offset = 0;
-                                    if (subBlock.split == 3) {
-                                        fontSize *= 3;
-                                        offset = subBlock.getSize() / 4;
-                                    } else {
-                                        fontSize *= 6;
-                                        offset = subBlock.getSize() / 2;
-                                    }
-                                    for (auto mode : subBlock.modes) {
-                                        from = getMotionVectorBase(macroblock.type, subBlock, modeIndex++);
-                                        ImVec2 center(from.x - offset + 0.3f, from.y - offset);
-                                        ImVec2 centerwin = getWindowPosition(seq, center);
-
-                                        centerwin += clip.Min;
-
-                                        drawMacroblockModes(mode, centerwin, fontSize);
-                                    }
-                                }
-                            }
-                        } else {
                             if (gMacroblockVectorsShown) {
                                 unsigned int vectorIndex = 0;
-                                for (auto motionVector : macroblock.motionVectors) {
+                                for (auto motionVector : subBlock.motionVectors) {
                                     int referenceFrame = std::get<2>(motionVector);
-                                    from = getMotionVectorBase(macroblock.type, macroblock, vectorIndex++);
+                                    from = getMotionVectorBase(macroblock.type, subBlock, vectorIndex++);
                                     fromwin = getWindowPosition(seq, from);
                                     fromwin += clip.Min;
                                     ImVec2 vectorTowin = getWindowPosition(seq, from + ImVec2(static_cast<float>(std::get<0>(motionVector)), static_cast<float>(std::get<1>(motionVector))));
@@ -895,26 +907,80 @@ void Window::displaySequence(Sequence& seq)
 
                                     vectorTowin -= fromwin;
                                     float hoverThreshold = seq.view->zoom * factor * 20.0f;
-                                    ImVec2 hover = getWindowPosition(seq, gHoveredPixel);
-                                    hover += clip.Min;
                                     bool showReferenceFrame = ImLengthSqr(fromwin - hover) < hoverThreshold * hoverThreshold;
 
-                                    // Same fromwin as macroblock (change to center of block)
                                     drawMacroblockVector(fromwin, vectorTowin, getMotionVectorColor(macroblock.type, referenceFrame), referenceFrame, showReferenceFrame);
                                 }
                             }
-                            if (gMacroblockModesShown && !macroblock.modes.empty()) {
-                                float fontSize = 12 * seq.view->zoom * factor;
-                                ImVec2 center(macroblock.getX() + 0.8f, macroblock.getY());
-                                ImVec2 centerwin = getWindowPosition(seq, center);
+                            if (gMacroblockModesShown) {
+                                unsigned int modeIndex = 0;
+                                float fontSize = seq.view->zoom * factor;
+                                float offset = 0;
+                                if (subBlock.split == 3) {
+                                    fontSize *= 3;
+                                    offset = subBlock.getSize() / 4;
+                                } else {
+                                    fontSize *= 6;
+                                    offset = subBlock.getSize() / 2;
+                                }
+                                for (auto mode : subBlock.modes) {
+                                    from = getMotionVectorBase(macroblock.type, subBlock, modeIndex++);
+                                    ImVec2 center(from.x - offset + 0.3f, from.y - offset);
+                                    ImVec2 centerwin = getWindowPosition(seq, center);
 
-                                centerwin += clip.Min;
+                                    centerwin += clip.Min;
 
-                                drawMacroblockModes(macroblock.modes.front(), centerwin, fontSize);
+                                    drawMacroblockModes(mode, centerwin, fontSize);
+                                }
                             }
                         }
+                    } else {
+                        if (gMacroblockVectorsShown && macroblock.motionVectors.empty() && macroblock.blocks.has_value()) {
+                            // the vectors of a block split in 4 are in its sub-blocks, their mean is drawn instead
+                            MacroblockSummary summary;
+                            for (const auto& subBlock : macroblock.blocks.value()) {
+                                for (auto motionVector : subBlock.motionVectors) {
+                                    summary.vectorSumX += static_cast<float>(std::get<0>(motionVector));
+                                    summary.vectorSumY += static_cast<float>(std::get<1>(motionVector));
+                                    summary.vectors++;
+                                }
+                            }
+                            if (summary.vectors > 0) {
+                                ImVec2 center = (macroblock.getTopLeft() + macroblock.getBottomRight()) * 0.5f;
+                                ImVec2 centerwin = getWindowPosition(seq, center) + clip.Min;
+                                ImVec2 meanVector = getWindowPosition(seq, center + summary.getMeanVector()) + clip.Min - centerwin;
+                                drawMacroblockVector(centerwin, meanVector, getMotionVectorColor(macroblock.type, 0), 0, false);
+                            }
+                        } else if (gMacroblockVectorsShown) {
+                            unsigned int vectorIndex = 0;
+                            for (auto motionVector : macroblock.motionVectors) {
+                                int referenceFrame = std::get<2>(motionVector);
+                                from = getMotionVectorBase(macroblock.type, macroblock, vectorIndex++);
+                                fromwin = getWindowPosition(seq, from);
+                                fromwin += clip.Min;
+                                ImVec2 vectorTowin = getWindowPosition(seq, from + ImVec2(static_cast<float>(std::get<0>(motionVector)), static_cast<float>(std::get<1>(motionVector))));
+                                vectorTowin += clip.Min;
+
+                                vectorTowin -= fromwin;
+                                float hoverThreshold = seq.view->zoom * factor * 20.0f;
+                                bool showReferenceFrame = ImLengthSqr(fromwin - hover) < hoverThreshold * hoverThreshold;
+
+                                // Same fromwin as macroblock (change to center of block)
+                                drawMacroblockVector(fromwin, vectorTowin, getMotionVectorColor(macroblock.type, referenceFrame), referenceFrame, showReferenceFrame);
+                            }
+                        }
+                        if (gMacroblockModesShown && !macroblock.modes.empty()) {
+                            float fontSize = 12 * seq.view->zoom * factor;
+                            ImVec2 center(macroblock.getX() + 0.8f, macroblock.getY());
+                            ImVec2 centerwin = getWindowPosition(seq, center);
+
+                            centerwin += clip.Min;
+
+                            drawMacroblockModes(macroblock.modes.front(), centerwin, fontSize);
+                        }
                     }
                 }
+
             }
         }
 
@@ -1129,6 +1195,7 @@ void Window::displaySequence(Sequence& seq)
                     }
                 }
                 seq.colormap->radius = std::max(0.f, seq.colormap->radius / (1.f - 2.f * delta_r * ImGui::GetIO().MouseWheelH));
+                seq.colormap->stopAutoScale();
                 resetSat = true;
             }
         }
@@ -1166,6 +1233,7 @@ void Window::displaySequence(Sequence& seq)
                         for (int i = 0; i < 3; i++)
                             seq.colormap->center[i] = mean;
                     }
+                    seq.colormap->stopAutoScale();
                 }
                 resetSat = true;
             }
@@ -1368,6 +1436,14 @@ void Window::displayInfo(Sequence& seq)
         }
     }
 
+    {
+        TilePoolStats pool = get_tile_pool_stats();
+        size_t taken = pool.reused + pool.created;
+        ImGui::Text("GPU: %.1fMB of textures, %.1fMB of unused tiles (%zu, %.0f%% reused)",
+            TextureCache::getSize() / 1e6, pool.bytes / 1e6, pool.tiles,
+            taken ? 100. * pool.reused / taken : 0.);
+    }
+
     if (gShowHistogram) {
         std::shared_ptr<Image> img = seq.getCurrentImage();
         if (img) {
@@ -143,10 +143,8 @@ static void list_directory(const std::string& path, std::vector<std::string>& di
     }
 }
 
-static std::vector<std::string> collect_directory(const std::string& path)
+static std::vector<std::pair<std::string, bool>> sorted_directory(const std::string& path)
 {
-    std::vector<std::string> results;
-
     std::vector<std::string> directories, files;
     list_directory(path, directories, files);
 
@@ -159,58 +157,85 @@ static std::vector<std::string> collect_directory(const std::string& path)
     }
     std::sort(sorted.begin(), sorted.end(),
         [](const auto& a, const auto& b) { return doj::alphanum_comp(a.first, b.first) < 0; });
+    return sorted;
+}
 
-    for (auto& info : sorted) {
-        const std::string& path = info.first;
-        bool is_dir = info.second;
-        if (is_dir) {
-            auto subfiles = collect_directory(path);
-            for (auto f : subfiles) {
-                results.push_back(f);
-            }
-        } else {
-            auto expanded = expand_path(path);
-            std::copy(expanded.cbegin(), expanded.cend(), std::back_inserter(results));
-        }
+FilenamesExpansion::FilenamesExpansion(const std::string& expr)
+    : expr(expr)
+    , produced(0)
+{
+    auto subexprs = try_split(expr);
+    for (auto it = subexprs.rbegin(); it != subexprs.rend(); it++) {
+        pending.push_back(std::make_pair(*it, SUBEXPRESSION));
     }
-    return results;
 }
 
-std::vector<fs::path> buildFilenamesFromExpression(const std::string& expr)
+void FilenamesExpansion::emit(const std::vector<std::string>& filenames, std::vector<fs::path>& out)
 {
-    std::vector<std::string> filenames;
+    std::copy(filenames.cbegin(), filenames.cend(), std::back_inserter(out));
+    produced += filenames.size();
+}
 
-    for (auto subexpr : try_split(expr)) {
-        auto globres = do_glob(subexpr);
+bool FilenamesExpansion::step(std::vector<fs::path>& out)
+{
+    if (pending.empty()) {
+        return false;
+    }
 
+    // items are pushed in reverse order so that the back of 'pending' is always the next one
+    // in the final order, this keeps the depth first order of the synchronous listing
+    auto item = pending.back();
+    pending.pop_back();
+    std::string& path = item.first;
+
+    switch (item.second) {
+    case SUBEXPRESSION: {
+        auto globres = do_glob(path);
         if (globres.size() == 0) {
             // vpv /vsicurl/https://download.osgeo.org/gdal/data/gtiff/small_world.tif
             // it's not a file, so it won't be in the globres
-            convert_for_gdal(subexpr);
-            auto expanded = expand_path(subexpr);
-            std::copy(expanded.cbegin(), expanded.cend(), std::back_inserter(filenames));
+            convert_for_gdal(path);
+            emit(expand_path(path), out);
         } else {
-            for (auto file : globres) {
-                if (fs::is_directory(file)) {
-                    auto indir = collect_directory(file);
-                    std::copy(indir.cbegin(), indir.cend(), std::back_inserter(filenames));
-                } else {
-                    auto expanded = expand_path(file);
-                    std::copy(expanded.cbegin(), expanded.cend(), std::back_inserter(filenames));
-                }
+            for (auto it = globres.rbegin(); it != globres.rend(); it++) {
+                pending.push_back(std::make_pair(*it, fs::is_directory(*it) ? DIRECTORY : PATH));
             }
         }
+    } break;
+    case DIRECTORY: {
+        auto sorted = sorted_directory(path);
+        for (auto it = sorted.rbegin(); it != sorted.rend(); it++) {
+            pending.push_back(std::make_pair(it->first, it->second ? DIRECTORY : PATH));
+        }
+    } break;
+    case PATH:
+        emit(expand_path(path), out);
+        // plain files are cheap, flush a batch of them at once
+        for (int i = 0; i < 256 && !pending.empty() && pending.back().second == PATH; i++) {
+            emit(expand_path(pending.back().first), out);
+            pending.pop_back();
+        }
+        break;
     }
 
-    if (filenames.empty() && expr == "-") {
-        filenames.push_back("-");
+    if (pending.empty() && produced == 0 && expr == "-") {
+        out.push_back("-");
+        produced++;
     }
+    return true;
+}
 
-    std::vector<fs::path> paths;
-    std::transform(filenames.cbegin(), filenames.cend(),
-        std::back_inserter(paths),
-        [](const auto& filename) { return fs::path(filename); });
+bool FilenamesExpansion::done() const
+{
+    return pending.empty();
+}
 
+std::vector<fs::path> buildFilenamesFromExpression(const std::string& expr)
+{
+    std::vector<fs::path> paths;
+    FilenamesExpansion expansion(expr);
+    while (expansion.step(paths))
+        ;
     return paths;
 }
 
@@ -271,3 +296,31 @@ TEST_CASE("buildFilenamesFromExpression")
             CHECK(v[v1.size()] == v2[0]);
     }
 }
+
+TEST_CASE("FilenamesExpansion")
+{
+    fs::path directory = fs::temp_directory_path() / "vpv-expansion-test";
+    fs::create_directories(directory / "b");
+    for (const char* name : { "a2.png", "a10.png", "b/c.png", "z.txt" })
+        fs::ofstream(directory / name) << name;
+    std::vector<fs::path> expected = { directory / "a2.png", directory / "a10.png", directory / "b/c.png", directory / "z.txt" };
+
+    // the first files are known before the whole expression is expanded
+    FilenamesExpansion expansion(directory.string());
+    std::vector<fs::path> paths;
+    while (paths.empty() && expansion.step(paths))
+        continue;
+    CHECK(paths.size() == 2);
+    CHECK(!expansion.done());
+    while (expansion.step(paths))
+        continue;
+    CHECK(expansion.done());
+    CHECK(paths == expected);
+    CHECK(buildFilenamesFromExpression(directory.string()) == expected);
+
+    // the subexpressions are expanded in order
+    std::string expr = (directory / "b").string() + "::" + (directory / "a*.png").string();
+    CHECK(buildFilenamesFromExpression(expr) == std::vector<fs::path> { expected[2], expected[0], expected[1] });
+
+    fs::remove_all(directory);
+}
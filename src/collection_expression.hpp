@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "fs.hpp"
@@ -8,3 +9,27 @@
 class ImageCollection;
 
 std::vector<fs::path> buildFilenamesFromExpression(const std::string& expr);
+
+// Incremental version of buildFilenamesFromExpression: each step expands at most one
+// glob, one directory listing or one batch of files, so that the first filenames
+// are known before the whole expression is listed. The final order is the same.
+class FilenamesExpansion {
+    enum Kind {
+        SUBEXPRESSION,
+        DIRECTORY,
+        PATH,
+    };
+
+    std::string expr;
+    std::vector<std::pair<std::string, Kind>> pending;
+    size_t produced;
+
+    void emit(const std::vector<std::string>& filenames, std::vector<fs::path>& out);
+
+public:
+    FilenamesExpansion(const std::string& expr);
+
+    // appends the newly found filenames to 'out', returns false once everything was expanded
+    bool step(std::vector<fs::path>& out);
+    bool done() const;
+};
@@ -1,8 +1,18 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <mutex>
+
+#include <doctest.h>
 
 #include "Image.hpp"
+#include "xmalloc.hpp"
 
 #ifdef USE_PLAMBDA
+#include "ThreadPool.hpp"
 #include "plambda.h"
 #endif
 
@@ -16,34 +26,123 @@
 
 #include "editors.hpp"
 
-static std::shared_ptr<Image> edit_images_plambda(const char* prog,
+static void compile_plambda(EditProgram& program, const std::vector<std::shared_ptr<Image>>& images)
+{
+#ifdef USE_PLAMBDA
+    std::vector<int> d;
+    for (const auto& img : images)
+        d.push_back(img->c);
+
+    char* err;
+    struct plambda_compiled* p = plambda_compile(d.size(), d.data(), (char*)program.prog.c_str(), &err);
+    if (!p) {
+        program.error = std::string(err);
+        return;
+    }
+    program.plambda = std::shared_ptr<struct plambda_compiled>(p, plambda_free);
+
+    std::vector<char> glsl(1 << 16);
+    program.glslOutputDim = plambda_to_glsl(p, d.size(), d.data(), glsl.data(), glsl.size());
+    if (program.glslOutputDim)
+        program.glsl = std::string(glsl.data());
+#endif
+}
+
+#ifdef USE_PLAMBDA
+struct PlambdaInputs {
+    std::vector<float*> x;
+    std::vector<int> w;
+    std::vector<int> h;
+    std::vector<int> d;
+
+    PlambdaInputs(const std::vector<std::shared_ptr<Image>>& images)
+    {
+        for (const auto& img : images) {
+            x.push_back(img->pixels);
+            w.push_back(img->w);
+            h.push_back(img->h);
+            d.push_back(img->c);
+        }
+    }
+};
+
+static int get_plambda_output_dim(EditProgram& program, PlambdaInputs& in, std::string& error)
+{
+    if (!program.plambda) {
+        error = program.error;
+        return 0;
+    }
+
+    // the output dimension only depends on the channel counts, which are part of the cache key
+    int dd = program.outputDim;
+    if (!dd) {
+        char* err;
+        dd = plambda_output_dim(program.plambda.get(), &in.x[0], &in.d[0], &err);
+        if (!dd) {
+            error = std::string(err);
+            return 0;
+        }
+        program.outputDim = dd;
+    }
+    return dd;
+}
+
+// evaluates the rows j0..j1 of a grid of ow columns (see plambda_run_region)
+static bool run_plambda_region(EditProgram& program, PlambdaInputs& in, float* out, int dd,
+    int x0, int y0, int step, int ow, int j0, int j1, std::string& error)
+{
+    struct plambda_compiled* p = program.plambda.get();
+    std::string runerror;
+    ThreadPool& pool = getThreadPool();
+    if (pool.getConcurrency() > 1 && j1 - j0 > 1 && plambda_is_parallelizable(p)) {
+        // the inputs are complete images, so neighborhood operators read them freely
+        // and the bands only partition the output, no halo is needed
+        int nbands = std::min(j1 - j0, pool.getConcurrency() * 4);
+        std::mutex mutex;
+        pool.parallelFor(nbands, [&](int band) {
+            int b0 = j0 + (j1 - j0) * band / nbands;
+            int b1 = j0 + (j1 - j0) * (band + 1) / nbands;
+            char* err;
+            if (!plambda_run_region(p, out, dd, &in.x[0], &in.w[0], &in.h[0], &in.d[0],
+                    x0, y0, step, ow, b0, b1, &err)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (runerror.empty())
+                    runerror = std::string(err);
+            }
+        });
+    } else {
+        char* err;
+        if (!plambda_run_region(p, out, dd, &in.x[0], &in.w[0], &in.h[0], &in.d[0],
+                x0, y0, step, ow, j0, j1, &err))
+            runerror = std::string(err);
+    }
+    if (!runerror.empty()) {
+        error = runerror;
+        return false;
+    }
+    return true;
+}
+#endif
+
+static std::shared_ptr<Image> edit_images_plambda(EditProgram& program,
     const std::vector<std::shared_ptr<Image>>& images,
     std::string& error)
 {
 #ifdef USE_PLAMBDA
-    size_t n = images.size();
-    std::vector<float*> x(n);
-    std::vector<int> w(n);
-    std::vector<int> h(n);
-    std::vector<int> d(n);
-    for (size_t i = 0; i < n; i++) {
-        std::shared_ptr<Image> img = images[i];
-        x[i] = img->pixels;
-        w[i] = img->w;
-        h[i] = img->h;
-        d[i] = img->c;
-    }
-
-    int dd;
-    char* err;
-    float* pixels = execute_plambda(n, &x[0], &w[0], &h[0], &d[0],
-        (char*)prog, &dd, &err);
-    if (!pixels) {
-        error = std::string(err);
+    PlambdaInputs in(images);
+    int dd = get_plambda_output_dim(program, in, error);
+    if (!dd)
+        return nullptr;
+
+    int w = in.w[0];
+    int h = in.h[0];
+    float* pixels = (float*)xmalloc(sizeof(float) * w * h * dd);
+    if (!run_plambda_region(program, in, pixels, dd, 0, 0, 1, w, 0, h, error)) {
+        free(pixels);
         return nullptr;
     }
 
-    std::shared_ptr<Image> img = std::make_shared<Image>(pixels, w[0], h[0], dd);
+    std::shared_ptr<Image> img = std::make_shared<Image>(pixels, w, h, dd);
     return img;
 #else
     error = "not compiled with plambda support";
@@ -52,6 +151,45 @@ static std::shared_ptr<Image> edit_images_plambda(const char* prog,
 #endif
 }
 
+// Octave arrays are column-major with the dimensions (h, w, c) while vpv images are interleaved,
+// the conversions go through square tiles so that both sides are accessed by cache lines
+#define TRANSPOSE_TILE 32
+
+static void interleaved_to_planes(float* dst, const float* src, size_t w, size_t h, size_t c)
+{
+    for (size_t y0 = 0; y0 < h; y0 += TRANSPOSE_TILE) {
+        size_t y1 = std::min(h, y0 + TRANSPOSE_TILE);
+        for (size_t x0 = 0; x0 < w; x0 += TRANSPOSE_TILE) {
+            size_t x1 = std::min(w, x0 + TRANSPOSE_TILE);
+            for (size_t z = 0; z < c; z++) {
+                float* plane = dst + z * w * h;
+                for (size_t x = x0; x < x1; x++) {
+                    for (size_t y = y0; y < y1; y++) {
+                        plane[x * h + y] = src[(y * w + x) * c + z];
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void planes_to_interleaved(float* dst, const float* src, size_t w, size_t h, size_t c)
+{
+    for (size_t y0 = 0; y0 < h; y0 += TRANSPOSE_TILE) {
+        size_t y1 = std::min(h, y0 + TRANSPOSE_TILE);
+        for (size_t x0 = 0; x0 < w; x0 += TRANSPOSE_TILE) {
+            size_t x1 = std::min(w, x0 + TRANSPOSE_TILE);
+            for (size_t y = y0; y < y1; y++) {
+                for (size_t x = x0; x < x1; x++) {
+                    for (size_t z = 0; z < c; z++) {
+                        dst[(y * w + x) * c + z] = src[(z * w + x) * h + y];
+                    }
+                }
+            }
+        }
+    }
+}
+
 static std::shared_ptr<Image> edit_images_octave(const char* prog,
     const std::vector<std::shared_ptr<Image>>& images,
     std::string& error)
@@ -100,17 +238,8 @@ static std::shared_ptr<Image> edit_images_octave(const char* prog,
         for (size_t i = 0; i < images.size(); i++) {
             std::shared_ptr<Image> img = images[i];
             dim_vector size((int)img->h, (int)img->w, (int)img->c);
-            NDArray m(size);
-
-            float* xptr = img->pixels;
-            for (size_t y = 0; y < img->h; y++) {
-                for (size_t x = 0; x < img->w; x++) {
-                    for (size_t z = 0; z < img->c; z++) {
-                        m(y, x, z) = *(xptr++);
-                    }
-                }
-            }
-
+            FloatNDArray m(size);
+            interleaved_to_planes(m.fortran_vec(), img->pixels, img->w, img->h, img->c);
             in(i) = octave_value(m);
         }
 
@@ -122,20 +251,14 @@ static std::shared_ptr<Image> edit_images_octave(const char* prog,
 #endif
 
         if (out.length() > 0) {
-            NDArray m = out(0).array_value();
+            // converted only if the program returned doubles
+            FloatNDArray m = out(0).float_array_value();
             size_t w = m.cols();
             size_t h = m.rows();
             size_t d = m.ndims() == 3 ? m.pages() : 1;
             size_t size = w * h * d;
-            float* data = (float*)malloc(sizeof(float) * size);
-            float* ptrdata = data;
-            for (size_t y = 0; y < h; y++) {
-                for (size_t x = 0; x < w; x++) {
-                    for (size_t z = 0; z < d; z++) {
-                        *(ptrdata++) = m(y, x, z);
-                    }
-                }
-            }
+            float* data = (float*)xmalloc(sizeof(float) * size);
+            planes_to_interleaved(data, m.data(), w, h, d);
             std::shared_ptr<Image> img = std::make_shared<Image>(data, w, h, d);
             return img;
         } else {
@@ -158,27 +281,304 @@ static std::shared_ptr<Image> edit_images_octave(const char* prog,
     return nullptr;
 }
 
-std::shared_ptr<Image> edit_images(EditType edittype, const std::string& _prog,
+// compiled programs, bounded because each variable tweak in the EditGUI produces a new program
+#define MAX_EDIT_PROGRAMS 64
+static std::mutex programsMutex;
+static std::map<std::string, std::shared_ptr<EditProgram>> programs;
+
+std::shared_ptr<EditProgram> get_edit_program(EditType edittype, const std::string& prog,
+    const std::vector<std::shared_ptr<Image>>& images)
+{
+    std::string key = std::to_string(edittype) + ":";
+    for (const auto& img : images)
+        key += std::to_string(img->c) + ",";
+    key += ":" + prog;
+
+    // compilation is serialized anyway, since the plambda parser is not reentrant
+    std::lock_guard<std::mutex> lock(programsMutex);
+    auto it = programs.find(key);
+    if (it != programs.end())
+        return it->second;
+
+    auto program = std::make_shared<EditProgram>(edittype, prog);
+    if (edittype == PLAMBDA)
+        compile_plambda(*program, images);
+
+    if (programs.size() >= MAX_EDIT_PROGRAMS)
+        programs.clear();
+    programs[key] = program;
+    return program;
+}
+
+std::shared_ptr<Image> edit_images(EditProgram& program,
     const std::vector<std::shared_ptr<Image>>& images,
     std::string& error)
 {
-    char* prog = (char*)_prog.c_str();
     std::shared_ptr<Image> image;
-    switch (edittype) {
+    switch (program.edittype) {
     case PLAMBDA:
-        image = edit_images_plambda(prog, images, error);
+        image = edit_images_plambda(program, images, error);
         break;
     case OCTAVE:
-        image = edit_images_octave(prog, images, error);
+        image = edit_images_octave(program.prog.c_str(), images, error);
         break;
     }
     return image;
 }
 
+bool can_edit_images_by_parts(const EditProgram& program)
+{
+#ifdef USE_PLAMBDA
+    return program.edittype == PLAMBDA && program.plambda && plambda_is_parallelizable(program.plambda.get());
+#else
+    return false;
+#endif
+}
+
+int get_edit_output_dim(EditProgram& program, const std::vector<std::shared_ptr<Image>>& images,
+    std::string& error)
+{
+#ifdef USE_PLAMBDA
+    PlambdaInputs in(images);
+    return get_plambda_output_dim(program, in, error);
+#else
+    error = "not compiled with plambda support";
+    return 0;
+#endif
+}
+
+std::shared_ptr<Image> edit_images_region(EditProgram& program,
+    const std::vector<std::shared_ptr<Image>>& images,
+    int x0, int y0, int step, int w, int h, std::string& error)
+{
+#ifdef USE_PLAMBDA
+    PlambdaInputs in(images);
+    int dd = get_plambda_output_dim(program, in, error);
+    if (!dd)
+        return nullptr;
+
+    float* pixels = (float*)xmalloc(sizeof(float) * w * h * dd);
+    if (!run_plambda_region(program, in, pixels, dd, x0, y0, step, w, 0, h, error)) {
+        free(pixels);
+        return nullptr;
+    }
+    return std::make_shared<Image>(pixels, w, h, dd);
+#else
+    error = "not compiled with plambda support";
+    return nullptr;
+#endif
+}
+
+bool edit_images_rows(EditProgram& program, const std::vector<std::shared_ptr<Image>>& images,
+    float* pixels, int y0, int y1, std::string& error)
+{
+#ifdef USE_PLAMBDA
+    PlambdaInputs in(images);
+    int dd = get_plambda_output_dim(program, in, error);
+    if (!dd)
+        return false;
+    int w = in.w[0];
+    return run_plambda_region(program, in, pixels + (size_t)y0 * w * dd, dd, 0, y0, 1, w, 0, y1 - y0, error);
+#else
+    error = "not compiled with plambda support";
+    return false;
+#endif
+}
+
 #include "ImageCollection.hpp"
 #include "Sequence.hpp"
 #include "globals.hpp"
 
+// canonical tokens of a plambda program and the token counts of its prefixes (see plambda_prefixes)
+static bool describe_plambda(const std::string& prog, int n, std::vector<std::string>& tokens, std::vector<int>& prefixes)
+{
+#ifdef USE_PLAMBDA
+    // the plambda parser is not reentrant
+    std::lock_guard<std::mutex> lock(programsMutex);
+    char* err;
+    struct plambda_compiled* p = plambda_compile(n, nullptr, (char*)prog.c_str(), &err);
+    if (!p)
+        return false;
+    std::vector<char> buf(prog.size() + 16 * n + 1024);
+    int count = plambda_canonical_text(p, buf.data(), buf.size());
+    std::string text = buf.data();
+    tokens.clear();
+    for (size_t i = 0; count && i < text.size();) {
+        size_t j = std::min(text.find(' ', i), text.size());
+        tokens.push_back(text.substr(i, j - i));
+        i = j + 1;
+    }
+    // the prefixes count the compiled tokens
+    bool ok = count && (int)tokens.size() == count;
+    if (ok) {
+        prefixes.resize(64);
+        prefixes.resize(plambda_prefixes(p, prefixes.data(), prefixes.size()));
+    }
+    plambda_free(p);
+    return ok;
+#else
+    return false;
+#endif
+}
+
+// joins the tokens from..to of a canonical program, with its variables renamed so that
+// the inputs it uses are numbered from first, inputs receives their original indices
+static std::string rename_plambda_inputs(const std::vector<std::string>& tokens, size_t from, size_t to,
+    int first, std::vector<int>& inputs)
+{
+    auto input = [](const std::string& token) {
+        if (token.compare(0, 6, "hidden") || token.size() < 8 || !isdigit(token[6]) || !isdigit(token[7]))
+            return -1;
+        return std::stoi(token.substr(6, 2));
+    };
+    for (size_t i = from; i < to; i++) {
+        int k = input(tokens[i]);
+        if (k >= 0 && std::find(inputs.begin(), inputs.end(), k) == inputs.end())
+            inputs.push_back(k);
+    }
+    std::sort(inputs.begin(), inputs.end());
+
+    std::string text;
+    for (size_t i = from; i < to; i++) {
+        if (!text.empty())
+            text += " ";
+        int k = input(tokens[i]);
+        if (k >= 0) {
+            char name[16];
+            int renamed = std::find(inputs.begin(), inputs.end(), k) - inputs.begin();
+            snprintf(name, sizeof(name), "hidden%02d", first + renamed);
+            text += name + tokens[i].substr(8);
+        } else {
+            text += tokens[i];
+        }
+    }
+    return text;
+}
+
+// splits a canonical program after its k first tokens, the result of the prefix is the first input of the rest
+// plambda takes the size of the output and of :w, :h, :i, :j from the first input,
+// so a prefix which does not read it would give its size to the rest, and is not split
+static bool split_plambda(const std::vector<std::string>& tokens, int k, std::string& prefix,
+    std::vector<int>& prefixInputs, std::string& rest, std::vector<int>& restInputs)
+{
+    prefixInputs.clear();
+    restInputs.clear();
+    prefix = rename_plambda_inputs(tokens, 0, k, 0, prefixInputs);
+    if (prefixInputs.empty() || prefixInputs[0] != 0)
+        return false;
+    rest = "hidden00 " + rename_plambda_inputs(tokens, k, tokens.size(), 1, restInputs);
+    return true;
+}
+
+// edits of equivalent collections with the same canonical program are the same node,
+// so that the results of their shared prefixes are found in the ImageCache
+struct EditNode {
+    std::weak_ptr<EditedImageCollection> node;
+    int users = 0;
+};
+// the nodes are released by the I/O thread too, when it drops the last provider of an edit
+static std::recursive_mutex editNodesMutex;
+static std::map<std::string, EditNode> editNodes;
+
+int get_edit_users(const std::string& identity)
+{
+    std::lock_guard<std::recursive_mutex> lock(editNodesMutex);
+    auto it = editNodes.find(identity);
+    return it == editNodes.end() ? 0 : it->second.users;
+}
+
+static void acquire_edit_user(const std::string& identity)
+{
+    std::lock_guard<std::recursive_mutex> lock(editNodesMutex);
+    editNodes[identity].users++;
+}
+
+void release_edit_user(const std::string& identity)
+{
+    std::lock_guard<std::recursive_mutex> lock(editNodesMutex);
+    auto it = editNodes.find(identity);
+    if (it != editNodes.end() && --it->second.users <= 0 && it->second.node.expired())
+        editNodes.erase(it);
+}
+
+// a sequence showing an edit, it is a user of the edit until it drops its collection
+class EditUser {
+    std::string identity;
+
+public:
+    std::shared_ptr<EditedImageCollection> node;
+
+    explicit EditUser(std::shared_ptr<EditedImageCollection> node)
+        : identity(node->getIdentity())
+        , node(node)
+    {
+        acquire_edit_user(identity);
+    }
+
+    ~EditUser()
+    {
+        release_edit_user(identity);
+    }
+};
+
+static std::shared_ptr<EditedImageCollection> get_edited_collection(EditType edittype, const std::string& prog,
+    const std::vector<std::shared_ptr<ImageCollection>>& collections)
+{
+    std::lock_guard<std::recursive_mutex> lock(editNodesMutex);
+    std::vector<std::string> tokens;
+    std::vector<int> prefixes;
+    std::string text = prog;
+    if (edittype == PLAMBDA && describe_plambda(prog, collections.size(), tokens, prefixes)) {
+        text.clear();
+        for (const auto& token : tokens)
+            text += (text.empty() ? "" : " ") + token;
+    } else {
+        prefixes.clear();
+    }
+
+    auto node = std::make_shared<EditedImageCollection>(edittype, text, collections);
+    std::string identity = node->getIdentity();
+    EditNode& entry = editNodes[identity];
+    if (auto existing = entry.node.lock())
+        return existing;
+
+    for (int k : prefixes) {
+        // the rest of the program starts with the result of the prefix
+        std::string prefix, rest;
+        std::vector<int> prefixInputs, restInputs;
+        if (!split_plambda(tokens, k, prefix, prefixInputs, rest, restInputs))
+            continue;
+
+        std::vector<std::shared_ptr<ImageCollection>> prefixCollections;
+        for (int i : prefixInputs)
+            prefixCollections.push_back(collections[i]);
+        std::shared_ptr<EditedImageCollection> sub = get_edited_collection(edittype, prefix, prefixCollections);
+        std::vector<std::shared_ptr<ImageCollection>> restCollections = { sub };
+        for (int i : restInputs)
+            restCollections.push_back(collections[i]);
+        std::string subIdentity = sub->getIdentity();
+        acquire_edit_user(subIdentity);
+        // the longer prefixes are users of the shorter ones too
+        int ownUsers = 1;
+        for (const auto& longer : node->subexpressions) {
+            for (const auto& s : longer.prefix->subexpressions)
+                ownUsers += s.identity == subIdentity;
+        }
+        node->subexpressions.push_back({ sub, std::make_shared<EditedImageCollection>(edittype, rest, restCollections),
+            subIdentity, ownUsers });
+    }
+
+    // the recursion may have added entries, the reference is found again
+    editNodes[identity].node = node;
+    for (auto it = editNodes.begin(); it != editNodes.end();) {
+        if (it->second.node.expired() && it->second.users <= 0)
+            it = editNodes.erase(it);
+        else
+            ++it;
+    }
+    return node;
+}
+
 std::shared_ptr<ImageCollection> create_edited_collection(EditType edittype, const std::string& _prog)
 {
     char* prog = (char*)_prog.c_str();
@@ -220,5 +620,278 @@ std::shared_ptr<ImageCollection> create_edited_collection(EditType edittype, con
         return nullptr;
     }
 
-    return std::make_shared<EditedImageCollection>(edittype, std::string(prog), collections);
+    // the collection points to the edit, and owns it through the user
+    auto user = std::make_shared<EditUser>(get_edited_collection(edittype, std::string(prog), collections));
+    return std::shared_ptr<ImageCollection>(user, user->node.get());
+}
+
+TEST_CASE("octave layout conversion")
+{
+    for (size_t c : { 1, 3, 4 }) {
+        size_t w = 67;
+        size_t h = 45;
+        std::vector<float> src(w * h * c);
+        for (size_t i = 0; i < src.size(); i++)
+            src[i] = i;
+        std::vector<float> planes(src.size());
+        interleaved_to_planes(planes.data(), src.data(), w, h, c);
+        size_t z = c - 1;
+        CHECK(planes[(z * w + 5) * h + 7] == src[(7 * w + 5) * c + z]);
+        std::vector<float> back(src.size());
+        planes_to_interleaved(back.data(), planes.data(), w, h, c);
+        CHECK(back == src);
+    }
+}
+
+#ifdef USE_PLAMBDA
+static std::vector<float> run_plambda_test(const char* prog, std::vector<std::vector<float>>& inputs,
+    int w, int h, std::vector<int> d, bool block, int& dd)
+{
+    std::vector<float*> x;
+    for (auto& in : inputs)
+        x.push_back(in.data());
+    std::vector<int> ws(inputs.size(), w);
+    std::vector<int> hs(inputs.size(), h);
+
+    char* err;
+    struct plambda_compiled* p = plambda_compile(inputs.size(), d.data(), (char*)prog, &err);
+    REQUIRE(p);
+    CHECK(plambda_set_block_evaluation(p, block) == block);
+    dd = plambda_output_dim(p, x.data(), d.data(), &err);
+    std::vector<float> out(w * h * dd);
+    CHECK(plambda_run_rows(p, out.data(), dd, x.data(), ws.data(), hs.data(), d.data(), 0, h, &err));
+    plambda_free(p);
+    return out;
+}
+
+static std::vector<std::vector<float>> make_plambda_inputs(int w, int h, const std::vector<int>& d)
+{
+    std::vector<std::vector<float>> inputs;
+    for (size_t k = 0; k < d.size(); k++) {
+        std::vector<float> in(w * h * d[k]);
+        for (size_t i = 0; i < in.size(); i++)
+            in[i] = std::sin(i * 0.37f + k) * 10;
+        in[k] = NAN;
+        inputs.push_back(in);
+    }
+    return inputs;
+}
+
+TEST_CASE("plambda block evaluation")
+{
+    std::vector<int> d = { 3, 1 };
+    for (int w : { 7, 256, 300 }) {
+        int h = 5;
+        auto inputs = make_plambda_inputs(w, h, d);
+        for (const char* prog : { "x y - fabs 10 *", "x y > x y if", "x[0] y hypot :i +",
+                 "x split rot + join y join", "x >1 y <1 + dup *", "x,l y,x + x(1,-1) *", ":X y join x[2] *" }) {
+            INFO(prog << " w=" << w);
+            int dd1, dd2;
+            auto scalar = run_plambda_test(prog, inputs, w, h, d, false, dd1);
+            auto block = run_plambda_test(prog, inputs, w, h, d, true, dd2);
+            CHECK(dd1 == dd2);
+            CHECK(std::memcmp(scalar.data(), block.data(), scalar.size() * sizeof(float)) == 0);
+        }
+    }
+
+    SUBCASE("fallback")
+    {
+        auto inputs = make_plambda_inputs(4, 4, d);
+        for (const char* prog : { "x vavg y +", "x%O y +", "x randu y + +" }) {
+            char* err;
+            struct plambda_compiled* p = plambda_compile(inputs.size(), d.data(), (char*)prog, &err);
+            REQUIRE(p);
+            CHECK(!plambda_set_block_evaluation(p, true));
+            plambda_free(p);
+        }
+    }
+}
+
+TEST_CASE("plambda region evaluation")
+{
+    std::vector<int> d = { 3, 1 };
+    int w = 300;
+    int h = 40;
+    auto inputs = make_plambda_inputs(w, h, d);
+    std::vector<float*> x;
+    for (auto& in : inputs)
+        x.push_back(in.data());
+    std::vector<int> ws(inputs.size(), w);
+    std::vector<int> hs(inputs.size(), h);
+    for (const char* prog : { "x y - fabs 10 *", "x[0] y hypot :i + :j *", "x,l y,x + x(1,-1) *" }) {
+        for (int block = 0; block < 2; block++) {
+            INFO(prog << " block=" << block);
+            int dd;
+            auto full = run_plambda_test(prog, inputs, w, h, d, block, dd);
+
+            char* err;
+            struct plambda_compiled* p = plambda_compile(inputs.size(), d.data(), (char*)prog, &err);
+            REQUIRE(p);
+            plambda_set_block_evaluation(p, block);
+            int x0 = 13, y0 = 5, step = 3, ow = 90, oh = 11;
+            std::vector<float> region(ow * oh * dd);
+            CHECK(plambda_run_region(p, region.data(), dd, x.data(), ws.data(), hs.data(), d.data(),
+                x0, y0, step, ow, 0, oh, &err));
+            plambda_free(p);
+            for (int j = 0; j < oh; j++)
+                for (int i = 0; i < ow; i++)
+                    for (int l = 0; l < dd; l++)
+                        CHECK(std::memcmp(&region[(j * ow + i) * dd + l],
+                                  &full[((y0 + j * step) * w + x0 + i * step) * dd + l], sizeof(float))
+                            == 0);
+        }
+    }
+}
+
+TEST_CASE("plambda sub-expressions")
+{
+    std::vector<std::string> tokens;
+    std::vector<int> prefixes;
+    auto text = [&]() {
+        std::string text;
+        for (const auto& token : tokens)
+            text += (text.empty() ? "" : " ") + token;
+        return text;
+    };
+    REQUIRE(describe_plambda("x y - fabs", 2, tokens, prefixes));
+    CHECK(text() == "hidden00 hidden01 - fabs");
+    CHECK(prefixes == std::vector<int> { 3 });
+    REQUIRE(describe_plambda("-  fabs", 2, tokens, prefixes));
+    CHECK(text() == "hidden00 hidden01 - fabs");
+    // plambda splits the tokens on underscores too
+    REQUIRE(describe_plambda("\tu_v\n-   fabs ", 2, tokens, prefixes));
+    CHECK(text() == "hidden00 hidden01 - fabs");
+    CHECK(tokens.size() == 4);
+    REQUIRE(describe_plambda("b[0] a,l - a(1,0) *", 2, tokens, prefixes));
+    CHECK(text() == "hidden01[0] hidden00,l - hidden00(1,0) *");
+    CHECK(prefixes == std::vector<int> { 3 });
+    REQUIRE(describe_plambda("x >1 <1 y +", 2, tokens, prefixes));
+    CHECK(prefixes.empty());
+
+    // a prefix which does not read the first input would give the size of another one to the rest
+    REQUIRE(describe_plambda("y fabs x +", 2, tokens, prefixes));
+    REQUIRE(prefixes == std::vector<int> { 2 });
+    std::string prefix, rest;
+    std::vector<int> prefixInputs, restInputs;
+    CHECK(!split_plambda(tokens, 2, prefix, prefixInputs, rest, restInputs));
+    REQUIRE(describe_plambda("x fabs y +", 2, tokens, prefixes));
+    REQUIRE(split_plambda(tokens, 2, prefix, prefixInputs, rest, restInputs));
+    CHECK(prefix == "hidden00 fabs");
+    CHECK(rest == "hidden00 hidden01 +");
+
+    // the rest of the program evaluated on the result of the prefix gives the same image,
+    // also when the second input has another size
+    int w = 31;
+    int h = 7;
+    auto makeImage = [](int w, int h, int d) {
+        auto input = make_plambda_inputs(w, h, { d })[0];
+        float* pixels = (float*)xmalloc(sizeof(float) * input.size());
+        std::copy(input.begin(), input.end(), pixels);
+        return std::make_shared<Image>(pixels, w, h, d);
+    };
+    for (auto size : { std::make_pair(w, h), std::make_pair(17, 12) }) {
+        std::vector<std::shared_ptr<Image>> images = { makeImage(w, h, 3), makeImage(size.first, size.second, 1) };
+        for (const char* prog : { "x y - fabs x *", "y x[1] + :i * y hypot", "x y join split + + y 2 * -",
+                 "y fabs x + :w *" }) {
+            INFO(prog << " with y of " << size.first << "x" << size.second);
+            REQUIRE(describe_plambda(prog, 2, tokens, prefixes));
+            REQUIRE(!prefixes.empty());
+            std::string error;
+            std::shared_ptr<Image> full = edit_images(*get_edit_program(PLAMBDA, prog, images), images, error);
+            REQUIRE(bool(full));
+            REQUIRE(full->w == w);
+            REQUIRE(full->h == h);
+            for (int k : prefixes) {
+                if (!split_plambda(tokens, k, prefix, prefixInputs, rest, restInputs))
+                    continue;
+                INFO(prefix << " / " << rest);
+                std::vector<std::shared_ptr<Image>> prefixImages;
+                for (int i : prefixInputs)
+                    prefixImages.push_back(images[i]);
+                std::vector<std::shared_ptr<Image>> restImages;
+                restImages.push_back(edit_images(*get_edit_program(PLAMBDA, prefix, prefixImages), prefixImages, error));
+                REQUIRE(bool(restImages[0]));
+                for (int i : restInputs)
+                    restImages.push_back(images[i]);
+                std::shared_ptr<Image> split = edit_images(*get_edit_program(PLAMBDA, rest, restImages), restImages, error);
+                REQUIRE(bool(split));
+                REQUIRE(split->w == full->w);
+                REQUIRE(split->h == full->h);
+                REQUIRE(split->c == full->c);
+                CHECK(std::memcmp(split->pixels, full->pixels, sizeof(float) * w * h * full->c) == 0);
+            }
+        }
+    }
 }
+
+TEST_CASE("plambda shared sub-expressions")
+{
+    class Files : public ImageCollection {
+    public:
+        int getLength() const override { return 1; }
+        std::shared_ptr<ImageProvider> getImageProvider(int) const override { return nullptr; }
+        const std::string& getFilename(int) const override { return empty; }
+        std::string getKey(int) const override { return "files"; }
+        void onFileReload(const std::string&) override { }
+    };
+    auto a = std::make_shared<Files>();
+    auto b = std::make_shared<Files>();
+
+    // equivalent collections and programs give the same edit
+    auto e1 = get_edited_collection(PLAMBDA, "x y - fabs 2 *", { std::make_shared<OffsetedImageCollection>(a, 1), b });
+    auto same = get_edited_collection(PLAMBDA, "u_v -  fabs 2 *", { std::make_shared<OffsetedImageCollection>(a, 1), b });
+    CHECK(e1 == same);
+    CHECK(get_edited_collection(PLAMBDA, "x y - fabs 2 *", { std::make_shared<OffsetedImageCollection>(a, 2), b }) != e1);
+    CHECK(get_edited_collection(PLAMBDA, "x y - fabs 2 *", { a, b }) != e1);
+
+    // from the longest prefix, "x y - fabs" and "x y -"
+    REQUIRE(e1->subexpressions.size() == 2);
+    const auto& fabs = e1->subexpressions[0];
+    const auto& diff = e1->subexpressions[1];
+    CHECK(fabs.ownUsers == 1);
+    CHECK(diff.ownUsers == 2);
+    CHECK(get_edit_users(fabs.identity) == 1);
+    CHECK(get_edit_users(diff.identity) == 2);
+    CHECK(fabs.prefix->subexpressions.at(0).prefix == diff.prefix);
+
+    {
+        // another edit with the same prefix shares it
+        auto e2 = get_edited_collection(PLAMBDA, "x y - 3 +", { std::make_shared<OffsetedImageCollection>(a, 1), b });
+        REQUIRE(e2->subexpressions.size() == 1);
+        CHECK(e2->subexpressions[0].prefix == diff.prefix);
+        CHECK(get_edit_users(diff.identity) == 3);
+        CHECK(get_edit_users(fabs.identity) == 1);
+
+        // and so does a sequence showing a prefix
+        EditUser user(fabs.prefix);
+        CHECK(get_edit_users(fabs.identity) == 2);
+    }
+    CHECK(get_edit_users(diff.identity) == 2);
+    CHECK(get_edit_users(fabs.identity) == 1);
+
+    std::string identity = diff.identity;
+    e1 = nullptr;
+    same = nullptr;
+    CHECK(get_edit_users(identity) == 0);
+}
+
+// run with: tests -tc="plambda benchmark" --no-skip
+TEST_CASE("plambda benchmark" * doctest::skip())
+{
+    int w = 1920;
+    int h = 1080;
+    std::vector<int> d = { 3, 3 };
+    auto inputs = make_plambda_inputs(w, h, d);
+    for (const char* prog : { "x y - fabs 10 *", "x y + 2 /", "x[0] y[0] - x[1] y[1] - hypot",
+             "x y - dup * sqrt", "x y > x y if", "x,l y -" }) {
+        double times[2];
+        for (int block = 0; block < 2; block++) {
+            int dd;
+            auto start = std::chrono::steady_clock::now();
+            run_plambda_test(prog, inputs, w, h, d, block, dd);
+            times[block] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        MESSAGE(prog << ": pixel by pixel " << times[0] << "ms, by blocks " << times[1] << "ms");
+    }
+}
+#endif
@@ -1,18 +1,62 @@
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <string>
 #include <vector>
 
 struct Image;
+struct plambda_compiled;
 
 enum EditType {
     PLAMBDA,
     OCTAVE,
 };
 
-std::shared_ptr<Image> edit_images(EditType edittype, const std::string& prog,
+// compiled form of an edit, shared by all the frames edited with the same program
+// and the same input channel counts (see get_edit_program)
+struct EditProgram {
+    EditType edittype;
+    std::string prog;
+    std::string error; // compilation error
+    std::shared_ptr<plambda_compiled> plambda;
+    std::atomic<int> outputDim; // 0 until the first run
+    std::string glsl; // fragment shader of a pointwise plambda program, empty if it has to run on the CPU
+    int glslOutputDim;
+
+    EditProgram(EditType edittype, const std::string& prog)
+        : edittype(edittype)
+        , prog(prog)
+        , outputDim(0)
+        , glslOutputDim(0)
+    {
+    }
+};
+
+// returns the cached program if it was already compiled for these inputs
+std::shared_ptr<EditProgram> get_edit_program(EditType edittype, const std::string& prog,
+    const std::vector<std::shared_ptr<Image>>& images);
+
+std::shared_ptr<Image> edit_images(EditProgram& program,
     const std::vector<std::shared_ptr<Image>>& images,
     std::string& error);
 
+// pointwise edits can be evaluated by parts, so that the visible region of a large edit
+// is shown before the rest is computed (see EditedImageProvider)
+bool can_edit_images_by_parts(const EditProgram& program);
+int get_edit_output_dim(EditProgram& program, const std::vector<std::shared_ptr<Image>>& images,
+    std::string& error);
+// evaluates the output on a grid of w*h pixels starting at (x0, y0), with a spacing of step pixels
+std::shared_ptr<Image> edit_images_region(EditProgram& program,
+    const std::vector<std::shared_ptr<Image>>& images,
+    int x0, int y0, int step, int w, int h, std::string& error);
+// evaluates the rows y0..y1 of the output, pixels holds the whole output
+bool edit_images_rows(EditProgram& program, const std::vector<std::shared_ptr<Image>>& images,
+    float* pixels, int y0, int y1, std::string& error);
+
+// the edits are shared by the sequences showing the same program of the same collections,
+// and the prefixes of the programs are shared by the edits (see EditedImageCollection::subexpressions)
 std::shared_ptr<class ImageCollection> create_edited_collection(EditType edittype, const std::string& prog);
+// of the edit with this identity: the sequences showing it and the edits having it as a prefix
+int get_edit_users(const std::string& identity);
+void release_edit_user(const std::string& identity);
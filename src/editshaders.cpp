@@ -0,0 +1,515 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+
+#include <GL/gl3w.h>
+#include <doctest.h>
+
+#include "GLTestContext.hpp"
+#include "Image.hpp"
+#include "OpenGLDebug.hpp"
+#include "Shader.hpp"
+#include "editors.hpp"
+#include "editshaders.hpp"
+#include "globals.hpp"
+#include "shaders.hpp"
+#include "xmalloc.hpp"
+
+// larger images are edited tile by tile
+#define GLSL_EDIT_TILE 1024
+#define MAX_EDIT_SHADERS 16
+// tiles rendered at each iteration of the main loop, so that a large edit does not stall the display
+#define GLSL_EDIT_TILES_PER_FRAME 2
+// tiles being copied back by the GPU while the next ones are rendered
+#define GLSL_EDIT_READBACKS 4
+
+bool GLSLEditJob::wait(int milliseconds)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return cv.wait_for(lock, std::chrono::milliseconds(milliseconds), [this] { return done; });
+}
+
+void GLSLEditJob::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    cv.notify_all();
+}
+
+static std::mutex jobsMutex;
+// the jobs whose tiles are not all rendered yet, in the order of submission
+static std::deque<std::shared_ptr<GLSLEditJob>> jobs;
+
+bool can_edit_images_glsl(const EditProgram& program, const std::vector<std::shared_ptr<Image>>& images)
+{
+    if (program.glsl.empty() || images.empty())
+        return false;
+    // the shader reads all the inputs at the same pixel
+    for (const auto& img : images) {
+        if (img->w != images[0]->w || img->h != images[0]->h)
+            return false;
+    }
+    return true;
+}
+
+static std::shared_ptr<GLSLEditJob> makeJob(const std::string& glsl, int outputDim,
+    const std::vector<std::shared_ptr<Image>>& images)
+{
+    auto job = std::make_shared<GLSLEditJob>();
+    job->glsl = glsl;
+    job->outputDim = outputDim;
+    job->images = images;
+
+    std::lock_guard<std::mutex> lock(jobsMutex);
+    jobs.push_back(job);
+    return job;
+}
+
+std::shared_ptr<GLSLEditJob> submit_glsl_edit(const EditProgram& program,
+    const std::vector<std::shared_ptr<Image>>& images)
+{
+    return makeJob(program.glsl, program.glslOutputDim, images);
+}
+
+static std::shared_ptr<Shader::Program> getEditShader(const std::string& glsl)
+{
+    // failed compilations are kept too, so that they are not retried at each frame
+    static std::map<std::string, std::shared_ptr<Shader::Program>> shaders;
+    auto it = shaders.find(glsl);
+    if (it != shaders.end())
+        return it->second;
+
+    std::shared_ptr<Shader::Program> program = createShader(glsl, "edit");
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program->getProgramID(), GL_LINK_STATUS, &linked);
+    if (linked != GL_TRUE)
+        program = nullptr;
+
+    if (shaders.size() >= MAX_EDIT_SHADERS)
+        shaders.clear();
+    shaders[glsl] = program;
+    return program;
+}
+
+// a rendered tile, copied to a pixel buffer by the GPU and read by a later run_glsl_edits
+struct EditReadback {
+    GLuint pbo;
+    GLsync fence;
+    std::shared_ptr<GLSLEditJob> job; // null when the buffer is free
+    size_t x, y, w, h;
+};
+
+struct EditTarget {
+    GLuint fbo;
+    GLuint texture;
+    GLuint vao;
+    GLuint vbo;
+    std::vector<GLuint> inputs; // of the tile size
+    std::vector<size_t> inputChannels; // the format of each input texture, 0 if not allocated yet
+    std::vector<EditReadback> readbacks;
+    std::deque<size_t> pending; // readbacks in the order of the rendering
+    size_t tile;
+    bool complete;
+};
+
+static EditTarget& getEditTarget()
+{
+    static EditTarget target;
+    static bool initialized = false;
+    if (initialized)
+        return target;
+    initialized = true;
+
+    GLint maxsize;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxsize);
+    target.tile = std::min(GLSL_EDIT_TILE, maxsize);
+
+    // float render targets are not clamped, and RGBA32F is the one that all GL 3.3 drivers can render to
+    glGenTextures(1, &target.texture);
+    glBindTexture(GL_TEXTURE_2D, target.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, target.tile, target.tile, 0, GL_RGBA, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    GLDEBUG();
+
+    glGenFramebuffers(1, &target.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.texture, 0);
+    target.complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    GLDEBUG();
+
+    // a quad covering the viewport, drawn with the default vertex shader (v_position at location 1)
+    static const float quad[] = { -1, -1, 1, -1, -1, 1, 1, 1 };
+    glGenVertexArrays(1, &target.vao);
+    glBindVertexArray(target.vao);
+    glGenBuffers(1, &target.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, target.vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    GLDEBUG();
+
+    target.readbacks.resize(GLSL_EDIT_READBACKS);
+    for (auto& r : target.readbacks) {
+        glGenBuffers(1, &r.pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, r.pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(float) * 4 * target.tile * target.tile, nullptr, GL_STREAM_READ);
+        r.fence = nullptr;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    GLDEBUG();
+
+    return target;
+}
+
+static GLenum getFormat(size_t c)
+{
+    static const GLenum formats[] = { GL_RED, GL_RED, GL_RG, GL_RGB, GL_RGBA };
+    return formats[c];
+}
+
+static GLenum getInternalFormat(size_t c)
+{
+    static const GLenum formats[] = { GL_R32F, GL_R32F, GL_RG32F, GL_RGB32F, GL_RGBA32F };
+    return formats[c];
+}
+
+static void finishJob(GLSLEditJob& job)
+{
+    if (job.error.empty()) {
+        job.result = std::make_shared<Image>(job.pixels, job.images[0]->w, job.images[0]->h, job.outputDim);
+    } else {
+        free(job.pixels);
+    }
+    job.pixels = nullptr;
+    job.images.clear();
+    job.finish();
+}
+
+// copies the tiles whose rendering is complete to the results, without waiting for the GPU
+static void collectReadbacks(EditTarget& target)
+{
+    while (!target.pending.empty()) {
+        EditReadback& r = target.readbacks[target.pending.front()];
+        // the flush makes sure that the fence is signaled eventually, even without a buffer swap
+        GLenum status = glClientWaitSync(r.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if (status == GL_TIMEOUT_EXPIRED)
+            return;
+        target.pending.pop_front();
+        glDeleteSync(r.fence);
+        r.fence = nullptr;
+
+        GLSLEditJob& job = *r.job;
+        size_t c = job.outputDim;
+        size_t w = job.images[0]->w;
+        size_t rowBytes = sizeof(float) * r.w * c;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, r.pbo);
+        const char* mapped = status == GL_WAIT_FAILED ? nullptr
+                                                      : (const char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, rowBytes * r.h, GL_MAP_READ_BIT);
+        if (mapped) {
+            for (size_t j = 0; j < r.h; j++)
+                memcpy(job.pixels + ((r.y + j) * w + r.x) * c, mapped + j * rowBytes, rowBytes);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        } else if (job.error.empty()) {
+            job.error = "cannot read the result of the edit shader";
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        GLDEBUG();
+
+        job.pendingTiles--;
+        if (job.nextTile == job.tileCount && job.pendingTiles == 0)
+            finishJob(job);
+        r.job = nullptr;
+    }
+}
+
+// renders the next tile of the job into a free readback buffer
+static void renderTile(EditTarget& target, Shader::Program& shader, GLSLEditJob& job, EditReadback& r)
+{
+    const std::vector<std::shared_ptr<Image>>& images = job.images;
+    size_t n = images.size();
+    size_t w = images[0]->w;
+    size_t h = images[0]->h;
+    size_t ts = target.tile;
+    size_t tilesX = (w + ts - 1) / ts;
+    r.x = job.nextTile % tilesX * ts;
+    r.y = job.nextTile / tilesX * ts;
+    r.w = std::min(ts, w - r.x);
+    r.h = std::min(ts, h - r.y);
+
+    while (target.inputs.size() < n) {
+        GLuint id;
+        glGenTextures(1, &id);
+        glBindTexture(GL_TEXTURE_2D, id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        target.inputs.push_back(id);
+        target.inputChannels.push_back(0);
+    }
+    for (size_t k = 0; k < n; k++) {
+        const Image& img = *images[k];
+        glActiveTexture(GL_TEXTURE0 + k);
+        glBindTexture(GL_TEXTURE_2D, target.inputs[k]);
+        if (target.inputChannels[k] != img.c) {
+            glTexImage2D(GL_TEXTURE_2D, 0, getInternalFormat(img.c), ts, ts, 0, getFormat(img.c), GL_FLOAT, nullptr);
+            target.inputChannels[k] = img.c;
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, r.w, r.h, getFormat(img.c), GL_FLOAT, img.pixels + (r.y * w + r.x) * img.c);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    GLDEBUG();
+
+    GLuint id = shader.getProgramID();
+    for (size_t k = 0; k < n; k++) {
+        std::string name = "x" + std::to_string(k);
+        glUniform1i(glGetUniformLocation(id, name.c_str()), k);
+    }
+    shader.setParameter("size", w, h, 0);
+    shader.setParameter("origin", r.x, r.y, 0);
+    glViewport(0, 0, r.w, r.h);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    GLDEBUG();
+
+    // the copy to the buffer is done by the GPU, the fence tells when it can be mapped
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, r.pbo);
+    glReadPixels(0, 0, r.w, r.h, getFormat(job.outputDim), GL_FLOAT, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    r.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    GLDEBUG();
+
+    job.nextTile++;
+    job.pendingTiles++;
+}
+
+// renders at most GLSL_EDIT_TILES_PER_FRAME tiles of the first jobs, returns whether a job was started
+static bool renderTiles(EditTarget& target)
+{
+    // the main loop renders with imgui afterwards, restore what it may rely on
+    GLint lastFbo, lastProgram, lastVao, lastActiveTexture, lastTexture;
+    GLint lastViewport[4];
+    GLboolean lastBlend, lastScissor;
+    bool saved = false;
+
+    for (int rendered = 0; rendered < GLSL_EDIT_TILES_PER_FRAME;) {
+        std::shared_ptr<GLSLEditJob> job;
+        {
+            std::lock_guard<std::mutex> lock(jobsMutex);
+            if (jobs.empty())
+                break;
+            job = jobs.front();
+        }
+
+        if (!job->pixels) {
+            size_t w = job->images[0]->w;
+            size_t h = job->images[0]->h;
+            job->tileCount = ((w + target.tile - 1) / target.tile) * ((h + target.tile - 1) / target.tile);
+            job->pixels = (float*)xmalloc(sizeof(float) * w * h * job->outputDim);
+        }
+        std::shared_ptr<Shader::Program> shader = getEditShader(job->glsl);
+        if (!shader || !target.complete) {
+            job->error = !shader ? "cannot compile the edit shader" : "cannot render to float textures";
+            job->nextTile = job->tileCount;
+        }
+
+        if (job->nextTile < job->tileCount) {
+            auto slot = std::find_if(target.readbacks.begin(), target.readbacks.end(),
+                [](const EditReadback& r) { return !r.job; });
+            if (slot == target.readbacks.end())
+                break;
+
+            if (!saved) {
+                saved = true;
+                glGetIntegerv(GL_FRAMEBUFFER_BINDING, &lastFbo);
+                glGetIntegerv(GL_CURRENT_PROGRAM, &lastProgram);
+                glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &lastVao);
+                glGetIntegerv(GL_ACTIVE_TEXTURE, &lastActiveTexture);
+                glGetIntegerv(GL_VIEWPORT, lastViewport);
+                glActiveTexture(GL_TEXTURE0);
+                glGetIntegerv(GL_TEXTURE_BINDING_2D, &lastTexture);
+                lastBlend = glIsEnabled(GL_BLEND);
+                lastScissor = glIsEnabled(GL_SCISSOR_TEST);
+                glDisable(GL_BLEND);
+                glDisable(GL_SCISSOR_TEST);
+                glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+                glBindVertexArray(target.vao);
+            }
+            shader->bind();
+            static const float identity[] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+            glUniformMatrix4fv(glGetUniformLocation(shader->getProgramID(), "v_transform"), 1, GL_FALSE, identity);
+            slot->job = job;
+            renderTile(target, *shader, *job, *slot);
+            target.pending.push_back(slot - target.readbacks.begin());
+            rendered++;
+        }
+
+        if (job->nextTile == job->tileCount) {
+            {
+                std::lock_guard<std::mutex> lock(jobsMutex);
+                jobs.pop_front();
+            }
+            if (job->pendingTiles == 0)
+                finishJob(*job);
+        }
+    }
+
+    if (saved) {
+        for (size_t k = 0; k < target.inputs.size(); k++) {
+            glActiveTexture(GL_TEXTURE0 + k);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, lastTexture);
+        glActiveTexture(lastActiveTexture);
+        glBindVertexArray(lastVao);
+        glBindFramebuffer(GL_FRAMEBUFFER, lastFbo);
+        glUseProgram(lastProgram);
+        glViewport(lastViewport[0], lastViewport[1], lastViewport[2], lastViewport[3]);
+        if (lastBlend)
+            glEnable(GL_BLEND);
+        if (lastScissor)
+            glEnable(GL_SCISSOR_TEST);
+        GLDEBUG();
+    }
+    return saved;
+}
+
+bool run_glsl_edits()
+{
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        if (jobs.empty() && getEditTarget().pending.empty())
+            return false;
+    }
+    EditTarget& target = getEditTarget();
+    collectReadbacks(target);
+    renderTiles(target);
+
+    bool busy = !target.pending.empty();
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        busy = busy || !jobs.empty();
+    }
+    if (busy) {
+        // the main loop has to come back to read the results
+        gActive = std::max(gActive, 1);
+    }
+    return busy;
+}
+
+std::shared_ptr<Image> edit_images_glsl(const std::string& glsl, int outputDim,
+    const std::vector<std::shared_ptr<Image>>& images, std::string& error)
+{
+    std::shared_ptr<GLSLEditJob> job = makeJob(glsl, outputDim, images);
+    while (run_glsl_edits() && !job->wait(0))
+        continue;
+    error = job->error;
+    return job->result;
+}
+
+#ifdef USE_PLAMBDA
+// needs an OpenGL 3.3 context, see GLTestContext
+TEST_CASE("plambda GLSL evaluation")
+{
+    GLTestContext gl;
+    if (!gl)
+        return;
+
+    // larger than a tile, and not a multiple of its size
+    int w = GLSL_EDIT_TILE + 37;
+    int h = 300;
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> dist(-100.f, 100.f);
+    auto makeImage = [&](int c) {
+        float* pixels = (float*)malloc(sizeof(float) * w * h * c);
+        // quantized, so that there are exact zeros and equal values for the comparisons
+        for (int i = 0; i < w * h * c; i++)
+            pixels[i] = std::round(dist(gen) * 4) / 4;
+        return std::make_shared<Image>(pixels, w, h, c);
+    };
+    std::vector<std::shared_ptr<Image>> rgb = { makeImage(3), makeImage(3) };
+    std::vector<std::shared_ptr<Image>> mixed = { makeImage(1), makeImage(4) };
+
+    struct {
+        const char* prog;
+        std::vector<std::shared_ptr<Image>>& images;
+        float tolerance; // relative, the transcendental functions of the GPU are approximations
+    } cases[] = {
+        { "x y -", rgb, 0 },
+        { "x y /", rgb, 1e-6 },
+        { "x y - 2 ^", rgb, 1e-5 },
+        { "x y - fabs x y + / 100 *", rgb, 1e-6 },
+        { "x y > x y if", rgb, 0 },
+        { "x[0] y[2] fmin :i :j * +", rgb, 0 },
+        { "x split rot join3 y -", rgb, 0 },
+        { "x sqrt y", mixed, 0 },
+        { "x y[3] * y[0] join", mixed, 0 },
+        { "x >1 <1 <1 * <1 sin + y[1] +", mixed, 1e-4 },
+        { "x 100 / :x :y hypot * exp2 log2 y *", mixed, 1e-4 },
+    };
+
+    for (auto& cs : cases) {
+        INFO(cs.prog);
+        std::string error;
+        std::shared_ptr<EditProgram> program = get_edit_program(PLAMBDA, cs.prog, cs.images);
+        REQUIRE(can_edit_images_glsl(*program, cs.images));
+        std::shared_ptr<Image> cpu = edit_images(*program, cs.images, error);
+        REQUIRE(bool(cpu));
+        std::shared_ptr<Image> gpu = edit_images_glsl(program->glsl, program->glslOutputDim, cs.images, error);
+        REQUIRE(bool(gpu));
+        REQUIRE(gpu->c == cpu->c);
+
+        int mismatches = 0;
+        std::string first;
+        for (size_t i = 0; i < cpu->w * cpu->h * cpu->c; i++) {
+            float a = cpu->pixels[i];
+            float b = gpu->pixels[i];
+            if (a == b || (std::isnan(a) && std::isnan(b)))
+                continue;
+            if (!(std::abs(a - b) <= cs.tolerance * std::max(1.f, std::abs(a)))) {
+                if (!mismatches)
+                    first = std::to_string(i) + ": " + std::to_string(a) + " vs " + std::to_string(b);
+                mismatches++;
+            }
+        }
+        INFO("first mismatch at " << first);
+        CHECK(mismatches == 0);
+    }
+
+    {
+        // the tiles are spread over several iterations of the main loop
+        float* pixels = (float*)malloc(sizeof(float) * 4 * GLSL_EDIT_TILE * 8);
+        for (int i = 0; i < 4 * GLSL_EDIT_TILE * 8; i++)
+            pixels[i] = i;
+        std::vector<std::shared_ptr<Image>> wide = { std::make_shared<Image>(pixels, 4 * GLSL_EDIT_TILE, 8, 1) };
+        std::shared_ptr<EditProgram> program = get_edit_program(PLAMBDA, "x 2 *", wide);
+        std::shared_ptr<GLSLEditJob> job = submit_glsl_edit(*program, wide);
+        int iterations = 0;
+        while (run_glsl_edits())
+            iterations++;
+        CHECK(iterations >= 4 / GLSL_EDIT_TILES_PER_FRAME);
+        REQUIRE(job->wait(0));
+        REQUIRE(bool(job->result));
+        CHECK(job->result->pixels[1] == 2);
+        CHECK(job->result->pixels[4 * GLSL_EDIT_TILE * 8 - 1] == 2.f * (4 * GLSL_EDIT_TILE * 8 - 1));
+    }
+
+    SUBCASE("not pointwise")
+    {
+        std::shared_ptr<EditProgram> program = get_edit_program(PLAMBDA, "x(1,0) y -", rgb);
+        CHECK(!can_edit_images_glsl(*program, rgb));
+    }
+}
+#endif
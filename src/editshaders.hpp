@@ -0,0 +1,57 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct Image;
+struct EditProgram;
+
+// pointwise plambda edits can be evaluated by a fragment shader (see plambda_to_glsl)
+// the OpenGL context belongs to the main thread, so the loading threads submit jobs
+// which are run by run_glsl_edits at each iteration of the main loop, a few tiles at a time
+class GLSLEditJob {
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done;
+
+public:
+    std::string glsl;
+    int outputDim;
+    std::vector<std::shared_ptr<Image>> images;
+
+    std::shared_ptr<Image> result;
+    std::string error;
+
+    // used by run_glsl_edits on the main thread
+    float* pixels;
+    size_t nextTile;
+    size_t tileCount;
+    size_t pendingTiles;
+
+    GLSLEditJob()
+        : done(false)
+        , outputDim(0)
+        , pixels(nullptr)
+        , nextTile(0)
+        , tileCount(0)
+        , pendingTiles(0)
+    {
+    }
+
+    // returns whether the job is done, waiting at most the given duration
+    bool wait(int milliseconds);
+    void finish();
+};
+
+bool can_edit_images_glsl(const EditProgram& program, const std::vector<std::shared_ptr<Image>>& images);
+std::shared_ptr<GLSLEditJob> submit_glsl_edit(const EditProgram& program,
+    const std::vector<std::shared_ptr<Image>>& images);
+// renders some tiles and reads back the finished ones, returns whether jobs remain
+bool run_glsl_edits();
+
+// needs the OpenGL context, runs the edit to completion
+std::shared_ptr<Image> edit_images_glsl(const std::string& glsl, int outputDim,
+    const std::vector<std::shared_ptr<Image>>& images, std::string& error);
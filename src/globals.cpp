@@ -26,8 +26,16 @@ bool gShowImage;
 float gDefaultFramerate;
 int gDownsamplingQuality;
 size_t gCacheLimitMB;
+size_t gGPUCacheLimitMB;
+size_t gTilePoolLimitMB;
+size_t gMacroblockCacheLimitMB;
 bool gSmoothHistogram;
 bool gForceIioOpen;
+int gThreads;
+bool gGPUEdits;
+bool gLazyEdits;
+bool gAutoScalePlayback;
+bool gExactTextures;
 int gActive;
 int gShowView;
 bool gReloadImages;
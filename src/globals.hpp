@@ -40,8 +40,16 @@ extern bool gShowMiniview;
 extern float gDefaultFramerate;
 extern int gDownsamplingQuality;
 extern size_t gCacheLimitMB;
+extern size_t gGPUCacheLimitMB;
+extern size_t gTilePoolLimitMB;
+extern size_t gMacroblockCacheLimitMB;
 extern bool gSmoothHistogram;
 extern bool gForceIioOpen;
+extern int gThreads;
+extern bool gGPUEdits;
+extern bool gLazyEdits;
+extern bool gAutoScalePlayback;
+extern bool gExactTextures;
 
 extern int gActive;
 extern int gShowView;
@@ -29,6 +29,12 @@ void SetShaderCallback(const ImDrawList* parent_list, const ImDrawCmd* pcmd)
         userdata->shader->bind();
         userdata->shader->setParameter("scale", userdata->scale[0], userdata->scale[1], userdata->scale[2]);
         userdata->shader->setParameter("bias", userdata->bias[0], userdata->bias[1], userdata->bias[2]);
+        if (userdata->layers) {
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, userdata->layers);
+            glActiveTexture(GL_TEXTURE0);
+            userdata->shader->setParameter("bands", userdata->bands[0], userdata->bands[1], userdata->bands[2]);
+        }
         uint64_t time = 0;
         ::letTimeFlow(&time);
         userdata->shader->setParameter("time", time / 1e6f, 0, 0);
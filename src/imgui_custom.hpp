@@ -13,6 +13,9 @@ struct ShaderUserData {
     std::shared_ptr<Shader::Program> shader;
     std::array<float, 3> scale;
     std::array<float, 3> bias;
+    // texture array holding the bands of the image (see Texture::stream), and the bands to display (-1 when missing)
+    unsigned layers = 0;
+    std::array<float, 3> bands;
 };
 
 void SetShaderCallback(const ImDrawList* parent_list, const ImDrawCmd* pcmd);
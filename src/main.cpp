@@ -29,19 +29,23 @@
 #include "ImageCollection.hpp"
 #include "ImageProvider.hpp"
 #include "LoadingThread.hpp"
+#include "MacroblockCache.hpp"
+#include "MacroblockCollection.hpp"
 #include "Player.hpp"
 #include "SVG.hpp"
 #include "Sequence.hpp"
 #include "Shader.hpp"
 #include "Terminal.hpp"
+#include "Texture.hpp"
+#include "TextureCache.hpp"
 #include "View.hpp"
 #include "Window.hpp"
 #include "collection_expression.hpp"
 #include "config.hpp"
 #include "dragndrop.hpp"
+#include "editshaders.hpp"
 #include "events.hpp"
 #include "globals.hpp"
-#include "json.hpp"
 #include "layout.hpp"
 #include "menu.hpp"
 #include "shaders.hpp"
@@ -52,7 +56,8 @@
 
 static void help();
 
-static void parseMetadata(std::istream& jsonFile);
+// collections given on the command line, listed by the listingthread
+static std::vector<std::shared_ptr<ProgressiveImageCollection>> gListings;
 
 static void parseArgs(int argc, char** argv)
 {
@@ -209,7 +214,7 @@ static void parseArgs(int argc, char** argv)
 
         if (isanewsequence) {
             auto seq = newSequence(colormap, player, view);
-            std::shared_ptr<ImageCollection> col;
+            std::shared_ptr<ProgressiveImageCollection> col;
             if (isfromfile) {
                 const char* filename = &argv[i][9];
                 std::ifstream file(filename);
@@ -225,27 +230,30 @@ static void parseArgs(int argc, char** argv)
                 if (!fakeglob.empty()) {
                     *(fakeglob.end() - strlen(SEQUENCE_SEPARATOR)) = 0;
                 }
-                auto filenames = buildFilenamesFromExpression(fakeglob);
-                col = buildImageCollectionFromFilenames(filenames);
+                col = std::make_shared<ProgressiveImageCollection>(fakeglob);
             } else {
                 assert(isfile);
-                auto filenames = buildFilenamesFromExpression(argv[i]);
-                col = buildImageCollectionFromFilenames(filenames);
+                col = std::make_shared<ProgressiveImageCollection>(argv[i]);
             }
+            // the files are listed in the background, the sequence grows as they are found
+            gListings.push_back(col);
             seq->setImageCollection(col, argv[i]);
             window->sequences.push_back(seq);
             has_one_sequence = true;
         }
 
         if (ismetadata) {
-
-            const char* filename = &argv[i][9];
-            std::ifstream jsonFile(filename);
-            if (!jsonFile.is_open()) {
-                fprintf(stderr, "could not open json file '%s', skipped\n", filename);
+            if (gSequences.empty()) {
+                fprintf(stderr, "metadata '%s' given before any sequence, skipped\n", &argv[i][9]);
+                continue;
+            }
+            auto macroblocks = std::make_shared<MacroblockCollection>(&argv[i][9]);
+            if (macroblocks->empty()) {
+                fprintf(stderr, "no metadata file matches '%s', skipped\n", &argv[i][9]);
                 continue;
             }
-            parseMetadata(jsonFile);
+            // the macroblocks of each frame are loaded in the background
+            gSequences.back()->macroblockCollection = macroblocks;
         }
     }
 
@@ -265,55 +273,39 @@ static void parseArgs(int argc, char** argv)
     }
 }
 
-static void parseMetadata(std::istream& jsonFile)
+// uploads the first loaded frame which is not on the GPU yet among the next frames of the playing sequences
+static void prefetchTextures()
 {
-            nlohmann::json j;
-            jsonFile >> j;
-
-            if (!j.contains("macroblocks") || !j["macroblocks"].is_array()) {
-                throw std::runtime_error("JSON file is missing 'macroblocks' array.");
+    for (int i = 1; i <= 8; i++) {
+        for (const auto& seq : gSequences) {
+            if (!seq->player || !seq->player->playing || !seq->colormap || !seq->view)
+                continue;
+            std::shared_ptr<ImageCollection> collection = seq->collection;
+            if (!collection || collection->getLength() == 0)
+                continue;
+            int frame = (seq->player->frame + i - 1) % collection->getLength();
+            std::shared_ptr<Image> image = ImageCache::find(collection->getKey(frame));
+            int level = chooseTextureLevel(seq->view->zoom * seq->getViewRescaleFactor());
+            if (image && TextureCache::prefetch(image, seq->colormap->getPrecision(), level))
                 return;
-            }
-
-            std::vector<Macroblock> macroblocks;
-            for (const auto& block : j["macroblocks"]) {
-
-                auto pos = Pos(block.value("pos", std::array<unsigned int, 2>()));
-                std::vector<std::vector<std::tuple<int, int, int>>> motionVectors;
-
-                if (block.contains("motion_vectors")) {
-                    for (const auto& row : block["motion_vectors"]) {
-                        std::vector<std::tuple<int, int, int>> rowVectors;
-                        for (const auto& vec : row) {
-                            rowVectors.emplace_back(vec.at(0), vec.at(1), vec.at(2));
-                        }
-                        motionVectors.push_back(rowVectors);
-                    }
-                }
-                char block_type = block.value("type", "S").at(0);
-                unsigned int split = block.value("split", 0);
-
-                switch (block_type) {
-                case 'I':
-                    macroblocks.emplace_back(I, pos, split, block.value("modes", std::vector<std::vector<unsigned int>>()), block.value("sub_split", 0));
-                    break;
-                case 'P':
-                    macroblocks.emplace_back(P, pos, split, block.value("sub_split", 0), motionVectors);
-                    break;
-                case 'B':
-                    macroblocks.emplace_back(B, pos, split, motionVectors);
-                    break;
-                case 'S':
-                    macroblocks.emplace_back(S, pos, motionVectors.front().front());
-                    break;
-                default:
-                    macroblocks.emplace_back(I, pos, 0, std::vector<std::vector<unsigned int>>(), 0);
-                    break;
-                }
-            }
+        }
+    }
+}
 
-            const auto& seq = gSequences[gSequences.size() - 1];
-            seq->setMacroblocks(macroblocks);
+// the min/max pyramids of the displayed images, for the autoscale of their regions (see Image::getRangeInRegion)
+// only while a selection is shown or once the sequence adjusted a region, the other regions are scanned
+static std::shared_ptr<Progressable> getPyramidToBuild()
+{
+    for (const auto& seq : gSequences) {
+        std::shared_ptr<Image> image = seq->image;
+        if (!image || !(gSelectionShown || seq->regionAutoScaleUsed))
+            continue;
+        image->pyramid->request(image);
+        if (!image->pyramid->isLoaded()) {
+            return image->pyramid;
+        }
+    }
+    return nullptr;
 }
 
 #if defined(__MINGW32__) && defined(main) // SDL is doing weird things
@@ -470,8 +462,16 @@ int main(int argc, char* argv[])
     gDefaultFramerate = config::get_float("DEFAULT_FRAMERATE");
     gDownsamplingQuality = config::get_int("DOWNSAMPLING_QUALITY");
     gCacheLimitMB = config::get_lua()["toMB"](config::get_string("CACHE_LIMIT"));
+    gGPUCacheLimitMB = config::get_lua()["toMB"](config::get_string("GPU_CACHE_LIMIT"));
+    gTilePoolLimitMB = config::get_lua()["toMB"](config::get_string("TILE_POOL_LIMIT"));
+    gMacroblockCacheLimitMB = config::get_lua()["toMB"](config::get_string("MACROBLOCK_CACHE_LIMIT"));
     gSmoothHistogram = config::get_bool("SMOOTH_HISTOGRAM");
     gForceIioOpen = config::get_bool("FORCE_IIO_OPEN");
+    gThreads = config::get_int("THREADS");
+    gGPUEdits = config::get_bool("GPU_EDITS");
+    gLazyEdits = config::get_bool("LAZY_EDITS");
+    gAutoScalePlayback = config::get_bool("AUTOSCALE_PLAYBACK");
+    gExactTextures = config::get_bool("EXACT_TEXTURES");
 
     parseLayout(config::get_string("DEFAULT_LAYOUT"));
 
@@ -494,6 +494,16 @@ int main(int argc, char* argv[])
 
     relayout();
 
+    SleepyLoadingThread<Progressable> listingthread([]() -> std::shared_ptr<Progressable> {
+        for (const auto& listing : gListings) {
+            if (!listing->isLoaded()) {
+                return listing;
+            }
+        }
+        return nullptr;
+    });
+    listingthread.start();
+
     SleepyLoadingThread<Progressable> iothread([]() -> std::shared_ptr<Progressable> {
         // fill the queue with images to be displayed
         for (const auto& seq : gSequences) {
@@ -502,6 +512,13 @@ int main(int argc, char* argv[])
                 return provider;
             }
         }
+        // and their macroblocks, before any futur frame
+        for (const auto& seq : gSequences) {
+            std::shared_ptr<Progressable> provider = seq->macroblockprovider;
+            if (provider && !provider->isLoaded()) {
+                return provider;
+            }
+        }
 
         if (!ImageCache::isFull()) {
             // fill the queue with futur frames
@@ -522,13 +539,43 @@ int main(int argc, char* argv[])
                 }
             }
         }
+
+        if (!MacroblockCache::isFull()) {
+            // fill the queue with the macroblocks of the futur frames
+            for (int i = 1; i < 100; i++) {
+                for (const auto& seq : gSequences) {
+                    std::shared_ptr<MacroblockCollection> macroblocks = seq->macroblockCollection;
+                    std::shared_ptr<ImageCollection> collection = seq->collection;
+                    if (!seq->player || !macroblocks || !collection || collection->getLength() == 0)
+                        continue;
+                    int frame = (seq->player->frame + i - 1) % collection->getLength();
+                    std::shared_ptr<MacroblockProvider> provider = macroblocks->getProvider(frame);
+                    if (provider && !provider->isLoaded()) {
+                        return provider;
+                    }
+                }
+            }
+        }
         return nullptr;
     });
     iothread.start();
 
     LoadingThread computethread([]() -> std::shared_ptr<Progressable> {
+        // the new frames adjusted with quantiles wait for their histograms, even when they are hidden
+        for (const auto& seq : gSequences) {
+            std::shared_ptr<Image> image = seq->image;
+            std::shared_ptr<Progressable> provider = seq->getAutoScaleHistogram();
+            // the image may have changed in between
+            if (!image || !provider || (provider != image->histogram && provider != image->integralHistogram))
+                continue;
+            if (provider == image->integralHistogram)
+                image->integralHistogram->request(image);
+            if (!provider->isLoaded()) {
+                return provider;
+            }
+        }
         if (!gShowHistogram)
-            return nullptr;
+            return getPyramidToBuild();
         for (const auto& w : gWindows) {
             std::shared_ptr<Progressable> provider = w->histogram;
             if (provider && !provider->isLoaded()) {
@@ -543,7 +590,19 @@ int main(int argc, char* argv[])
                 return provider;
             }
         }
-        return nullptr;
+        // makes the histograms of the selection immediate
+        if (gSelectionShown) {
+            for (const auto& seq : gSequences) {
+                std::shared_ptr<Image> image = seq->image;
+                if (!image)
+                    continue;
+                image->integralHistogram->request(image);
+                if (!image->integralHistogram->isLoaded()) {
+                    return image->integralHistogram;
+                }
+            }
+        }
+        return getPyramidToBuild();
     });
     computethread.start();
 
@@ -600,6 +659,10 @@ int main(int argc, char* argv[])
         }
 
         watcher_check();
+        run_glsl_edits();
+        // the next frames are uploaded once the GPU is done with the displayed ones
+        if (!run_texture_uploads())
+            prefetchTextures();
 
         for (const auto& seq : gSequences) {
             std::shared_ptr<Progressable> provider = seq->imageprovider;
@@ -711,6 +774,7 @@ int main(int argc, char* argv[])
 
         if (isKeyPressed("F11")) {
             ImageCache::flush();
+            MacroblockCache::flush();
             SVG::flushCache();
         }
 
@@ -790,15 +854,20 @@ int main(int argc, char* argv[])
         }
     }
 
+    listingthread.stop();
     iothread.stop();
     computethread.stop();
 
     bool allow_brutal_exit = false;
+    auto future_listing = std::async(std::launch::async, [&listingthread] { listingthread.join(); });
     auto future_io = std::async(std::launch::async, [&iothread] { iothread.join(); });
     auto future_compute = std::async(std::launch::async, [&computethread] { computethread.join(); });
     auto future_terminal = std::async(std::launch::async, [] { gTerminal.stopAllAndJoin(); });
     // If the threads are not joinable within a short amount of time (for instance, if iio/gdal loads a big image),
     // we allow the programm to exit brutally.
+    if (future_listing.wait_for(std::chrono::milliseconds(50)) == std::future_status::timeout) {
+        allow_brutal_exit = true;
+    }
     if (future_io.wait_for(std::chrono::milliseconds(50)) == std::future_status::timeout) {
         allow_brutal_exit = true;
     }
@@ -811,6 +880,9 @@ int main(int argc, char* argv[])
 
     SVG::flushCache();
     ImageCache::flush();
+    MacroblockCache::flush();
+    TextureCache::flush();
+    release_texture_objects();
 
     ImGui_ImplSdlGL3_Shutdown();
     ImGui::DestroyContext();
@@ -868,6 +940,8 @@ static void help()
         B();
         T("alt+a: same as 'a' but with a saturation cut at 5%% by default");
         B();
+        T("Setting AUTOSCALE_PLAYBACK to true applies the last 'a' (or ctrl+a, alt+a) of a sequence again to each new frame, for example during the playback.");
+        B();
         T("mouse scroll: adjust the brightness");
         B();
         T("shift+mouse scroll: adjust the contrast");
@@ -937,7 +1011,9 @@ static void help()
     if (H("JPEG macroblocks")) {
         T("vpv can visualize JPEG macroblocks and their properties.");
         T("To enable the macroblock visualization, a json file according to the format specifications has to be passed using the metadata:<path> tag (for each image in each sequence).");
+        T("The metadata:<path> tag applies to the sequence given before it. The path can also be a collection of json files, one for each frame, or a single .jsonl file with the json of one frame per line. The macroblocks of each frame are loaded in the background and kept up to MACROBLOCK_CACHE_LIMIT.");
         T("The current implementation supports S, I, P and B blocks with their various subdivisions, motion vectors and I-frame modes.");
+        T("When zoomed out, the macroblocks are grouped in larger cells showing their most frequent type and their mean motion vector, and the subdivisions are shown only when they are large enough.");
         ImGui::Spacing();
         T("Shortcuts");
         B();
@@ -996,6 +1072,14 @@ static void help()
         static char text[] = "SCALE = 1"
                              "\nWATCH = false"
                              "\nCACHE_LIMIT = '2GB'"
+                             "\nGPU_CACHE_LIMIT = '512MB'"
+                             "\nTILE_POOL_LIMIT = '256MB'"
+                             "\nMACROBLOCK_CACHE_LIMIT = '256MB'"
+                             "\nTHREADS = 0"
+                             "\nGPU_EDITS = false"
+                             "\nLAZY_EDITS = true"
+                             "\nAUTOSCALE_PLAYBACK = false"
+                             "\nEXACT_TEXTURES = false"
                              "\nSCREENSHOT = 'screenshot_%d.png'"
                              "\nWINDOW_WIDTH = 1024"
                              "\nWINDOW_HEIGHT = 720"
@@ -1024,7 +1108,15 @@ static void help()
         B();
         T("Setting CACHE to 0 disables the caching of the images. This slows down vpv but also makes it use less RAM.");
         B();
+        T("GPU_CACHE_LIMIT is the video memory used to keep the recent frames on the GPU. During the playback, the next frames are uploaded in advance, so that short sequences play at the refresh rate.");
+        B();
+        T("TILE_POOL_LIMIT is the video memory kept by the texture tiles which are no longer used, so that the next textures of the same size are created without allocation. The usage of the pool is shown in the information window.");
+        B();
+        T("MACROBLOCK_CACHE_LIMIT is the memory used to keep the macroblocks of the recent frames (see JPEG macroblocks). During the playback, the macroblocks of the next frames are loaded in advance.");
+        B();
         T("SCALE allows to rescale vpv's interface (might be useful for high-density displays).");
+        B();
+        T("Setting EXACT_TEXTURES to true keeps the images in 32-bit floats on the GPU. Otherwise, the images decoded from 8 or 16-bit integers use normalized integer textures and the others use half floats when it does not change the displayed colors.");
         ImGui::Spacing();
         T("Shortcuts");
         B();
@@ -5,6 +5,37 @@
 extern "C" {
 #endif
 
+struct plambda_compiled;
+
+// the functions below return 0 on failure and set *error to a thread-local message
+// each call can be made on a different thread; plambda_run_rows can be called
+// concurrently on distinct rows if plambda_is_parallelizable returns 1
+// pd (the channel counts of the inputs) can be null, but then the program
+// is always evaluated pixel by pixel instead of by blocks of pixels
+struct plambda_compiled* plambda_compile(int n, int* pd, char* program, char** error);
+int plambda_output_dim(struct plambda_compiled* c, float** x, int* pd, char** error);
+int plambda_is_parallelizable(struct plambda_compiled* c);
+// returns whether the block evaluation is used (it is enabled by default when possible)
+int plambda_set_block_evaluation(struct plambda_compiled* c, int enable);
+int plambda_run_rows(struct plambda_compiled* c, float* out, int opd,
+    float** x, int* w, int* h, int* pd, int y0, int y1, char** error);
+// evaluates the program on a grid of ow columns starting at the pixel (x0, y0), with a spacing of step pixels
+// the rows j0..j1 of the grid are written to out, whose rows are ow pixels long
+int plambda_run_region(struct plambda_compiled* c, float* out, int opd,
+    float** x, int* w, int* h, int* pd, int x0, int y0, int step, int ow, int j0, int j1,
+    char** error);
+// writes a fragment shader evaluating the program at each pixel (see editshaders.cpp)
+// and returns the output dimension, or 0 if the program is not pointwise or does not fit in a vec4
+int plambda_to_glsl(struct plambda_compiled* c, int n, int* pd, char* buf, int size);
+// writes the program with its variables named after the inputs they are bound to (hidden00, hidden01...)
+// and its tokens separated by single spaces, so that equivalent programs have the same text
+// returns the number of tokens, one per compiled token, or 0 if the text does not fit
+int plambda_canonical_text(struct plambda_compiled* c, char* buf, int size);
+// writes the token counts of the proper prefixes of the program which leave a single value
+// on the stack, from the longest, and returns how many were found
+int plambda_prefixes(struct plambda_compiled* c, int* ends, int max);
+void plambda_free(struct plambda_compiled* c);
+
 float* execute_plambda(int n, float** x, int* w, int* h, int* pd,
     char* program, int* od, char** error);
 
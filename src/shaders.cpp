@@ -1,8 +1,11 @@
 #include <algorithm>
 #include <array>
 #include <map>
+#include <regex>
 #include <string>
 
+#include <doctest.h>
+
 #include "Shader.hpp"
 #include "globals.hpp"
 #include "shaders.hpp"
@@ -24,6 +27,22 @@ static const std::string defaultVertex = S(
         gl_Position = v_transform * vec4(v_position.xy, 0, 1);
     });
 
+// the tonemaps read the displayed bands with readBands, from the layers uploaded by Texture::stream
+// so that changing the bands does not upload the image again
+static const std::string bandsPrelude = R"(
+uniform sampler2DArray bandLayers;
+uniform vec3 bands;
+float readBand(vec2 uv, float b) {
+    if (b < 0.0)
+        return 0.0;
+    vec4 p = texture(bandLayers, vec3(uv, floor(b / 4.0)));
+    return p[int(mod(b, 4.0))];
+}
+vec4 readBands(vec2 uv) {
+    return vec4(readBand(uv, bands.x), readBand(uv, bands.y), readBand(uv, bands.z), 1.0);
+}
+)";
+
 std::shared_ptr<Shader::Program> createShader(const std::string& mainFragment, const std::string& name)
 {
     return std::make_shared<Shader::Program>(std::initializer_list<Shader::Shader> {
@@ -32,9 +51,17 @@ std::shared_ptr<Shader::Program> createShader(const std::string& mainFragment, c
         name);
 }
 
+// the shaders written before the layers read the displayed bands with texture(tex, uv),
+// nothing is bound to tex anymore so these calls are rewritten to readBands
+static std::string upgradeTonemap(const std::string& mainFragment)
+{
+    std::string upgraded = std::regex_replace(mainFragment, std::regex("uniform\\s+sampler2D\\s+tex\\s*;"), "");
+    return std::regex_replace(upgraded, std::regex("\\btexture\\s*\\(\\s*tex\\s*,\\s*"), "readBands(");
+}
+
 bool loadShader(const std::string& name, const std::string& mainFragment)
 {
-    auto shader = createShader(mainFragment, name);
+    auto shader = createShader(bandsPrelude + upgradeTonemap(mainFragment), name);
     gShaders.push_back(shader);
     std::sort(gShaders.begin(), gShaders.end(),
         [](const std::shared_ptr<Shader::Program> lhs, const std::shared_ptr<Shader::Program> rhs) {
@@ -51,3 +78,12 @@ std::shared_ptr<Shader::Program> getShader(const std::string& name)
     }
     return nullptr;
 }
+
+TEST_CASE("upgradeTonemap")
+{
+    std::string old = "uniform sampler2D tex;\nvoid main() {\n    vec4 p = texture( tex, f_texcoord.st);\n    vec4 q = texture(other, f_texcoord.st);\n}";
+    CHECK(upgradeTonemap(old) == "\nvoid main() {\n    vec4 p = readBands(f_texcoord.st);\n    vec4 q = texture(other, f_texcoord.st);\n}");
+    // the names which only start with tex are kept
+    std::string other = "uniform sampler2D texture2;\nvec4 p = texture(texture2, uv);";
+    CHECK(upgradeTonemap(other) == other);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+#include "Image.hpp"
+#include "xmalloc.hpp"
+
+// a w x h x c image for the tests, value(i) gives the sample i in the order of the pixels
+// the special values are set by value too, so that the range of the image skips them
+template <typename F>
+std::shared_ptr<Image> makeTestImage(size_t w, size_t h, size_t c, F value)
+{
+    float* pixels = (float*)xmalloc(sizeof(float) * w * h * c);
+    for (size_t i = 0; i < w * h * c; i++)
+        pixels[i] = value(i);
+    return std::make_shared<Image>(pixels, w, h, c);
+}
@@ -30,13 +30,882 @@ static void fail(const char* fmt, ...)
 #define HIDE_ALL_MAINS
 #include "plambda.c"
 
-float* execute_plambda(int n, float** x, int* w, int* h, int* pd,
-    char* program, int* opd, char** error)
+// block evaluation {{{1
+// the scalar interpreter (run_program_vectorially_at) goes through the whole program for each pixel
+// for programs whose vector dimensions are known in advance, each instruction is instead applied to
+// PLAMBDA_BLOCK consecutive pixels of a row at once, with one array of lanes per component,
+// so that the dispatch is paid once per block and the arithmetic loops can be vectorized
+
+#define PLAMBDA_BLOCK 256
+#define PLAMBDA_REGISTERS 10
+
+enum block_op {
+    BLOCK_GENERIC,
+    BLOCK_ADD,
+    BLOCK_SUB,
+    BLOCK_MUL,
+    BLOCK_DIV,
+    BLOCK_GT,
+    BLOCK_LT,
+    BLOCK_EQ,
+    BLOCK_GE,
+    BLOCK_LE,
+    BLOCK_NE,
+    BLOCK_FABS,
+    BLOCK_SQRT,
+    BLOCK_FMIN,
+    BLOCK_FMAX,
+    BLOCK_IF,
+};
+
+struct plambda_compiled {
+    struct plambda_program p[1];
+    int block; // whether the block evaluation is used
+    int blockable; // whether the block evaluation is possible
+    int maxdepth;
+    int maxdim;
+    int opd;
+    unsigned char ops[PLAMBDA_MAX_TOKENS];
+    char* source; // with the hidden variables, one token per compiled token
+};
+
+static enum block_op block_op_of(struct predefined_function* f)
+{
+    // these give the same results in float as the double functions rounded to float
+    void (*ff)(void) = f->f;
+    if (ff == (void (*)(void))sum_two_doubles) return BLOCK_ADD;
+    if (ff == (void (*)(void))substract_two_doubles) return BLOCK_SUB;
+    if (ff == (void (*)(void))multiply_two_doubles) return BLOCK_MUL;
+    if (ff == (void (*)(void))divide_two_doubles) return BLOCK_DIV;
+    if (ff == (void (*)(void))logic_g) return BLOCK_GT;
+    if (ff == (void (*)(void))logic_l) return BLOCK_LT;
+    if (ff == (void (*)(void))logic_e) return BLOCK_EQ;
+    if (ff == (void (*)(void))logic_ge) return BLOCK_GE;
+    if (ff == (void (*)(void))logic_le) return BLOCK_LE;
+    if (ff == (void (*)(void))logic_ne) return BLOCK_NE;
+    if (ff == (void (*)(void))fabs) return BLOCK_FABS;
+    if (ff == (void (*)(void))sqrt) return BLOCK_SQRT;
+    if (ff == (void (*)(void))fmin) return BLOCK_FMIN;
+    if (ff == (void (*)(void))fmax) return BLOCK_FMAX;
+    if (ff == (void (*)(void))logic_if) return BLOCK_IF;
+    return BLOCK_GENERIC;
+}
+
+// infers the dimension of each value of the stack, returns 0 if the program
+// cannot be evaluated by blocks (magic variables, vector functions, some stack operators...)
+static int block_plan(struct plambda_compiled* c, int n, int* pd)
+{
+    struct plambda_program* p = c->p;
+    int d[PLAMBDA_MAX_TOKENS];
+    int regd[PLAMBDA_REGISTERS] = { 0 };
+    int sn = 0;
+
+    c->maxdepth = 0;
+    c->maxdim = 1;
+    for (int i = 0; i < p->n; i++) {
+        struct plambda_token* t = p->t + i;
+        c->ops[i] = BLOCK_GENERIC;
+        switch (t->type) {
+        case PLAMBDA_CONSTANT:
+            d[sn++] = 1;
+            break;
+        case PLAMBDA_SCALAR:
+            if (t->index < 0 || t->index >= n)
+                return 0;
+            d[sn++] = 1;
+            break;
+        case PLAMBDA_VECTOR:
+            if (t->index < 0 || t->index >= n)
+                return 0;
+            if (t->component == -1)
+                d[sn++] = pd[t->index];
+            else if ((t->component == -2 || t->component == -3) && pd[t->index] % 2 == 0)
+                d[sn++] = pd[t->index] / 2;
+            else
+                return 0;
+            break;
+        case PLAMBDA_IMAGEOP:
+            // evaluated pixel by pixel (by imageop), but the rest of the program is still done by blocks
+            if (t->index < 0 || t->index >= n)
+                return 0;
+            if (t->imageop_operator > 1000 && t->imageop_operator < 2000)
+                return 0;
+            d[sn++] = t->component < 0 ? pd[t->index] : 1;
+            break;
+        case PLAMBDA_COLONVAR:
+            if (!strchr("ijwhnxyrtIJPQLRWHX", t->colonvar))
+                return 0;
+            d[sn++] = t->colonvar == 'X' ? 2 : 1;
+            break;
+        case PLAMBDA_OPERATOR: {
+            struct predefined_function* f = global_table_of_predefined_functions + t->index;
+            if (f->nargs == 0) {
+                d[sn++] = 1;
+                break;
+            }
+            if (f->nargs < 1 || f->nargs > 3 || sn < f->nargs)
+                return 0;
+            int rd = 1;
+            for (int k = 0; k < f->nargs; k++) {
+                int dk = d[--sn];
+                if (dk > 1) {
+                    if (rd > 1 && dk != rd)
+                        return 0;
+                    rd = dk;
+                }
+            }
+            d[sn++] = rd;
+            c->ops[i] = block_op_of(f);
+        } break;
+        case PLAMBDA_STACKOP:
+            switch (t->index) {
+            case PLAMBDA_STACKOP_DEL:
+                if (sn < 1)
+                    return 0;
+                sn--;
+                break;
+            case PLAMBDA_STACKOP_DUP:
+                if (sn < 1)
+                    return 0;
+                d[sn] = d[sn - 1];
+                sn++;
+                break;
+            case PLAMBDA_STACKOP_ROT: {
+                if (sn < 2)
+                    return 0;
+                int tmp = d[sn - 1];
+                d[sn - 1] = d[sn - 2];
+                d[sn - 2] = tmp;
+            } break;
+            case PLAMBDA_STACKOP_VSPLIT: {
+                if (sn < 1)
+                    return 0;
+                int dk = d[--sn];
+                for (int k = 0; k < dk && sn < PLAMBDA_MAX_TOKENS - 1; k++)
+                    d[sn++] = 1;
+            } break;
+            case PLAMBDA_STACKOP_VMERGE:
+                if (sn < 2 || d[sn - 2] + d[sn - 1] >= PLAMBDA_MAX_PIXELDIM)
+                    return 0;
+                d[sn - 2] += d[sn - 1];
+                sn--;
+                break;
+            case PLAMBDA_STACKOP_VMERGE3:
+                if (sn < 3 || d[sn - 3] + d[sn - 2] + d[sn - 1] >= PLAMBDA_MAX_PIXELDIM)
+                    return 0;
+                d[sn - 3] += d[sn - 2] + d[sn - 1];
+                sn -= 2;
+                break;
+            default:
+                return 0;
+            }
+            break;
+        case PLAMBDA_VARDEF: {
+            int r = abs(t->index);
+            if (r >= PLAMBDA_REGISTERS)
+                return 0;
+            if (t->index > 0) {
+                if (sn < 1)
+                    return 0;
+                regd[r] = d[--sn];
+            } else {
+                if (!regd[r])
+                    return 0;
+                d[sn++] = regd[r];
+            }
+        } break;
+        default:
+            return 0;
+        }
+        if (sn >= PLAMBDA_MAX_TOKENS - 1)
+            return 0;
+        if (sn > c->maxdepth)
+            c->maxdepth = sn;
+        if (sn > 0 && d[sn - 1] > c->maxdim)
+            c->maxdim = d[sn - 1];
+    }
+    if (sn < 1)
+        return 0;
+    c->opd = d[sn - 1];
+    return 1;
+}
+
+struct block_value {
+    float* v; // component k of lane l is v[k * PLAMBDA_BLOCK + l]
+    int d;
+};
+
+struct block_state {
+    struct block_value stack[PLAMBDA_MAX_TOKENS];
+    int n;
+    struct block_value reg[PLAMBDA_REGISTERS];
+    float** free;
+    int nfree;
+};
+
+static float* block_alloc(struct block_state* s)
+{
+    assert(s->nfree > 0);
+    return s->free[--s->nfree];
+}
+
+static void block_release(struct block_state* s, float* v)
+{
+    s->free[s->nfree++] = v;
+}
+
+static struct block_value* block_push(struct block_state* s, int d)
+{
+    struct block_value* r = s->stack + s->n++;
+    r->v = block_alloc(s);
+    r->d = d;
+    return r;
+}
+
+static void block_copy(float* dst, const struct block_value* src, int len)
+{
+    for (int k = 0; k < src->d; k++)
+        memcpy(dst + k * PLAMBDA_BLOCK, src->v + k * PLAMBDA_BLOCK, len * sizeof(float));
+}
+
+// the lanes of a block are the pixels i0, i0 + step, ... of the row j
+static void block_sample(float* out, float* img, int w, int h, int pd, int cmp,
+    int i0, int j, int len, int step)
+{
+    if (j >= 0 && j < h && i0 >= 0 && i0 + (len - 1) * step < w && cmp >= 0 && cmp < pd) {
+        const float* in = img + ((size_t)j * w + i0) * pd + cmp;
+        for (int l = 0; l < len; l++)
+            out[l] = in[(size_t)l * step * pd];
+    } else {
+        for (int l = 0; l < len; l++)
+            out[l] = getsample_cfg(img, w, h, pd, i0 + l * step, j, cmp);
+    }
+}
+
+#define BLOCK_LOOP(expr)                                       \
+    for (int k = 0; k < rd; k++) {                              \
+        float* o = r + k * PLAMBDA_BLOCK;                       \
+        const float* a = A->v + (A->d > 1 ? k * PLAMBDA_BLOCK : 0); \
+        const float* b = B->v + (B->d > 1 ? k * PLAMBDA_BLOCK : 0); \
+        (void)a;                                                \
+        (void)b;                                                \
+        for (int l = 0; l < len; l++)                           \
+            o[l] = (expr);                                      \
+    }
+
+static void block_apply(struct block_state* s, struct predefined_function* f,
+    int op, int len)
+{
+    if (f->nargs == 0) {
+        float* o = block_push(s, 1)->v;
+        for (int l = 0; l < len; l++)
+            o[l] = f->value;
+        return;
+    }
+
+    // same argument order as apply_function: the top of the stack is the last argument
+    struct block_value args[3];
+    int rd = 1;
+    for (int k = f->nargs - 1; k >= 0; k--) {
+        args[k] = s->stack[--s->n];
+        if (args[k].d > rd)
+            rd = args[k].d;
+    }
+    float* r = block_alloc(s);
+    struct block_value* A = args;
+    struct block_value* B = args + (f->nargs > 1);
+
+    switch (op) {
+    case BLOCK_ADD: BLOCK_LOOP(a[l] + b[l]) break;
+    case BLOCK_SUB: BLOCK_LOOP(a[l] - b[l]) break;
+    case BLOCK_MUL: BLOCK_LOOP(a[l] * b[l]) break;
+    case BLOCK_DIV: BLOCK_LOOP(a[l] / b[l]) break;
+    case BLOCK_GT: BLOCK_LOOP(a[l] > b[l]) break;
+    case BLOCK_LT: BLOCK_LOOP(a[l] < b[l]) break;
+    case BLOCK_EQ: BLOCK_LOOP(a[l] == b[l]) break;
+    case BLOCK_GE: BLOCK_LOOP(a[l] >= b[l]) break;
+    case BLOCK_LE: BLOCK_LOOP(a[l] <= b[l]) break;
+    case BLOCK_NE: BLOCK_LOOP(a[l] != b[l]) break;
+    case BLOCK_FABS: BLOCK_LOOP(fabsf(a[l])) break;
+    case BLOCK_SQRT: BLOCK_LOOP(sqrtf(a[l])) break;
+    case BLOCK_FMIN: BLOCK_LOOP(fminf(a[l], b[l])) break;
+    case BLOCK_FMAX: BLOCK_LOOP(fmaxf(a[l], b[l])) break;
+    default:
+        for (int k = 0; k < rd; k++) {
+            float* o = r + k * PLAMBDA_BLOCK;
+            const float* v[3];
+            for (int m = 0; m < f->nargs; m++)
+                v[m] = args[m].v + (args[m].d > 1 ? k * PLAMBDA_BLOCK : 0);
+            if (op == BLOCK_IF) {
+                for (int l = 0; l < len; l++)
+                    o[l] = v[0][l] ? v[1][l] : v[2][l];
+            } else if (f->nargs == 1) {
+                double (*g)(double) = (double (*)(double))f->f;
+                for (int l = 0; l < len; l++)
+                    o[l] = g(v[0][l]);
+            } else if (f->nargs == 2) {
+                double (*g)(double, double) = (double (*)(double, double))f->f;
+                for (int l = 0; l < len; l++)
+                    o[l] = g(v[0][l], v[1][l]);
+            } else {
+                double (*g)(double, double, double) = (double (*)(double, double, double))f->f;
+                for (int l = 0; l < len; l++)
+                    o[l] = g(v[0][l], v[1][l], v[2][l]);
+            }
+        }
+        break;
+    }
+
+    for (int k = 0; k < f->nargs; k++)
+        block_release(s, args[k].v);
+    s->stack[s->n].v = r;
+    s->stack[s->n].d = rd;
+    s->n++;
+}
+
+static void run_program_by_blocks(struct plambda_compiled* c, struct block_state* s,
+    float* out, float** val, int* w, int* h, int* pd, int i0, int j, int len, int step)
 {
-    struct plambda_program* p = malloc(sizeof(*p));
+    struct plambda_program* p = c->p;
+    s->n = 0;
+    for (int i = 0; i < p->n; i++) {
+        struct plambda_token* t = p->t + i;
+        switch (t->type) {
+        case PLAMBDA_CONSTANT: {
+            float* o = block_push(s, 1)->v;
+            for (int l = 0; l < len; l++)
+                o[l] = t->value;
+        } break;
+        case PLAMBDA_SCALAR: {
+            int k = t->index;
+            float* o = block_push(s, 1)->v;
+            block_sample(o, val[k], w[k], h[k], pd[k], t->component,
+                i0 + t->displacement[0], j + t->displacement[1], len, step);
+        } break;
+        case PLAMBDA_VECTOR: {
+            int k = t->index;
+            int d = t->component == -1 ? pd[k] : pd[k] / 2;
+            int first = t->component == -3 ? pd[k] / 2 : 0;
+            float* o = block_push(s, d)->v;
+            for (int m = 0; m < d; m++)
+                block_sample(o + m * PLAMBDA_BLOCK, val[k], w[k], h[k], pd[k], first + m,
+                    i0 + t->displacement[0], j + t->displacement[1], len, step);
+        } break;
+        case PLAMBDA_IMAGEOP: {
+            int k = t->index;
+            int d = t->component < 0 ? pd[k] : 1;
+            float* o = block_push(s, d)->v;
+            for (int l = 0; l < len; l++) {
+                float lout[PLAMBDA_MAX_PIXELDIM];
+                imageop(lout, val[k], w[k], h[k], pd[k], i0 + l * step, j, t);
+                for (int m = 0; m < d; m++)
+                    o[m * PLAMBDA_BLOCK + l] = lout[m];
+            }
+        } break;
+        case PLAMBDA_COLONVAR: {
+            if (t->colonvar == 'X') {
+                float* o = block_push(s, 2)->v;
+                for (int l = 0; l < len; l++) {
+                    o[l] = i0 + l * step;
+                    o[PLAMBDA_BLOCK + l] = j;
+                }
+            } else {
+                float* o = block_push(s, 1)->v;
+                for (int l = 0; l < len; l++)
+                    o[l] = eval_colonvar(*w, *h, i0 + l * step, j, t->colonvar);
+            }
+        } break;
+        case PLAMBDA_OPERATOR:
+            block_apply(s, global_table_of_predefined_functions + t->index, c->ops[i], len);
+            break;
+        case PLAMBDA_STACKOP:
+            switch (t->index) {
+            case PLAMBDA_STACKOP_DEL:
+                block_release(s, s->stack[--s->n].v);
+                break;
+            case PLAMBDA_STACKOP_DUP: {
+                struct block_value* top = s->stack + s->n - 1;
+                block_copy(block_push(s, top->d)->v, top, len);
+            } break;
+            case PLAMBDA_STACKOP_ROT: {
+                struct block_value tmp = s->stack[s->n - 1];
+                s->stack[s->n - 1] = s->stack[s->n - 2];
+                s->stack[s->n - 2] = tmp;
+            } break;
+            case PLAMBDA_STACKOP_VSPLIT: {
+                struct block_value x = s->stack[--s->n];
+                for (int k = 0; k < x.d; k++)
+                    memcpy(block_push(s, 1)->v, x.v + k * PLAMBDA_BLOCK, len * sizeof(float));
+                block_release(s, x.v);
+            } break;
+            case PLAMBDA_STACKOP_VMERGE:
+            case PLAMBDA_STACKOP_VMERGE3: {
+                int m = t->index == PLAMBDA_STACKOP_VMERGE ? 2 : 3;
+                struct block_value* x = s->stack + s->n - m;
+                int d = 0;
+                for (int k = 0; k < m; k++)
+                    d += x[k].d;
+                float* r = block_alloc(s);
+                for (int k = 0, o = 0; k < m; o += x[k].d, k++) {
+                    block_copy(r + o * PLAMBDA_BLOCK, x + k, len);
+                    block_release(s, x[k].v);
+                }
+                s->n -= m;
+                s->stack[s->n].v = r;
+                s->stack[s->n].d = d;
+                s->n++;
+            } break;
+            }
+            break;
+        case PLAMBDA_VARDEF: {
+            int r = abs(t->index);
+            if (t->index > 0) {
+                if (s->reg[r].v)
+                    block_release(s, s->reg[r].v);
+                s->reg[r] = s->stack[--s->n];
+            } else {
+                block_copy(block_push(s, s->reg[r].d)->v, s->reg + r, len);
+            }
+        } break;
+        }
+    }
+
+    struct block_value* r = s->stack + s->n - 1;
+    for (int k = 0; k < r->d; k++)
+        for (int l = 0; l < len; l++)
+            out[l * r->d + k] = r->v[k * PLAMBDA_BLOCK + l];
+    while (s->n)
+        block_release(s, s->stack[--s->n].v);
+}
+
+// evaluates the rows j0..j1 of a region of ow columns, whose pixel (i, j) is the pixel
+// (x0 + i * step, y0 + j * step) of the image, the output rows are ow pixels long
+static void run_region_by_blocks(struct plambda_compiled* c, float* out,
+    float** x, int* w, int* h, int* pd, int x0, int y0, int step, int ow, int j0, int j1)
+{
+    // one buffer per stack value and per register, plus one for the result of an operator
+    int nbuffers = c->maxdepth + PLAMBDA_REGISTERS + 1;
+    size_t bufsize = (size_t)c->maxdim * PLAMBDA_BLOCK;
+    float* memory = xmalloc(nbuffers * bufsize * sizeof(float));
+    float* buffers[nbuffers];
+    struct block_state* s = xmalloc(sizeof(*s));
+    for (int k = 0; k < nbuffers; k++)
+        buffers[k] = memory + k * bufsize;
+    s->free = buffers;
+    s->nfree = nbuffers;
+    for (int k = 0; k < PLAMBDA_REGISTERS; k++)
+        s->reg[k].v = 0;
+
+    for (int j = j0; j < j1; j++) {
+        for (int i = 0; i < ow; i += PLAMBDA_BLOCK) {
+            int len = ow - i < PLAMBDA_BLOCK ? ow - i : PLAMBDA_BLOCK;
+            float* o = out + ((size_t)j * ow + i) * c->opd;
+            run_program_by_blocks(c, s, o, x, w, h, pd, x0 + i * step, y0 + j * step, len, step);
+        }
+    }
+
+    free(s);
+    free(memory);
+}
+
+// GLSL translation {{{1
+// pointwise programs can be evaluated by a fragment shader, which fetches the inputs
+// at the current fragment (see editshaders.cpp)
+// each value of the stack becomes a GLSL variable, so the dimensions are limited to 4
+
+struct glsl_value {
+    char name[16];
+    int d;
+};
+
+struct glsl_writer {
+    char* buf;
+    int size;
+    int len;
+};
+
+static void glsl_printf(struct glsl_writer* w, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static void glsl_printf(struct glsl_writer* w, const char* fmt, ...)
+{
+    va_list argp;
+    va_start(argp, fmt);
+    int r = w->len < w->size ? vsnprintf(w->buf + w->len, w->size - w->len, fmt, argp)
+                             : vsnprintf(NULL, 0, fmt, argp);
+    va_end(argp);
+    w->len += r;
+}
+
+static const char* glsl_type(int d)
+{
+    static const char* types[] = { "", "float", "vec2", "vec3", "vec4" };
+    return types[d];
+}
+
+// writes the value x converted to dimension d (broadcasting a scalar)
+static void glsl_arg(struct glsl_writer* w, const struct glsl_value* x, int d)
+{
+    if (x->d == d)
+        glsl_printf(w, "%s", x->name);
+    else
+        glsl_printf(w, "%s(%s)", glsl_type(d), x->name);
+}
+
+// writes the component k of x (or x itself if it is a scalar)
+static void glsl_component(struct glsl_writer* w, const struct glsl_value* x, int k)
+{
+    if (x->d == 1)
+        glsl_printf(w, "%s", x->name);
+    else
+        glsl_printf(w, "%s.%c", x->name, "xyzw"[k]);
+}
+
+static void glsl_float(struct glsl_writer* w, double v)
+{
+    if (isnan(v))
+        glsl_printf(w, "uintBitsToFloat(0x7fc00000u)");
+    else if (isinf(v))
+        glsl_printf(w, "uintBitsToFloat(%s)", v > 0 ? "0x7f800000u" : "0xff800000u");
+    else
+        glsl_printf(w, "%.9e", (float)v);
+}
+
+static const char* glsl_builtin(const char* name, int nargs)
+{
+    static const char* unary[][2] = {
+        { "fabs", "abs" }, { "sqrt", "sqrt" }, { "floor", "floor" }, { "ceil", "ceil" },
+        { "trunc", "trunc" }, { "rint", "roundEven" }, { "nearbyint", "roundEven" },
+        { "exp", "exp" }, { "exp2", "exp2" }, { "log", "log" }, { "log2", "log2" },
+        { "sin", "sin" }, { "cos", "cos" }, { "tan", "tan" },
+        { "asin", "asin" }, { "acos", "acos" }, { "atan", "atan" },
+        { "sinh", "sinh" }, { "cosh", "cosh" }, { "tanh", "tanh" },
+        { "asinh", "asinh" }, { "acosh", "acosh" }, { "atanh", "atanh" },
+    };
+    static const char* binary[][2] = {
+        { "fmin", "min" }, { "fmax", "max" }, { "atan2", "atan" },
+        { "pow", "plambda_pow" }, { "^", "plambda_pow" }, { "hypot", "plambda_hypot" },
+    };
+    if (nargs == 1) {
+        for (int i = 0; i < (int)(sizeof unary / sizeof *unary); i++)
+            if (!strcmp(name, unary[i][0]))
+                return unary[i][1];
+    } else if (nargs == 2) {
+        for (int i = 0; i < (int)(sizeof binary / sizeof *binary); i++)
+            if (!strcmp(name, binary[i][0]))
+                return binary[i][1];
+    }
+    return 0;
+}
+
+static const char* glsl_comparison(const char* name, const char** vecfunc)
+{
+    static const char* comparisons[][3] = {
+        { ">", ">", "greaterThan" }, { "<", "<", "lessThan" }, { "=", "==", "equal" },
+        { ">=", ">=", "greaterThanEqual" }, { "<=", "<=", "lessThanEqual" }, { "!=", "!=", "notEqual" },
+    };
+    for (int i = 0; i < (int)(sizeof comparisons / sizeof *comparisons); i++) {
+        if (!strcmp(name, comparisons[i][0])) {
+            *vecfunc = comparisons[i][2];
+            return comparisons[i][1];
+        }
+    }
+    return 0;
+}
+
+// writes the expression of an operator applied to args (the last one being the top of the stack)
+// the result has dimension rd, returns 0 if the operator has no GLSL equivalent
+static int glsl_operator(struct glsl_writer* w, struct predefined_function* f,
+    struct glsl_value* args, int rd)
+{
+    const char* name = f->name;
+    const char* vecfunc;
+    const char* builtin;
+    const char* op;
+    if (f->nargs == 0) {
+        glsl_float(w, f->value);
+    } else if (f->nargs == 2 && strlen(name) == 1 && strchr("+-*/", *name)) {
+        glsl_printf(w, "%s %s %s", args[0].name, name, args[1].name);
+    } else if (f->nargs == 2 && (op = glsl_comparison(name, &vecfunc))) {
+        if (rd == 1) {
+            glsl_printf(w, "float(%s %s %s)", args[0].name, op, args[1].name);
+        } else {
+            glsl_printf(w, "%s(%s(", glsl_type(rd), vecfunc);
+            glsl_arg(w, args, rd);
+            glsl_printf(w, ", ");
+            glsl_arg(w, args + 1, rd);
+            glsl_printf(w, "))");
+        }
+    } else if (f->nargs == 3 && !strcmp(name, "if")) {
+        if (rd == 1) {
+            glsl_printf(w, "%s != 0.0 ? %s : %s", args[0].name, args[1].name, args[2].name);
+        } else {
+            glsl_printf(w, "mix(");
+            glsl_arg(w, args + 2, rd);
+            glsl_printf(w, ", ");
+            glsl_arg(w, args + 1, rd);
+            glsl_printf(w, ", notEqual(");
+            glsl_arg(w, args, rd);
+            glsl_printf(w, ", %s(0.0)))", glsl_type(rd));
+        }
+    } else if ((builtin = glsl_builtin(name, f->nargs))) {
+        if (strncmp(builtin, "plambda_", 8) || rd == 1) {
+            glsl_printf(w, "%s(", builtin);
+            for (int k = 0; k < f->nargs; k++) {
+                glsl_printf(w, k ? ", " : "");
+                glsl_arg(w, args + k, rd);
+            }
+            glsl_printf(w, ")");
+        } else {
+            // the helpers are only defined for scalars
+            glsl_printf(w, "%s(", glsl_type(rd));
+            for (int c = 0; c < rd; c++) {
+                glsl_printf(w, "%s%s(", c ? ", " : "", builtin);
+                for (int k = 0; k < f->nargs; k++) {
+                    glsl_printf(w, k ? ", " : "");
+                    glsl_component(w, args + k, c);
+                }
+                glsl_printf(w, ")");
+            }
+            glsl_printf(w, ")");
+        }
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static const char* glsl_colonvar(int c)
+{
+    switch (c) {
+    case 'i': return "p.x";
+    case 'j': return "p.y";
+    case 'w': return "size.x";
+    case 'h': return "size.y";
+    case 'n': return "size.x * size.y";
+    case 'x': return "(2.0 / (size.x - 1.0)) * p.x - 1.0";
+    case 'y': return "(2.0 / (size.y - 1.0)) * p.y - 1.0";
+    default: return 0;
+    }
+}
+
+static const char* glsl_prelude = "uniform vec3 origin;\n"
+                                  "uniform vec3 size;\n"
+                                  "out vec4 out_color;\n"
+                                  "float plambda_pow(float a, float b)\n"
+                                  "{\n"
+                                  "    if (b == 0.0) return 1.0;\n"
+                                  "    if (a == 0.0) return b > 0.0 ? 0.0 : uintBitsToFloat(0x7f800000u);\n"
+                                  "    float r = pow(abs(a), b);\n"
+                                  "    if (a > 0.0) return r;\n"
+                                  "    if (b != floor(b)) return uintBitsToFloat(0x7fc00000u);\n"
+                                  "    return mod(b, 2.0) == 0.0 ? r : -r;\n"
+                                  "}\n"
+                                  "float plambda_hypot(float a, float b)\n"
+                                  "{\n"
+                                  "    return length(vec2(a, b));\n"
+                                  "}\n";
+
+static int glsl_translate(struct plambda_compiled* c, int n, int* pd, struct glsl_writer* w)
+{
+    struct plambda_program* p = c->p;
+    struct glsl_value s[PLAMBDA_MAX_TOKENS];
+    struct glsl_value reg[PLAMBDA_REGISTERS];
+    int sn = 0;
+    int nv = 0;
+
+    if (!c->blockable || c->maxdim > 4)
+        return 0;
+    for (int k = 0; k < n; k++)
+        if (pd[k] < 1 || pd[k] > 4)
+            return 0;
+
+    glsl_printf(w, "%s", glsl_prelude);
+    for (int k = 0; k < n; k++)
+        glsl_printf(w, "uniform sampler2D x%d;\n", k);
+    glsl_printf(w, "void main()\n{\n");
+    glsl_printf(w, "    ivec2 q = ivec2(gl_FragCoord.xy);\n");
+    glsl_printf(w, "    vec2 p = vec2(q) + origin.xy;\n");
+    for (int k = 0; k < n; k++)
+        glsl_printf(w, "    vec4 in%d = texelFetch(x%d, q, 0);\n", k, k);
+
+    for (int i = 0; i < p->n; i++) {
+        struct plambda_token* t = p->t + i;
+        struct glsl_value* v = s + sn;
+        snprintf(v->name, sizeof v->name, "v%d", nv);
+        switch (t->type) {
+        case PLAMBDA_CONSTANT:
+            v->d = 1;
+            glsl_printf(w, "    float %s = ", v->name);
+            glsl_float(w, t->value);
+            glsl_printf(w, ";\n");
+            break;
+        case PLAMBDA_SCALAR:
+        case PLAMBDA_VECTOR: {
+            // only the current pixel is available in the fragment shader
+            int k = t->index;
+            if (t->displacement[0] || t->displacement[1])
+                return 0;
+            int first = 0;
+            if (t->type == PLAMBDA_SCALAR) {
+                if (t->component < 0 || t->component >= pd[k])
+                    return 0;
+                first = t->component;
+                v->d = 1;
+            } else if (t->component == -1) {
+                v->d = pd[k];
+            } else {
+                v->d = pd[k] / 2;
+                first = t->component == -3 ? v->d : 0;
+            }
+            glsl_printf(w, "    %s %s = in%d.%.*s;\n", glsl_type(v->d), v->name, k, v->d, "xyzw" + first);
+        } break;
+        case PLAMBDA_COLONVAR: {
+            const char* e = glsl_colonvar(t->colonvar);
+            if (!e)
+                return 0;
+            v->d = 1;
+            glsl_printf(w, "    float %s = %s;\n", v->name, e);
+        } break;
+        case PLAMBDA_OPERATOR: {
+            struct predefined_function* f = global_table_of_predefined_functions + t->index;
+            struct glsl_value args[3];
+            int rd = 1;
+            for (int k = f->nargs - 1; k >= 0; k--) {
+                args[k] = s[--sn];
+                if (args[k].d > rd)
+                    rd = args[k].d;
+            }
+            v = s + sn;
+            snprintf(v->name, sizeof v->name, "v%d", nv);
+            v->d = rd;
+            glsl_printf(w, "    %s %s = ", glsl_type(rd), v->name);
+            if (!glsl_operator(w, f, args, rd))
+                return 0;
+            glsl_printf(w, ";\n");
+        } break;
+        case PLAMBDA_STACKOP:
+            // stack operators only rename values
+            switch (t->index) {
+            case PLAMBDA_STACKOP_DEL:
+                sn--;
+                break;
+            case PLAMBDA_STACKOP_DUP:
+                s[sn] = s[sn - 1];
+                sn++;
+                break;
+            case PLAMBDA_STACKOP_ROT: {
+                struct glsl_value tmp = s[sn - 1];
+                s[sn - 1] = s[sn - 2];
+                s[sn - 2] = tmp;
+            } break;
+            case PLAMBDA_STACKOP_VSPLIT: {
+                struct glsl_value x = s[--sn];
+                for (int k = 0; k < x.d; k++) {
+                    s[sn] = x;
+                    if (x.d > 1) {
+                        // the components of a vector are named v<n>.x, v<n>.y, ...
+                        size_t l = strlen(x.name);
+                        s[sn].name[l] = '.';
+                        s[sn].name[l + 1] = "xyzw"[k];
+                        s[sn].name[l + 2] = 0;
+                    }
+                    s[sn++].d = 1;
+                }
+            } break;
+            case PLAMBDA_STACKOP_VMERGE:
+            case PLAMBDA_STACKOP_VMERGE3: {
+                int m = t->index == PLAMBDA_STACKOP_VMERGE ? 2 : 3;
+                struct glsl_value* x = s + sn - m;
+                int d = 0;
+                for (int k = 0; k < m; k++)
+                    d += x[k].d;
+                glsl_printf(w, "    %s v%d = %s(", glsl_type(d), nv, glsl_type(d));
+                for (int k = 0; k < m; k++)
+                    glsl_printf(w, "%s%s", k ? ", " : "", x[k].name);
+                glsl_printf(w, ");\n");
+                sn -= m;
+                snprintf(s[sn].name, sizeof s[sn].name, "v%d", nv);
+                s[sn++].d = d;
+            } break;
+            }
+            nv++;
+            continue;
+        case PLAMBDA_VARDEF: {
+            int r = abs(t->index);
+            if (t->index > 0)
+                reg[r] = s[--sn];
+            else
+                s[sn++] = reg[r];
+        }
+            continue;
+        default:
+            return 0;
+        }
+        sn++;
+        nv++;
+    }
+
+    struct glsl_value* r = s + sn - 1;
+    glsl_printf(w, "    out_color = vec4(%s", r->name);
+    for (int k = r->d; k < 4; k++)
+        glsl_printf(w, ", 0.0");
+    glsl_printf(w, ");\n}\n");
+    return c->opd;
+}
+
+// sub-expressions {{{1
+// edits of the same inputs often share the beginning of their programs (x y - and x y - fabs),
+// so that the result of a prefix computed by one edit can be reused by the others (see editors.cpp)
+
+// returns the stack depth after the token, or -1 if it depends on the inputs
+static int prefix_stack_depth(struct plambda_token* t, int sn)
+{
+    switch (t->type) {
+    case PLAMBDA_OPERATOR: {
+        struct predefined_function* f = global_table_of_predefined_functions + t->index;
+        if (f->nargs < 0 || sn < f->nargs)
+            return -1;
+        return sn + 1 - f->nargs;
+    }
+    case PLAMBDA_STACKOP:
+        switch (t->index) {
+        case PLAMBDA_STACKOP_DEL:
+            return sn >= 1 ? sn - 1 : -1;
+        case PLAMBDA_STACKOP_DUP:
+            return sn >= 1 ? sn + 1 : -1;
+        case PLAMBDA_STACKOP_ROT:
+            return sn >= 2 ? sn : -1;
+        case PLAMBDA_STACKOP_VMERGE:
+            return sn >= 2 ? sn - 1 : -1;
+        case PLAMBDA_STACKOP_VMERGE3:
+            return sn >= 3 ? sn - 2 : -1;
+        default:
+            return -1;
+        }
+    case PLAMBDA_VARDEF:
+        // the registers would have to be passed from the prefix to the rest
+        return -1;
+    default:
+        return sn + 1;
+    }
+}
+
+static int token_is_variable(struct plambda_token* t)
+{
+    return t->type == PLAMBDA_SCALAR || t->type == PLAMBDA_VECTOR
+        || t->type == PLAMBDA_MAGIC || t->type == PLAMBDA_IMAGEOP;
+}
+
+// vpv interface {{{1
+
+struct plambda_compiled* plambda_compile(int n, int* pd, char* program, char** error)
+{
+    struct plambda_compiled* c = malloc(sizeof(*c));
+    struct plambda_program* p = c->p;
+    c->source = 0;
 
     if (setjmp(g_jmpbuf)) {
-        free(p);
+        free(c->source);
+        free(c);
         *error = g_error;
         return 0;
     }
@@ -47,7 +916,11 @@ float* execute_plambda(int n, float** x, int* w, int* h, int* pd,
         int maxplen = n * 20 + strlen(program) + 100;
         char newprogram[maxplen];
         add_hidden_variables(newprogram, maxplen, n, program);
+        collection_of_varnames_end(p->var);
         plambda_compile_program(p, newprogram);
+        c->source = strdup(newprogram);
+    } else {
+        c->source = strdup(program);
     }
 
     if (n != p->var->n && !(n == 1 && p->var->n == 0))
@@ -56,14 +929,181 @@ float* execute_plambda(int n, float** x, int* w, int* h, int* pd,
             p->var->n, n);
 
     //print_compiled_program(p);
-    int pdreal = eval_dim(p, x, pd);
+    c->blockable = pd && block_plan(c, n, pd);
+    c->block = c->blockable;
+    return c;
+}
+
+int plambda_output_dim(struct plambda_compiled* c, float** x, int* pd, char** error)
+{
+    if (setjmp(g_jmpbuf)) {
+        *error = g_error;
+        return 0;
+    }
+
+    // this also initializes the lazy global settings (getpixel operator, smart parameters)
+    // before any parallel evaluation
+    return eval_dim(c->p, x, pd);
+}
+
+int plambda_is_parallelizable(struct plambda_compiled* c)
+{
+    struct plambda_program* p = c->p;
+    for (int i = 0; i < p->n; i++) {
+        struct plambda_token* t = p->t + i;
+        // magic variables fill a global cache of image statistics
+        if (t->type == PLAMBDA_MAGIC)
+            return 0;
+        // random generators share a global state, and the result would depend on the scheduling
+        if (t->type == PLAMBDA_OPERATOR) {
+            struct predefined_function* f = global_table_of_predefined_functions + t->index;
+            if (!strncmp(f->name, "rand", 4))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+int plambda_set_block_evaluation(struct plambda_compiled* c, int enable)
+{
+    c->block = enable && c->blockable;
+    return c->block;
+}
+
+int plambda_run_region(struct plambda_compiled* c, float* out, int opd,
+    float** x, int* w, int* h, int* pd, int x0, int y0, int step, int ow, int j0, int j1,
+    char** error)
+{
+    if (setjmp(g_jmpbuf)) {
+        *error = g_error;
+        return 0;
+    }
+
+    if (c->block && c->opd == opd) {
+        run_region_by_blocks(c, out, x, w, h, pd, x0, y0, step, ow, j0, j1);
+        return 1;
+    }
+
+    for (int j = j0; j < j1; j++) {
+        for (int i = 0; i < ow; i++) {
+            float result[opd];
+            int r = run_program_vectorially_at(result, c->p, x, w, h, pd, x0 + i * step, y0 + j * step);
+            if (r != opd)
+                fail("r != pdmax");
+            float* o = out + ((size_t)j * ow + i) * opd;
+            for (int l = 0; l < r; l++)
+                o[l] = result[l];
+        }
+    }
+    return 1;
+}
+
+int plambda_run_rows(struct plambda_compiled* c, float* out, int opd,
+    float** x, int* w, int* h, int* pd, int y0, int y1, char** error)
+{
+    return plambda_run_region(c, out, opd, x, w, h, pd, 0, 0, 1, *w, y0, y1, error);
+}
+
+int plambda_to_glsl(struct plambda_compiled* c, int n, int* pd, char* buf, int size)
+{
+    struct glsl_writer w = { buf, size, 0 };
+    int opd = glsl_translate(c, n, pd, &w);
+    if (!opd || w.len >= size)
+        return 0;
+    return opd;
+}
+
+int plambda_canonical_text(struct plambda_compiled* c, char* buf, int size)
+{
+    struct plambda_program* p = c->p;
+    // the names must sort like the inputs
+    if (p->var->n > 100)
+        return 0;
+
+    const char* spacing = " \n\t_";
+    const char* s = c->source;
+    int len = 0;
+    for (int i = 0; i < p->n; i++) {
+        s += strspn(s, spacing);
+        int toklen = strcspn(s, spacing);
+        if (!toklen)
+            return 0;
+        char tok[toklen + 1];
+        memcpy(tok, s, toklen);
+        tok[toklen] = '\0';
+        s += toklen;
+
+        struct plambda_token* t = p->t + i;
+        char name[16] = "";
+        const char* modifiers = tok;
+        if (token_is_variable(t)) {
+            const char* end;
+            token_is_word(tok, &end);
+            snprintf(name, sizeof(name), "hidden%02d", t->index);
+            modifiers = end ? end : "";
+        }
+        len += snprintf(buf + len, size > len ? size - len : 0, "%s%s%s", i ? " " : "", name, modifiers);
+    }
+    // the source is split like plambda_compile_program does, check that it has no other token
+    s += strspn(s, spacing);
+    if (*s || len >= size)
+        return 0;
+    return p->n;
+}
+
+int plambda_prefixes(struct plambda_compiled* c, int* ends, int max)
+{
+    struct plambda_program* p = c->p;
+    int found[PLAMBDA_MAX_TOKENS];
+    int nfound = 0;
+    int sn = 0;
+    int operators = 0;
+    for (int i = 0; i < p->n - 1; i++) {
+        struct plambda_token* t = p->t + i;
+        sn = prefix_stack_depth(t, sn);
+        if (sn < 0)
+            break;
+        if (!token_is_variable(t) && t->type != PLAMBDA_CONSTANT && t->type != PLAMBDA_COLONVAR)
+            operators++;
+        if (sn == 1 && operators)
+            found[nfound++] = i + 1;
+    }
+
+    int k = 0;
+    for (int i = nfound - 1; i >= 0 && k < max; i--)
+        ends[k++] = found[i];
+    return k;
+}
+
+void plambda_free(struct plambda_compiled* c)
+{
+    collection_of_varnames_end(c->p->var);
+    free(c->source);
+    free(c);
+}
+
+float* execute_plambda(int n, float** x, int* w, int* h, int* pd,
+    char* program, int* opd, char** error)
+{
+    struct plambda_compiled* c = plambda_compile(n, pd, program, error);
+    if (!c)
+        return 0;
+
+    int pdreal = plambda_output_dim(c, x, pd, error);
+    if (!pdreal) {
+        plambda_free(c);
+        return 0;
+    }
 
     float* out = xmalloc(*w * *h * pdreal * sizeof *out);
-    *opd = run_program_vectorially(out, pdreal, p, x, w, h, pd);
-    assert(*opd == pdreal);
+    if (!plambda_run_rows(c, out, pdreal, x, w, h, pd, 0, *h, error)) {
+        free(out);
+        plambda_free(c);
+        return 0;
+    }
+    *opd = pdreal;
 
-    collection_of_varnames_end(p->var);
-    free(p);
+    plambda_free(c);
     return out;
 }
 
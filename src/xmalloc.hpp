@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+// malloc which exits instead of returning null, like the xmalloc of imscript
+// (the pixels given to an Image are released with free)
+inline void* xmalloc(size_t size)
+{
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        fprintf(stderr, "xmalloc: out of memory when requesting %zu bytes (%gMB)\n", size, size / (0x100000 * 1.0));
+        exit(1);
+    }
+    return p;
+}